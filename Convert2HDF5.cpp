@@ -3,7 +3,7 @@
  * Permission to use, copy, modify, and/or distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
  * copyright notice and this permission notice appear in all copies.
- * 
+ *
  * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
  * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
  * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
@@ -12,33 +12,58 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
 /** \file
- * A quick and easy example program to extract the header of a GADGET file into ASCII*/
+ * An example program to convert a Gadget snapshot to HDF5.
+ * The conversion is streamed in chunks; see gadgetconvert.hpp.*/
 
 #include "gadgetreader.hpp"
 #include "gadgetwriter.hpp"
+#include "gadgetconvert.hpp"
 #include <iostream>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "type_map.h"
 
 using namespace GadgetReader;
 using namespace GadgetWriter;
+using namespace GadgetConvert;
 using namespace std;
 
 int main(int argc, char* argv[]){
      int verbose=0;
+     int64_t chunk_part = 1<<20;
+     int nreaders = 4, queue_len = 4;
      gadget_header head;
-     if(argc<2){
-            fprintf(stderr,"Usage: ./Convert2HDF5 filename. Will output filename.hdf5\n");
+     int c;
+     while((c = getopt(argc, argv, "vc:j:q:h")) !=-1){
+        switch(c){
+            case 'v':
+                verbose=1;
+                break;
+            case 'c':
+                chunk_part = atol(optarg);
+                break;
+            case 'j':
+                nreaders = atoi(optarg);
+                break;
+            case 'q':
+                queue_len = atoi(optarg);
+                break;
+            case 'h':
+            default:
+                optind = argc;
+                break;
+        }
+     }
+     if(optind >= argc || chunk_part < 1 || nreaders < 1 || queue_len < 1){
+            fprintf(stderr,"Usage: ./Convert2HDF5 [-v] [-c particles per chunk] [-j blocks read at once] [-q chunks queued] filename. Will output filename.hdf5\n");
             exit(1);
      }
 
-     if(argc >2) verbose=1;
-     
-     string filename(argv[1]);
+     string filename(argv[optind]);
      string outfile = filename +".hdf5";
      GSnap snap(filename);
      if(snap.GetNumFiles() < 1){
@@ -50,31 +75,18 @@ int main(int argc, char* argv[]){
      std::valarray<int64_t> npart(N_TYPE);
      for (int i=0; i<N_TYPE; i++)
          npart[i] = snap.GetNpart(i);
+     /*Initialise the map*/
+     init_map();
+     /*Work out what to convert: one job per type present in each block*/
+     vector<convert_job> jobs = plan_jobs(snap, &type_map);
+     vector<GadgetWriter::block_info> out_blocks = output_blocks(jobs);
+     int idsize = snap.IsBlock("ID  ") ? snap.GetPartLen("ID  ") : sizeof(int64_t);
      try {
-        GWriteSnap hdf5snap(outfile, npart, snap.GetNumFiles());
+        GWriteSnap hdf5snap(outfile, npart, snap.GetNumFiles(), idsize, true, true, &out_blocks);
         hdf5snap.WriteHeaders(head);
-        /*Now write some data types*/
-        /*Initialise the map*/
-        init_map();
-        set<string> blocks=snap.GetBlocks();
-        set<string>::iterator it;
-        for(int i = 0; i < N_TYPE; i++){
-            if(snap.GetNpart(i) == 0)
-                continue;
-            for(it=blocks.begin() ; it != blocks.end(); it++){
-                /*Default to float, except when we have IDs*/
-                void * blockdata;
-                if(*it == "ID  ")
-                    blockdata = malloc(sizeof(int64_t)*snap.GetBlockSize(*it,i));
-                else
-                   blockdata =malloc(sizeof(float)*snap.GetBlockSize(*it,i));
-                snap.GetBlock(*it,blockdata,snap.GetNpart(i),0,0);
-                if(verbose)
-                    cout<<"Converting type "<<i<<" block "<<*it<<" to "<<type_map[*it]<<endl;
-                hdf5snap.WriteBlocks(type_map[*it], i, blockdata, snap.GetNpart(i), 0);
-                free(blockdata);
-            }
-        }
+        return run_pipeline(snap, jobs, [&](const convert_job& job, void * data, int64_t np, int64_t begin) {
+                    return hdf5snap.WriteBlocks(job.out_name, job.type, data, np, begin);
+                }, chunk_part, nreaders, queue_len, verbose);
      }
      catch(const std::ios_base::failure& e) {
          cerr<<e.what();
@@ -82,5 +94,3 @@ int main(int argc, char* argv[]){
      }
      return 0;
 }
-
-
@@ -87,11 +87,13 @@ int main(int argc, char* argv[]){
              return 1;
      }
 
+     /*Each type reuses the buffer of the one before, if it is big enough*/
+     GBufferPool pool;
      for(int type=0; type<N_TYPE; type++){ 
            if(snap.GetNpart(type) < 1)
                continue;
            FILE* output;
-           float * data=(float *) malloc(snap.GetBlockSize(block,type));
+           float * data=(float *) pool.Allocate(snap.GetBlockSize(block,type));
            if(!data){
                fprintf(stderr,"Error allocating memory for type %d\n",type);
                exit(1);
@@ -107,7 +109,7 @@ int main(int argc, char* argv[]){
                 fwrite(data,sizeof(float),snap.GetBlockSize(block,type)/sizeof(float),output);
                 fclose(output);
            }
-           free(data);
+           pool.Release(data);
      }
      return 0;
 }
@@ -17,6 +17,11 @@
  * Test suite using boost::test*/
 #define BOOST_TEST_MODULE GadgetReader
 #include "gadgetreader.hpp"
+#include "gadgetseries.hpp"
+#include "gadgetcatalogue.hpp"
+#include "gadgetmapreduce.hpp"
+#include "gadgetsort.hpp"
+#include "crc32c.h"
 #include <boost/test/unit_test.hpp>
 #include <boost/test/test_tools.hpp>
 #include <cmath>
@@ -147,3 +152,530 @@ BOOST_AUTO_TEST_CASE(get_blocks)
         FLOATS_NEAR_TO(block[10],0.00821469352);
         free(block);
 }
+
+//Check the typed reads convert correctly
+BOOST_AUTO_TEST_CASE(typed_reads)
+{
+        GSnap snap("test_g2_snap",false);
+        BOOST_CHECK_EQUAL(snap.GetBlockDType("POS "),'f');
+        BOOST_CHECK_EQUAL(snap.GetBlockDType("ID  "),'i');
+        BOOST_CHECK_EQUAL(snap.GetBlockComponents("POS "),3);
+        BOOST_CHECK_EQUAL(snap.GetBlockComponents("MASS"),1);
+        std::vector<float> pos(3*8192);
+        std::vector<double> dpos(3*8192);
+        BOOST_CHECK_EQUAL((snap.ReadBlock<float,3>("POS ",&pos[0],8192,0,0)),8192);
+        BOOST_CHECK_EQUAL((snap.ReadBlock<double,3>("POS ",&dpos[0],8192,0,0)),8192);
+        FLOATS_NEAR_TO(dpos[300],568.540833);
+        BOOST_CHECK_EQUAL(dpos[3*8192-1],pos[3*8192-1]);
+        //Wrong number of components reads nothing
+        BOOST_CHECK_EQUAL((snap.ReadBlock<float,1>("POS ",&pos[0],1,0,0)),0);
+        //IDs widened to 64 bits, reading only the stars
+        std::vector<int32_t> id(57);
+        std::vector<int64_t> lid(57);
+        int skip = (1<<N_TYPE)-1-(1<<STARS_TYPE);
+        BOOST_CHECK_EQUAL((snap.ReadBlock<int32_t,1>("ID  ",&id[0],57,0,skip)),57);
+        BOOST_CHECK_EQUAL((snap.ReadBlock<int64_t,1>("ID  ",&lid[0],57,0,skip)),57);
+        BOOST_CHECK_EQUAL(id[56],lid[56]);
+        BOOST_CHECK_EQUAL(snap.GetBlockInt("ID  ",57,0,skip)[10],lid[10]);
+        //A negative count reads nothing, with or without conversion
+        BOOST_CHECK_EQUAL((snap.ReadBlock<double,3>("POS ",&dpos[0],-1,0,0)),0);
+        BOOST_CHECK_EQUAL((snap.ReadBlock<float,3>("POS ",&pos[0],-1,0,0)),0);
+        BOOST_CHECK_EQUAL(snap.GetBlock("POS ",&pos[0],-1,0,0),0);
+}
+
+BOOST_AUTO_TEST_CASE(load_blocks)
+{
+        GSnap snap("test_g2_snap",false);
+        std::vector<std::string> names;
+        names.push_back("POS ");
+        names.push_back("ID  ");
+        names.push_back("NOPE");
+        GSnapData data;
+        BOOST_CHECK_EQUAL(snap.Load(names,(1<<N_TYPE)-1,data),0);
+        BOOST_REQUIRE(data.GetBlock("POS "));
+        BOOST_CHECK(!data.GetBlock("NOPE"));
+        BOOST_CHECK_EQUAL(data.GetBlock("POS ")->npart,8192);
+        std::vector<float> pos(3*8192);
+        snap.GetBlock("POS ",&pos[0],8192,0,0);
+        BOOST_CHECK_EQUAL(data.Get<float>("POS ")[300],pos[300]);
+        BOOST_CHECK_EQUAL(data.Get<float>("POS ")[3*8192-1],pos[3*8192-1]);
+        BOOST_CHECK(!data.Get<double>("POS "));
+        //Stars only
+        BOOST_CHECK_EQUAL(snap.Load(names,1<<STARS_TYPE,data),0);
+        BOOST_CHECK_EQUAL(data.GetBlock("ID  ")->npart,57);
+        int skip = (1<<N_TYPE)-1-(1<<STARS_TYPE);
+        BOOST_CHECK_EQUAL(data.Get<int32_t>("ID  ")[10],snap.GetBlockInt("ID  ",57,0,skip)[10]);
+}
+
+BOOST_AUTO_TEST_CASE(buffer_pool)
+{
+        GSnap snap("test_g2_snap",false);
+        GBufferPool pool;
+        std::vector<float> pos = snap.GetBlock("POS ",8192,0,0);
+        {
+                pool_vector<float> ppos = snap.GetBlock("POS ",8192,0,0,pool);
+                BOOST_REQUIRE_EQUAL(ppos.size(),pos.size());
+                BOOST_CHECK_EQUAL(ppos[3*8192-1],pos[3*8192-1]);
+        }
+        //The next snapshot of the same size reuses the buffer
+        BOOST_CHECK(pool.GetCachedBytes() >= 3*8192*sizeof(float));
+        pool_vector<float> again = snap.GetBlock("POS ",8192,0,0,pool);
+        BOOST_CHECK_EQUAL(pool.GetReused(),1);
+        BOOST_CHECK_EQUAL(pool.GetAllocated(),1);
+        //Loads share the pool too
+        GSnapData data(&pool);
+        std::vector<std::string> names(1,"VEL ");
+        BOOST_CHECK_EQUAL(snap.Load(names,(1<<N_TYPE)-1,data),0);
+        BOOST_CHECK_EQUAL(pool.GetAllocated(),2);
+        BOOST_CHECK_EQUAL(snap.Load(names,(1<<N_TYPE)-1,data),0);
+        BOOST_CHECK_EQUAL(pool.GetAllocated(),2);
+        BOOST_CHECK_EQUAL(data.Get<float>("VEL ")[5],snap.GetBlock("VEL ",2,0,0)[5]);
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_series)
+{
+        GSnap snap("test_g2_snap",false);
+        std::vector<float> pos = snap.GetBlock("POS ",8192,0,0);
+        std::vector<std::string> names(1,"POS ");
+        //Conversions which would read a missing argument are rejected
+        GSnapSeries bad("snap_%s_%03d",3,5,names,(1<<N_TYPE)-1,false);
+        BOOST_CHECK(!bad.Next());
+        //With no conversions in the pattern, every index is the same snapshot
+        GSnapSeries series("test_g2_snap",3,5,names,(1<<N_TYPE)-1,false);
+        BOOST_CHECK_EQUAL(series.GetFilename(4),"test_g2_snap");
+        int count = 0;
+        while(series.Next()){
+                BOOST_CHECK_EQUAL(series.GetIndex(),3+count);
+                BOOST_CHECK_EQUAL(series.GetStatus(),0);
+                BOOST_CHECK_EQUAL(series.GetSnap().GetNumFiles(),2);
+                BOOST_CHECK_EQUAL(series.GetData().GetBlock("POS ")->npart,8192);
+                BOOST_CHECK_EQUAL(series.GetData().Get<float>("POS ")[3*8192-1],pos[3*8192-1]);
+                count++;
+        }
+        BOOST_CHECK_EQUAL(count,3);
+        //Copied block maps are the same as scanned ones
+        GSnap copy("test_g2_snap",snap,false);
+        BOOST_CHECK(copy.GetBlocks() == snap.GetBlocks());
+        BOOST_CHECK_EQUAL(copy.GetBlockSize("VEL ",1),snap.GetBlockSize("VEL ",1));
+        GSnapSeries none("not_a_snapshot_%03d",0,0,names,(1<<N_TYPE)-1,false);
+        BOOST_CHECK(none.Next());
+        BOOST_CHECK_EQUAL(none.GetStatus(),1);
+        BOOST_CHECK(!none.Next());
+}
+
+BOOST_AUTO_TEST_CASE(header_catalogue)
+{
+        GSnap snap("test_g2_snap",false);
+        gadget_header head;
+        BOOST_CHECK_EQUAL(ReadHeader("test_g2_snap.1",head),0);
+        BOOST_CHECK_EQUAL(ReadHeader("should_not_exist_at_all_file",head),1);
+        BOOST_CHECK_EQUAL(head.npart[0],snap.GetHeader(1).npart[0]);
+        BOOST_CHECK(CheckHeaders(head,snap.GetHeader(0)));
+        GHeaderCatalogue cat(false);
+        std::vector<std::string> snaps;
+        snaps.push_back("test_g2_snap");
+        snaps.push_back("should_not_exist_at_all_file");
+        BOOST_CHECK_EQUAL(cat.Build(snaps,4),1);
+        BOOST_REQUIRE_EQUAL(cat.GetEntries().size(),3);
+        BOOST_CHECK_EQUAL(cat.GetEntries()[1].file,"test_g2_snap.1");
+        BOOST_CHECK_EQUAL(cat.GetEntries()[1].status,0);
+        BOOST_CHECK_EQUAL(cat.GetEntries()[2].status,1);
+        BOOST_REQUIRE(cat.Find("test_g2_snap.0"));
+        BOOST_CHECK_EQUAL(cat.Find("test_g2_snap.0")->header.redshift,snap.GetHeader().redshift);
+        //Round trip through the binary form
+        BOOST_CHECK_EQUAL(cat.Write("btest_catalogue.tmp"),0);
+        GHeaderCatalogue cat2(false);
+        BOOST_CHECK_EQUAL(cat2.Read("btest_catalogue.tmp"),0);
+        remove("btest_catalogue.tmp");
+        BOOST_REQUIRE_EQUAL(cat2.GetEntries().size(),3);
+        BOOST_CHECK_EQUAL(cat2.Find("test_g2_snap.1")->header.npart[1],head.npart[1]);
+        BOOST_CHECK_EQUAL(cat2.Read("test_g2_snap.0"),1);
+}
+
+BOOST_AUTO_TEST_CASE(checksums)
+{
+        BOOST_CHECK_EQUAL(crc32c(0,"123456789",9),0xe3069283u);
+        //Large enough for the interleaved hardware path, and joined from pieces
+        std::vector<unsigned char> buf(100000);
+        for(size_t i = 0; i < buf.size(); i++)
+                buf[i] = i*i % 251;
+        uint32_t whole = crc32c(0,&buf[0],buf.size());
+        BOOST_CHECK_EQUAL(crc32c(crc32c(0,&buf[0],777),&buf[777],buf.size()-777),whole);
+        BOOST_CHECK_EQUAL(crc32c_combine(crc32c(0,&buf[0],50000),crc32c(0,&buf[50000],50000),50000),whole);
+        crc32c_pieces pieces;
+        uint32_t crc = 0;
+        pieces.add(60000,&buf[60000],40000);
+        BOOST_CHECK(!pieces.get(buf.size(),crc));
+        pieces.add(0,&buf[0],60000);
+        BOOST_CHECK(pieces.get(buf.size(),crc));
+        BOOST_CHECK_EQUAL(crc,whole);
+        //No sidecar
+        GSnap snap("test_g2_snap",false);
+        BOOST_CHECK_EQUAL(snap.Verify(),2);
+        //Write one for the IDs of the first file, as GWriteFile would
+        std::vector<block_segment> segs;
+        for(int j = 0; j < N_TYPE; j++){
+                std::vector<block_segment> s = snap.GetBlockSegments("ID  ",j);
+                for(size_t k = 0; k < s.size(); k++)
+                        if(s[k].file == 0)
+                                segs.push_back(s[k]);
+        }
+        BOOST_REQUIRE(segs.size() > 0);
+        const int64_t bytes = (segs.back().offset + segs.back().npart*snap.GetPartLen("ID  ")) - segs[0].offset;
+        std::vector<char> ids(bytes);
+        FILE * fd = fopen("test_g2_snap.0","rb");
+        BOOST_REQUIRE(fd);
+        BOOST_REQUIRE(fseek(fd,segs[0].offset,SEEK_SET) == 0 && fread(&ids[0],1,bytes,fd) == (size_t) bytes);
+        fclose(fd);
+        crc = crc32c(0,&ids[0],bytes);
+        fd = fopen("test_g2_snap.0.crc32c","w");
+        fprintf(fd,"%08x %ld ID  \n",crc,bytes);
+        fclose(fd);
+        BOOST_CHECK_EQUAL(snap.Verify(),0);
+        fd = fopen("test_g2_snap.0.crc32c","w");
+        fprintf(fd,"%08x %ld ID  \n",crc^1,bytes);
+        fclose(fd);
+        BOOST_CHECK_EQUAL(snap.Verify(1),1);
+        remove("test_g2_snap.0.crc32c");
+}
+
+BOOST_AUTO_TEST_CASE(block_handles)
+{
+        GSnap snap("test_g2_snap",false);
+        BOOST_CHECK_EQUAL(block_key_name(make_block_key("POS ")),"POS ");
+        BOOST_CHECK_EQUAL(block_key_name(make_block_key("ID")),"ID");
+        BOOST_CHECK(make_block_key("ID") != make_block_key("ID  "));
+        //Keys sort as names do
+        BOOST_CHECK(make_block_key("MASS") < make_block_key("POS "));
+        block_handle pos = GSnap::GetBlockHandle("POS ");
+        BOOST_CHECK(snap.IsBlock(pos));
+        BOOST_CHECK(!snap.IsBlock(GSnap::GetBlockHandle("POSITIONS")));
+        BOOST_CHECK_EQUAL(snap.GetBlockSize(pos,1),snap.GetBlockSize("POS ",1));
+        BOOST_CHECK_EQUAL(snap.GetPartLen(pos),12);
+        BOOST_CHECK_EQUAL(snap.GetBlockTypes(pos),snap.GetBlockTypes("POS "));
+        std::vector<float> all = snap.GetBlock("POS ",8192,0,0);
+        std::vector<float> some(3*100);
+        BOOST_CHECK_EQUAL(snap.GetBlock(pos,&some[0],100,5000,0),100);
+        BOOST_CHECK_EQUAL(some[3*99+2],all[3*5099+2]);
+        std::vector<double> dpos(3*100);
+        BOOST_CHECK_EQUAL((snap.ReadBlock<double,3>(pos,&dpos[0],100,5000,0)),100);
+        BOOST_CHECK_EQUAL((float) dpos[7],all[3*5000+7]);
+}
+
+BOOST_AUTO_TEST_CASE(page_cache)
+{
+        GSnap snap("test_g2_snap",false);
+        std::vector<float> all = snap.GetBlock("POS ",8192,0,0);
+        GPageCache cache(1<<20, 64<<10);
+        snap.SetPageCache(&cache);
+        //Small reads of nearby particles, which should mostly hit the cache
+        std::vector<float> some(3*16);
+        for(int i = 0; i < 8192; i += 100){
+                int64_t n = std::min(16, 8192-i);
+                BOOST_REQUIRE_EQUAL(snap.GetBlock("POS ",&some[0],n,i,0),n);
+                BOOST_CHECK_EQUAL(some[0],all[3*i]);
+                BOOST_CHECK_EQUAL(some[3*n-1],all[3*(i+n)-1]);
+        }
+        BOOST_CHECK(cache.GetHits() > cache.GetMisses());
+        BOOST_CHECK(cache.GetCachedBytes() > 0 && cache.GetCachedBytes() <= 1<<20);
+        //Large reads bypass the cache but give the same answer
+        std::vector<float> again = snap.GetBlock("POS ",8192,0,0);
+        BOOST_CHECK(again == all);
+        cache.Clear();
+        BOOST_CHECK_EQUAL(cache.GetCachedBytes(),0);
+        //One open file at a time: the two files of the snapshot take turns, and still read correctly
+        GPageCache onefile(1<<20, 64<<10, 1);
+        snap.SetPageCache(&onefile);
+        for(int i = 0; i < 4; i++){
+                const int64_t part = (i % 2) ? 8192-16 : 0;
+                BOOST_REQUIRE_EQUAL(snap.GetBlock("POS ",&some[0],16,part,0),16);
+                BOOST_CHECK_EQUAL(some[3*15+2],all[3*(part+15)+2]);
+        }
+        //Clearing while other threads read must not hand them another file's pages
+        std::vector<std::thread> readers;
+        std::vector<int> bad(4, 0);
+        for(int t = 0; t < 4; t++)
+                readers.push_back(std::thread([&snap, &all, &bad, t]{
+                        std::vector<float> mine(3*16);
+                        for(int i = t; i < 8192-16; i += 37)
+                                if(snap.GetBlock("POS ",&mine[0],16,i,0) != 16 || mine[3*15] != all[3*(i+15)])
+                                        bad[t]++;
+                }));
+        for(int i = 0; i < 100; i++)
+                onefile.Clear();
+        for(int t = 0; t < 4; t++){
+                readers[t].join();
+                BOOST_CHECK_EQUAL(bad[t],0);
+        }
+}
+
+BOOST_AUTO_TEST_CASE(derived_quantities)
+{
+        GSnap snap("test_g2_snap",false);
+        const int64_t ngas = snap.GetNpart(BARYON_TYPE);
+        std::vector<float> u = snap.GetBlock("U   ",ngas,0,0);
+        std::vector<float> nhp = snap.GetBlock("NHP ",ngas,0,0);
+        std::vector<float> nhep = snap.GetBlock("NHEP",ngas,0,0);
+        std::vector<float> nheq = snap.GetBlock("NHEQ",ngas,0,0);
+        std::vector<float> rho = snap.GetBlock("RHO ",ngas,0,0);
+        //Must agree with a straightforward calculation from the input blocks
+        std::vector<float> temp = snap.ReadDerived("Temperature",0,4);
+        BOOST_REQUIRE_EQUAL(temp.size(),(size_t) ngas);
+        const double X = 0.76;
+        for(int64_t i = 0; i < ngas; i += 97){
+                double ne = nhp[i]+nhep[i]+2*nheq[i];
+                double t = 2./3*u[i]*1e10*4*1.67262178e-24/1.38066e-16/(1+3*X+4*X*ne);
+                BOOST_CHECK_CLOSE(temp[i],t,1e-3);
+        }
+        //Part of the particles, with the units of the test snapshot
+        std::vector<float> dens(100);
+        BOOST_REQUIRE_EQUAL(snap.ReadDerived("Density",&dens[0],100,1000,0,2),100);
+        gadget_header head = snap.GetHeader(0);
+        double scale = 1.989e43/pow(3.085678e21,3)*head.HubbleParam*head.HubbleParam/pow(head.time,3);
+        BOOST_CHECK_CLOSE(dens[0],rho[1000]*scale,1e-3);
+        BOOST_CHECK_CLOSE(dens[99],rho[1099]*scale,1e-3);
+        BOOST_CHECK(snap.ReadDerived("Entropy",0).empty());
+}
+
+BOOST_AUTO_TEST_CASE(filtered_reads)
+{
+        GSnap snap("test_g2_snap",false);
+        const int64_t ngas = snap.GetNpart(BARYON_TYPE);
+        const int skip = (1<<N_TYPE)-1-(1<<BARYON_TYPE);
+        std::vector<float> rho = snap.GetBlock("RHO ",ngas,0,skip);
+        std::vector<float> u = snap.GetBlock("U   ",ngas,0,skip);
+        std::vector<float> pos = snap.GetBlock("POS ",ngas,0,skip);
+        std::vector<float> sorted(rho);
+        std::sort(sorted.begin(),sorted.end());
+        const double cut = sorted[9*ngas/10];
+        //Dense and hot
+        std::vector<block_predicate> preds;
+        preds.push_back(block_predicate{"RHO ",cut,INFINITY});
+        preds.push_back(block_predicate{"U   ",100,INFINITY});
+        std::vector<int64_t> index;
+        BOOST_REQUIRE_EQUAL(snap.Select(preds,BARYON_TYPE,index),0);
+        std::vector<int64_t> want;
+        for(int64_t i = 0; i < ngas; i++)
+                if(rho[i] >= cut && u[i] >= 100)
+                        want.push_back(i);
+        BOOST_REQUIRE(want.size() > 0);
+        BOOST_CHECK(index == want);
+        std::vector<float> sel(3*index.size());
+        BOOST_REQUIRE_EQUAL(snap.ReadSelected("POS ",BARYON_TYPE,index,&sel[0]),(int64_t) index.size());
+        for(size_t i = 0; i < index.size(); i++)
+                BOOST_CHECK_EQUAL(sel[3*i+2],pos[3*index[i]+2]);
+        //Zone maps skip chunks, but do not change the result
+        std::vector<std::string> names(1,"RHO ");
+        BOOST_REQUIRE_EQUAL(snap.WriteZoneMaps(names,64),0);
+        //Mapping another block later keeps the maps of the first
+        BOOST_REQUIRE_EQUAL(snap.WriteZoneMaps(std::vector<std::string>(1,"U   "),64),0);
+        int64_t skipped = 0;
+        preds.resize(1);
+        preds[0].min = sorted.back();
+        BOOST_REQUIRE_EQUAL(snap.Select(preds,BARYON_TYPE,index,&skipped),0);
+        BOOST_CHECK(skipped > ngas/2);
+        BOOST_REQUIRE(index.size() >= 1);
+        BOOST_CHECK_EQUAL(rho[index[0]],sorted.back());
+        for(int i = 0; i < snap.GetNumFiles(); i++)
+                remove((snap.GetFileName(i)+".zones").c_str());
+        BOOST_CHECK_EQUAL(snap.ReadSelected("POS ",BARYON_TYPE,std::vector<int64_t>(1,ngas),&sel[0]),0);
+}
+
+BOOST_AUTO_TEST_CASE(map_reduce)
+{
+        GSnap snap("test_g2_snap",false);
+        //Count the particles of each type, with small chunks so several threads have work
+        std::vector<std::string> names(1,"POS ");
+        GMapReduce<float> mr(snap,names,(1<<N_TYPE)-1,3,500);
+        std::vector<int64_t> counts(N_TYPE,0);
+        BOOST_REQUIRE_EQUAL(mr.Run(counts,[](const particle_chunk<float>& c, std::vector<int64_t>& n){ n[c.type] += c.npart; },
+                        [](std::vector<int64_t>& into, const std::vector<int64_t>& from){
+                                for(int j = 0; j < N_TYPE; j++)
+                                        into[j] += from[j];
+                        }),0);
+        for(int j = 0; j < N_TYPE; j++)
+                BOOST_CHECK_EQUAL(counts[j],snap.GetNpart(j,true));
+        //The density grid holds all the mass, and is the same every time
+        std::vector<double> grid, again;
+        BOOST_REQUIRE_EQUAL(CICDensity(snap,16,grid,1<<BARYON_TYPE,3,false),0);
+        BOOST_REQUIRE_EQUAL(CICDensity(snap,16,again,1<<BARYON_TYPE,3),0);
+        BOOST_CHECK(grid == again);
+        std::vector<float> mass = snap.GetBlock("MASS",snap.GetNpart(BARYON_TYPE),0,(1<<N_TYPE)-1-(1<<BARYON_TYPE));
+        double total = 0, gridded = 0;
+        for(size_t i = 0; i < mass.size(); i++)
+                total += mass[i];
+        const double cell = snap.GetHeader(0).BoxSize/16;
+        for(size_t i = 0; i < grid.size(); i++)
+                gridded += grid[i]*cell*cell*cell;
+        BOOST_CHECK_CLOSE(gridded,total,1e-6);
+}
+
+BOOST_AUTO_TEST_CASE(subsampled_reads)
+{
+        GSnap snap("test_g2_snap",false);
+        //Positions of gas and dark matter, which are in two files
+        const int skip = (1<<N_TYPE)-1-(1<<BARYON_TYPE)-(1<<DM_TYPE);
+        const int64_t npart = snap.GetNpart(BARYON_TYPE)+snap.GetNpart(DM_TYPE);
+        std::vector<float> all = snap.GetBlock("POS ",npart,0,skip);
+        BOOST_REQUIRE_EQUAL(all.size(),(size_t) 3*npart);
+        //Every seventh particle, from the third
+        std::vector<float> strided(3*((npart-2+6)/7));
+        BOOST_REQUIRE_EQUAL(snap.GetBlockStrided("POS ",&strided[0],7,2,skip),(int64_t) strided.size()/3);
+        for(size_t i = 0; i < strided.size()/3; i++)
+                BOOST_CHECK_EQUAL(strided[3*i+1],all[3*(2+7*i)+1]);
+        //A random tenth, the same each time, and nested within a random half
+        const int64_t nsample = snap.GetSampleSize("POS ",0.1,42,skip);
+        BOOST_CHECK(nsample > npart/20 && nsample < npart/5);
+        std::vector<float> sample(3*nsample);
+        BOOST_REQUIRE_EQUAL(snap.GetBlockSample("POS ",&sample[0],0.1,42,skip),nsample);
+        int64_t j = 0;
+        for(int64_t i = 0; i < npart; i++)
+                if(in_sample(i,0.1,42)){
+                        BOOST_CHECK(in_sample(i,0.5,42));
+                        BOOST_CHECK_EQUAL(sample[3*j],all[3*i]);
+                        j++;
+                }
+        BOOST_CHECK_EQUAL(j,nsample);
+        //Listed particles, in any order
+        std::vector<int64_t> index;
+        index.push_back(npart-1);
+        index.push_back(0);
+        index.push_back(1);
+        std::vector<float> listed(9);
+        BOOST_REQUIRE_EQUAL(snap.GetBlockIndexed("POS ",&listed[0],index,skip),3);
+        BOOST_CHECK_EQUAL(listed[0],all[3*(npart-1)]);
+        BOOST_CHECK_EQUAL(listed[5],all[2]);
+        BOOST_CHECK_EQUAL(listed[8],all[5]);
+}
+
+BOOST_AUTO_TEST_CASE(lod_pyramid)
+{
+        GSnap snap("test_g2_snap",false);
+        std::vector<std::string> names(1,"MASS");
+        BOOST_REQUIRE_EQUAL(snap.WritePyramid(names,2,7),0);
+        const int skip = (1<<N_TYPE)-1-(1<<BARYON_TYPE);
+        const int64_t ngas = snap.GetNpart(BARYON_TYPE);
+        std::vector<float> pos = snap.GetBlock("POS ",ngas,0,skip);
+        std::vector<float> mass = snap.GetBlock("MASS",ngas,0,skip);
+        for(int level = 1; level <= 2; level++){
+                GSnap lod = GSnap::OpenLevel("test_g2_snap",level,false);
+                BOOST_REQUIRE_EQUAL(lod.GetNumFiles(),1);
+                BOOST_CHECK(!lod.IsBlock("RHO "));
+                for(int t = 0; t < N_TYPE; t++){
+                        int64_t want = 0;
+                        for(int64_t i = 0; i < snap.GetNpart(t); i++)
+                                want += in_sample(i,1.0/(1<<(3*level)),7);
+                        BOOST_CHECK_EQUAL(lod.GetNpart(t),want);
+                }
+                const int64_t nlod = lod.GetNpart(BARYON_TYPE);
+                BOOST_REQUIRE(nlod > 0);
+                std::vector<float> lpos = lod.GetBlock("POS ",nlod,0,skip);
+                std::vector<float> lmass = lod.GetBlock("MASS",nlod,0,skip);
+                BOOST_REQUIRE_EQUAL(lpos.size(),(size_t) 3*nlod);
+                int64_t j = 0;
+                for(int64_t i = 0; i < ngas && j < nlod; i++)
+                        if(in_sample(i,1.0/(1<<(3*level)),7)){
+                                BOOST_CHECK_EQUAL(lpos[3*j+2],pos[3*i+2]);
+                                BOOST_CHECK_EQUAL(lmass[j],mass[i]);
+                                j++;
+                        }
+                BOOST_CHECK_EQUAL(j,nlod);
+                remove(GSnap::GetLevelFileName("test_g2_snap",level).c_str());
+        }
+}
+
+BOOST_AUTO_TEST_CASE(component_reads)
+{
+        GSnap snap("test_g2_snap",false);
+        const int skip = (1<<N_TYPE)-1-(1<<BARYON_TYPE)-(1<<DM_TYPE);
+        const int64_t npart = snap.GetNpart(BARYON_TYPE)+snap.GetNpart(DM_TYPE);
+        std::vector<float> pos = snap.GetBlock("POS ",npart,0,skip);
+        //Just z, from the fifth particle
+        std::vector<float> z = snap.GetBlockComponent("POS ",2,npart-4,4,skip);
+        BOOST_REQUIRE_EQUAL(z.size(),(size_t) npart-4);
+        for(int64_t i = 0; i < npart-4; i++)
+                BOOST_CHECK_EQUAL(z[i],pos[3*(i+4)+2]);
+        //x and z together, converted to double
+        std::vector<double> xz(2*npart);
+        BOOST_REQUIRE_EQUAL(snap.ReadComponents<double>("POS ",&xz[0],5,npart,0,skip),npart);
+        for(int64_t i = 0; i < npart; i++){
+                BOOST_CHECK_EQUAL(xz[2*i],pos[3*i]);
+                BOOST_CHECK_EQUAL(xz[2*i+1],pos[3*i+2]);
+        }
+        //All three as separate arrays
+        std::vector<float> planes(3*npart);
+        BOOST_REQUIRE_EQUAL(snap.ReadComponents<float>("POS ",&planes[0],7,npart,0,skip,true),npart);
+        for(int64_t i = 0; i < npart; i++)
+                for(int c = 0; c < 3; c++)
+                        BOOST_CHECK_EQUAL(planes[c*npart+i],pos[3*i+c]);
+        //There is no fourth coordinate
+        BOOST_CHECK_EQUAL(snap.ReadComponents<float>("POS ",&planes[0],8,npart,0,skip),0);
+        BOOST_CHECK_EQUAL(snap.ReadComponents<float>("POS ",&planes[0],7,-1,0,skip),0);
+}
+
+BOOST_AUTO_TEST_CASE(sort_by_id)
+{
+        //Against a plain stable sort, on several threads, with keys spread over every byte
+        std::vector<uint64_t> keys(300000);
+        for(size_t i = 0; i < keys.size(); i++)
+                keys[i] = (i*0x9e3779b97f4a7c15ull) >> (i % 3 ? 0 : 40);
+        const std::vector<uint64_t> orig(keys);
+        std::vector<uint64_t> want(keys);
+        std::vector<int64_t> perm;
+        RadixSortPermutation(keys,perm,64,3);
+        std::stable_sort(want.begin(),want.end());
+        BOOST_CHECK(keys == want);
+        for(size_t i = 0; i < keys.size(); i += 997)
+                BOOST_CHECK_EQUAL(keys[i],orig[perm[i]]);
+        //Every particle of the snapshot, in order of ID
+        GSnap snap("test_g2_snap",false);
+        std::vector<std::string> names;
+        names.push_back("POS ");
+        names.push_back("ID  ");
+        sorted_blocks sorted;
+        BOOST_REQUIRE_EQUAL(SortByID(snap,names,(1<<N_TYPE)-1,sorted,2),0);
+        int64_t npart = 0;
+        for(int t = 0; t < N_TYPE; t++)
+                npart += snap.GetNpart(t);
+        BOOST_REQUIRE_EQUAL(sorted.ids.size(),(size_t) npart);
+        BOOST_REQUIRE_EQUAL(sorted.partlen[0],12);
+        //Types one at a time, in the order SortByID takes them
+        std::vector<float> pos;
+        std::vector<long long> ids;
+        for(int t = 0; t < N_TYPE; t++){
+                const int skip = (1<<N_TYPE)-1-(1<<t);
+                std::vector<float> p = snap.GetBlock("POS ",snap.GetNpart(t),0,skip);
+                std::vector<long long> i = snap.GetBlockInt("ID  ",snap.GetNpart(t),0,skip);
+                pos.insert(pos.end(),p.begin(),p.end());
+                ids.insert(ids.end(),i.begin(),i.end());
+        }
+        const float * spos = (const float *) &sorted.blocks[0][0];
+        for(int64_t i = 0; i < npart; i++){
+                if(i > 0)
+                        BOOST_CHECK(sorted.ids[i-1] <= sorted.ids[i]);
+                BOOST_CHECK_EQUAL(sorted.ids[i],(uint64_t) ids[sorted.order[i]]);
+                BOOST_CHECK_EQUAL(spos[3*i+1],pos[3*sorted.order[i]+1]);
+        }
+        //Out of core, with buckets of a few hundred particles, gives the same
+        BOOST_REQUIRE_EQUAL(SortByIDToFiles(snap,names,(1<<N_TYPE)-1,"sort_test",4096,2),0);
+        FILE * fd = fopen("sort_test.POS","rb");
+        BOOST_REQUIRE(fd);
+        std::vector<char> ondisc(sorted.blocks[0].size()+1);
+        BOOST_CHECK_EQUAL(fread(&ondisc[0],1,ondisc.size(),fd),sorted.blocks[0].size());
+        fclose(fd);
+        BOOST_CHECK(memcmp(&ondisc[0],&sorted.blocks[0][0],sorted.blocks[0].size()) == 0);
+        remove("sort_test.POS");
+        remove("sort_test.ID");
+        //Buckets of five particles: too many to have open at once, so the block is read several times
+        BOOST_REQUIRE_EQUAL(SortByIDToFiles(snap,names,(1<<N_TYPE)-1,"sort_test",64,2,false),0);
+        fd = fopen("sort_test.POS","rb");
+        BOOST_REQUIRE(fd);
+        BOOST_CHECK_EQUAL(fread(&ondisc[0],1,ondisc.size(),fd),sorted.blocks[0].size());
+        fclose(fd);
+        BOOST_CHECK(memcmp(&ondisc[0],&sorted.blocks[0][0],sorted.blocks[0].size()) == 0);
+        remove("sort_test.POS");
+        remove("sort_test.ID");
+        //MASS is missing for dark matter, which has a mass in the header
+        names.push_back("MASS");
+        BOOST_CHECK_EQUAL(SortByID(snap,names,(1<<N_TYPE)-1,sorted,2,false),1);
+}
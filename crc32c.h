@@ -0,0 +1,219 @@
+/* Copyright (c) 2010, Simeon Bird <spb41@cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+#ifndef __CRC32C_H
+#define __CRC32C_H
+
+#include <map>
+#include <mutex>
+#include <utility>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42
+#endif
+/** \file
+ * CRC-32C (Castagnoli) checksums of block data, shared by the reader and the writer.
+ * The SSE4.2 crc32 instruction is used when the processor has it, otherwise a table-driven routine. */
+
+/** Reflected CRC-32C polynomial*/
+#define CRC32C_POLY 0x82f63b78u
+
+/** Multiply a and b modulo the CRC polynomial. Bit 31 is x^0.*/
+static inline uint32_t crc32c_multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1u << 31, p = 0;
+    for(;;){
+        if(a & m){
+            p ^= b;
+            if((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+/** x^(n*2^k) modulo the CRC polynomial. With k=3, this shifts a CRC over n zero bytes.*/
+static inline uint32_t crc32c_x2nmodp(uint64_t n, unsigned k)
+{
+    //x^(2^j) for each j
+    static const struct x2n_table {
+        uint32_t t[32];
+        x2n_table() {
+            uint32_t p = 1u << 30;
+            for(int j = 0; j < 32; j++){
+                t[j] = p;
+                p = crc32c_multmodp(p, p);
+            }
+        }
+    } table;
+    uint32_t p = 1u << 31;
+    while(n){
+        if(n & 1)
+            p = crc32c_multmodp(table.t[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+/** Table-driven CRC-32C, eight bytes at a time. crc is the raw register, without conditioning.*/
+static inline uint32_t crc32c_sw(uint32_t crc, const unsigned char * buf, size_t len)
+{
+    static const struct slice_table {
+        uint32_t t[8][256];
+        slice_table() {
+            for(int i = 0; i < 256; i++){
+                uint32_t c = i;
+                for(int j = 0; j < 8; j++)
+                    c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+                t[0][i] = c;
+            }
+            for(int i = 0; i < 256; i++)
+                for(int j = 1; j < 8; j++)
+                    t[j][i] = (t[j-1][i] >> 8) ^ t[0][t[j-1][i] & 0xff];
+        }
+    } table;
+    const uint32_t (*t)[256] = table.t;
+    for(; len && ((uintptr_t) buf & 7); len--)
+        crc = (crc >> 8) ^ t[0][(crc ^ *buf++) & 0xff];
+    for(; len >= 8; len -= 8, buf += 8){
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        word ^= crc;
+        crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^ t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff] ^
+              t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^ t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+    }
+    for(; len; len--)
+        crc = (crc >> 8) ^ t[0][(crc ^ *buf++) & 0xff];
+    return crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+/** Bytes given to each of the three interleaved streams of crc32c_hw*/
+#define CRC32C_LANE 8192
+
+/** CRC-32C using the SSE4.2 crc32 instruction. This has a latency of three cycles but can start one each cycle,
+ * so large buffers are split into three streams, which are combined afterwards.*/
+__attribute__((target("sse4.2"))) static inline uint32_t crc32c_hw(uint32_t crc, const unsigned char * buf, size_t len)
+{
+    //Shifts over one and two lanes of zeroes
+    static const uint32_t shift1 = crc32c_x2nmodp(CRC32C_LANE, 3), shift2 = crc32c_x2nmodp(2*CRC32C_LANE, 3);
+    for(; len && ((uintptr_t) buf & 7); len--)
+        crc = _mm_crc32_u8(crc, *buf++);
+    uint64_t c0 = crc;
+    for(; len >= 3*CRC32C_LANE; len -= 3*CRC32C_LANE, buf += 3*CRC32C_LANE){
+        uint64_t c1 = 0, c2 = 0;
+        for(size_t i = 0; i < CRC32C_LANE; i += 8){
+            c0 = _mm_crc32_u64(c0, *(const uint64_t *) (buf + i));
+            c1 = _mm_crc32_u64(c1, *(const uint64_t *) (buf + CRC32C_LANE + i));
+            c2 = _mm_crc32_u64(c2, *(const uint64_t *) (buf + 2*CRC32C_LANE + i));
+        }
+        c0 = crc32c_multmodp(shift2, c0) ^ crc32c_multmodp(shift1, c1) ^ c2;
+    }
+    for(; len >= 8; len -= 8, buf += 8)
+        c0 = _mm_crc32_u64(c0, *(const uint64_t *) buf);
+    crc = c0;
+    for(; len; len--)
+        crc = _mm_crc32_u8(crc, *buf++);
+    return crc;
+}
+#endif
+
+/** Update a CRC-32C with len bytes of data. Start with crc = 0.
+ * Gives the standard CRC-32C: crc32c(0, "123456789", 9) == 0xe3069283.*/
+static inline uint32_t crc32c(uint32_t crc, const void * data, size_t len)
+{
+    const unsigned char * buf = (const unsigned char *) data;
+#ifdef CRC32C_HAVE_SSE42
+    static const bool hw = __builtin_cpu_supports("sse4.2");
+    if(hw)
+        return ~crc32c_hw(~crc, buf, len);
+#endif
+    return ~crc32c_sw(~crc, buf, len);
+}
+
+/** CRC-32C of two pieces of data put together, from the CRC of each and the length of the second.
+ * Pieces written by different threads can be checksummed separately and combined.*/
+static inline uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+    return crc32c_multmodp(crc32c_x2nmodp(len2, 3), crc1) ^ crc2;
+}
+
+/** Checksum of a block of data which is written in pieces, perhaps out of order and from several threads.
+ * Each piece is checksummed as it arrives and joined to its neighbours, so when the block is complete
+ * a single checksum of the whole remains. Thread-safe.*/
+class crc32c_pieces {
+    public:
+    crc32c_pieces(): bad(false) {};
+    /** Add len bytes of data, starting offset bytes into the block.
+     * The checksum is computed before taking the lock, so different threads may checksum at once.*/
+    void add(uint64_t offset, const void * data, uint64_t len)
+    {
+        if(!len)
+            return;
+        uint32_t crc = crc32c(0, data, len);
+        std::lock_guard<std::mutex> guard(lock);
+        std::map<uint64_t, std::pair<uint64_t, uint32_t> >::iterator next = pieces.lower_bound(offset);
+        //Overlapping pieces mean part of the block was written twice, so the checksum can not be trusted
+        if(next != pieces.end() && next->first < offset + len){
+            bad = true;
+            return;
+        }
+        if(next != pieces.begin()){
+            std::map<uint64_t, std::pair<uint64_t, uint32_t> >::iterator prev = next;
+            --prev;
+            if(prev->first + prev->second.first > offset){
+                bad = true;
+                return;
+            }
+            //Join to the piece before
+            if(prev->first + prev->second.first == offset){
+                offset = prev->first;
+                crc = crc32c_combine(prev->second.second, crc, len);
+                len += prev->second.first;
+                pieces.erase(prev);
+            }
+        }
+        //Join to the piece after
+        if(next != pieces.end() && next->first == offset + len){
+            crc = crc32c_combine(crc, next->second.second, next->second.first);
+            len += next->second.first;
+            pieces.erase(next);
+        }
+        pieces[offset] = std::make_pair(len, crc);
+    }
+    /** Get the checksum of the block, if exactly bytes 0 to total have been added, each once.
+     * @return true if so.*/
+    bool get(uint64_t total, uint32_t& crc)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(bad || pieces.size() != 1 || pieces.begin()->first != 0 || pieces.begin()->second.first != total)
+            return false;
+        crc = pieces.begin()->second.second;
+        return true;
+    }
+    private:
+    crc32c_pieces(const crc32c_pieces&);
+    crc32c_pieces& operator=(const crc32c_pieces&);
+    /** Runs of data: offset to length and checksum*/
+    std::map<uint64_t, std::pair<uint64_t, uint32_t> > pieces;
+    bool bad;
+    std::mutex lock;
+};
+
+#endif //__CRC32C_H
@@ -0,0 +1,137 @@
+/* Pool of reusable read buffers*/
+#include "gadgetreader.hpp"
+#include <sys/mman.h>
+
+namespace GadgetReader{
+
+  /*Buffers at least this large are mapped rather than malloced*/
+  #define MAP_THRESHOLD (1<<20)
+  /*Alignment of the small buffers*/
+  #define POOL_ALIGN 64
+  /*Size of a transparent huge page on x86-64*/
+  #define HUGE_PAGE (2<<20)
+
+  GBufferPool::GBufferPool(size_t max_cached, bool huge_pages): max_cached(max_cached), cached(0), huge_pages(huge_pages), reused(0), allocated(0)
+  {
+  }
+
+  GBufferPool::~GBufferPool()
+  {
+          Trim();
+          for(std::map<void *, size_t>::iterator it = in_use.begin(); it != in_use.end(); ++it)
+                  free_buffer(it->first, it->second);
+  }
+
+  size_t GBufferPool::size_class(size_t bytes)
+  {
+          if(bytes <= 4096)
+                  return 4096;
+          //Four classes between each power of two, so at most a quarter is wasted
+          size_t top = 4096;
+          while(top*2 <= bytes)
+                  top *= 2;
+          const size_t step = top/4;
+          return (bytes + step - 1)/step*step;
+  }
+
+  void * GBufferPool::new_buffer(size_t bytes)
+  {
+          if(bytes < MAP_THRESHOLD){
+                  void * ptr;
+                  if(posix_memalign(&ptr, POOL_ALIGN, bytes))
+                          return NULL;
+                  return ptr;
+          }
+          void * ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+          if(ptr == MAP_FAILED)
+                  return NULL;
+#ifdef MADV_HUGEPAGE
+          if(huge_pages)
+                  madvise(ptr, bytes, MADV_HUGEPAGE);
+#endif
+          return ptr;
+  }
+
+  void GBufferPool::free_buffer(void * buffer, size_t bytes)
+  {
+          if(bytes < MAP_THRESHOLD)
+                  free(buffer);
+          else
+                  munmap(buffer, bytes);
+  }
+
+  void * GBufferPool::Allocate(size_t bytes)
+  {
+          size_t size = size_class(bytes);
+          //A mapping can only be backed by huge pages in whole huge pages
+          if(huge_pages && size >= MAP_THRESHOLD)
+                  size = (size + HUGE_PAGE - 1)/HUGE_PAGE*HUGE_PAGE;
+          {
+                  std::lock_guard<std::mutex> guard(lock);
+                  //Take the smallest cached buffer big enough, if it is not too much bigger
+                  std::multimap<size_t, void *>::iterator it = free_list.lower_bound(size);
+                  if(it != free_list.end() && it->first <= size + size/2){
+                          void * ptr = it->second;
+                          in_use[ptr] = it->first;
+                          cached -= it->first;
+                          free_list.erase(it);
+                          reused++;
+                          return ptr;
+                  }
+          }
+          //Allocate outside the lock, as faulting in a large mapping is slow
+          void * ptr = new_buffer(size);
+          if(!ptr)
+                  return NULL;
+          std::lock_guard<std::mutex> guard(lock);
+          in_use[ptr] = size;
+          allocated++;
+          return ptr;
+  }
+
+  void GBufferPool::Release(void * buffer)
+  {
+          if(!buffer)
+                  return;
+          std::unique_lock<std::mutex> guard(lock);
+          std::map<void *, size_t>::iterator it = in_use.find(buffer);
+          if(it == in_use.end())
+                  return;
+          const size_t size = it->second;
+          in_use.erase(it);
+          if(cached + size <= max_cached){
+                  free_list.insert(std::make_pair(size, buffer));
+                  cached += size;
+                  return;
+          }
+          guard.unlock();
+          free_buffer(buffer, size);
+  }
+
+  void GBufferPool::Trim()
+  {
+          std::lock_guard<std::mutex> guard(lock);
+          for(std::multimap<size_t, void *>::iterator it = free_list.begin(); it != free_list.end(); ++it)
+                  free_buffer(it->second, it->first);
+          free_list.clear();
+          cached = 0;
+  }
+
+  size_t GBufferPool::GetCachedBytes()
+  {
+          std::lock_guard<std::mutex> guard(lock);
+          return cached;
+  }
+
+  int64_t GBufferPool::GetReused()
+  {
+          std::lock_guard<std::mutex> guard(lock);
+          return reused;
+  }
+
+  int64_t GBufferPool::GetAllocated()
+  {
+          std::lock_guard<std::mutex> guard(lock);
+          return allocated;
+  }
+}
@@ -0,0 +1,129 @@
+/* Copyright (c) 2010, Simeon Bird <spb41@cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+/** \file
+ * Pool of reusable read buffers, so that reading many snapshots in turn
+ * does not allocate, fault in and free the same large buffers for every snapshot.
+ * Included by gadgetreader.hpp; include that rather than this.*/
+#ifndef __GADGETBUFFERPOOL_H
+#define __GADGETBUFFERPOOL_H
+
+#include <map>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+namespace GadgetReader{
+
+  /** A pool of aligned buffers, recycled by size class.
+   * Sizes are rounded up to a class, with four classes for each power of two,
+   * so a buffer can be reused for a slightly larger request, such as the same block of the next snapshot.
+   * Released buffers are kept for reuse, up to max_cached bytes; beyond that they are freed.
+   * Buffers of 1 MB and more are mapped directly from the system, so freeing them returns the memory,
+   * and may be backed by transparent huge pages.
+   * All buffers are aligned to 64 bytes. Thread-safe.*/
+  class DLL_PUBLIC GBufferPool {
+    public:
+    /** @param max_cached Most bytes of released buffers to keep. The default keeps everything.
+     * @param huge_pages Ask the system to back large buffers with huge pages, to cut the number of page faults.*/
+    GBufferPool(size_t max_cached=SIZE_MAX, bool huge_pages=false);
+    /** Frees every buffer. Buffers still in use become invalid, so release them first.*/
+    ~GBufferPool();
+    /** Get a buffer of at least bytes bytes. Its contents are undefined.
+     * @return NULL if the memory could not be allocated.*/
+    void * Allocate(size_t bytes);
+    /** Return a buffer from Allocate to the pool. NULL is ignored.*/
+    void Release(void * buffer);
+    /** Free all cached buffers*/
+    void Trim();
+    /** Bytes in cached buffers, waiting for reuse*/
+    size_t GetCachedBytes();
+    /** Number of calls to Allocate satisfied from the cache*/
+    int64_t GetReused();
+    /** Number of calls to Allocate which needed new memory*/
+    int64_t GetAllocated();
+    private:
+    GBufferPool(const GBufferPool&);
+    GBufferPool& operator=(const GBufferPool&);
+    /** Round a request up to its size class*/
+    static size_t size_class(size_t bytes);
+    void * new_buffer(size_t bytes);
+    static void free_buffer(void * buffer, size_t bytes);
+    size_t max_cached, cached;
+    bool huge_pages;
+    int64_t reused, allocated;
+    /** Cached buffers, by size*/
+    std::multimap<size_t, void *> free_list;
+    /** Buffers in use, and their sizes*/
+    std::map<void *, size_t> in_use;
+    std::mutex lock;
+  };
+
+  /** Standard library allocator drawing from a GBufferPool, for vectors which should reuse pooled memory.
+   * A default constructed allocator has no pool, and uses malloc.
+   * Elements are default initialised, so resizing a vector of numbers does not clear it:
+   * the reads which fill the vector touch each page once, rather than twice.*/
+  template <class T> class GPoolAllocator {
+    public:
+    typedef T value_type;
+    /* The pool moves with the memory*/
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+    GPoolAllocator(GBufferPool * pool=NULL): pool(pool) {};
+    template <class U> GPoolAllocator(const GPoolAllocator<U>& other): pool(other.pool) {};
+    T * allocate(size_t n)
+    {
+        void * ptr = pool ? pool->Allocate(n*sizeof(T)) : malloc(n*sizeof(T));
+        if(!ptr && n)
+            throw std::bad_alloc();
+        return (T *) ptr;
+    }
+    void deallocate(T * ptr, size_t)
+    {
+        if(pool)
+            pool->Release(ptr);
+        else
+            free(ptr);
+    }
+    /** Default initialise, rather than value initialise*/
+    template <class U> void construct(U * ptr)
+    {
+        ::new((void *) ptr) U;
+    }
+    template <class U, class... Args> void construct(U * ptr, Args&&... args)
+    {
+        ::new((void *) ptr) U(std::forward<Args>(args)...);
+    }
+    GBufferPool * pool;
+  };
+
+  template <class T, class U> bool operator==(const GPoolAllocator<T>& a, const GPoolAllocator<U>& b)
+  {
+      return a.pool == b.pool;
+  }
+
+  template <class T, class U> bool operator!=(const GPoolAllocator<T>& a, const GPoolAllocator<U>& b)
+  {
+      return a.pool != b.pool;
+  }
+
+  /** A vector whose memory comes from a GBufferPool*/
+  template <class T> using pool_vector = std::vector<T, GPoolAllocator<T> >;
+}
+
+#endif //__GADGETBUFFERPOOL_H
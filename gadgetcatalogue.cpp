@@ -0,0 +1,200 @@
+/* Catalogue of snapshot headers, read in parallel*/
+#include "gadgetcatalogue.hpp"
+#include "read_utils.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace GadgetReader{
+
+  /*Identifies a binary catalogue, and its version*/
+  static const char catalogue_magic[8] = {'G','H','C','A','T','0','0','1'};
+
+  /*Read the header of each entry, nthreads at a time*/
+  static void read_headers(std::vector<catalogue_entry>& todo, int nthreads, bool debug)
+  {
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> workers;
+        for(int i = 0; i < std::max(std::min<int>(nthreads, todo.size()), 1); i++)
+                workers.push_back(std::thread([&]{
+                        size_t j;
+                        while((j = next++) < todo.size()){
+                                if(ReadHeader(todo[j].file, todo[j].header, debug)){
+                                        memset(&todo[j].header, 0, sizeof(gadget_header));
+                                        todo[j].status = 1;
+                                }
+                                else
+                                        todo[j].status = 0;
+                        }
+                }));
+        for(size_t i = 0; i < workers.size(); i++)
+                workers[i].join();
+  }
+
+  int64_t GHeaderCatalogue::Build(const std::vector<std::string>& snapshots, int nthreads)
+  {
+        //First files, which tell us how many files each snapshot has
+        std::vector<catalogue_entry> first(snapshots.size());
+        for(size_t i = 0; i < snapshots.size(); i++){
+                first[i].file = snapshots[i];
+                //As in GSnap, add .0 if there is no file by the given name
+                if(access(first[i].file.c_str(), R_OK))
+                        first[i].file += ".0";
+                first[i].snapshot = i;
+                first[i].file_num = 0;
+        }
+        read_headers(first, nthreads, debug);
+        //All the other files
+        std::vector<catalogue_entry> rest;
+        for(size_t i = 0; i < first.size(); i++){
+                const int num_files = first[i].header.num_files;
+                if(first[i].status || num_files <= 1)
+                        continue;
+                if(num_files > 999){
+                        WARN("Implausible number of files in %s: %d\n",first[i].file.c_str(),num_files);
+                        continue;
+                }
+                std::string base = first[i].file;
+                if(base.size() > 2 && base.compare(base.size()-2, 2, ".0") == 0)
+                        base.erase(base.size()-2);
+                for(int j = 1; j < num_files; j++){
+                        catalogue_entry entry;
+                        entry.file = base + "." + std::to_string(j);
+                        entry.snapshot = i;
+                        entry.file_num = j;
+                        rest.push_back(entry);
+                }
+        }
+        read_headers(rest, nthreads, debug);
+        //Put them in order, and check each file against the first of its snapshot
+        int64_t bad = 0;
+        size_t r = 0;
+        for(size_t i = 0; i < first.size(); i++){
+                entries.push_back(first[i]);
+                bad += first[i].status != 0;
+                for(; r < rest.size() && rest[r].snapshot == (int) i; r++){
+                        if(!rest[r].status && !CheckHeaders(rest[r].header, first[i].header)){
+                                WARN("Header of %s is inconsistent with %s\n",rest[r].file.c_str(),first[i].file.c_str());
+                                rest[r].status = 2;
+                        }
+                        bad += rest[r].status != 0;
+                        entries.push_back(rest[r]);
+                }
+        }
+        index();
+        return bad;
+  }
+
+  void GHeaderCatalogue::index()
+  {
+        by_file.clear();
+        for(size_t i = 0; i < entries.size(); i++)
+                by_file[entries[i].file] = i;
+  }
+
+  const catalogue_entry * GHeaderCatalogue::Find(const std::string& file) const
+  {
+        std::map<std::string, size_t>::const_iterator it = by_file.find(file);
+        if(it == by_file.end())
+                return NULL;
+        return &entries[it->second];
+  }
+
+  int GHeaderCatalogue::WriteCSV(const std::string& filename) const
+  {
+        FILE * fd = fopen(filename.c_str(), "w");
+        if(!fd){
+                WARN("Could not open %s for writing\n",filename.c_str());
+                return 1;
+        }
+        fprintf(fd, "file,snapshot,file_num,status,num_files,time,redshift,BoxSize,Omega0,OmegaLambda,HubbleParam");
+        for(int j = 0; j < N_TYPE; j++)
+                fprintf(fd, ",npart%d", j);
+        for(int j = 0; j < N_TYPE; j++)
+                fprintf(fd, ",npartTotal%d", j);
+        for(int j = 0; j < N_TYPE; j++)
+                fprintf(fd, ",NallHW%d", j);
+        fprintf(fd, "\n");
+        for(size_t i = 0; i < entries.size(); i++){
+                const gadget_header& h = entries[i].header;
+                fprintf(fd, "%s,%d,%d,%d,%d,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g", entries[i].file.c_str(), entries[i].snapshot, entries[i].file_num,
+                                entries[i].status, h.num_files, h.time, h.redshift, h.BoxSize, h.Omega0, h.OmegaLambda, h.HubbleParam);
+                for(int j = 0; j < N_TYPE; j++)
+                        fprintf(fd, ",%u", h.npart[j]);
+                for(int j = 0; j < N_TYPE; j++)
+                        fprintf(fd, ",%u", h.npartTotal[j]);
+                for(int j = 0; j < N_TYPE; j++)
+                        fprintf(fd, ",%u", h.NallHW[j]);
+                fprintf(fd, "\n");
+        }
+        if(fclose(fd)){
+                WARN("Could not write %s\n",filename.c_str());
+                return 1;
+        }
+        return 0;
+  }
+
+  /*Binary format: magic, entry count, then for each entry
+   * snapshot, file_num, status, length of the name, the name and the raw header.*/
+  int GHeaderCatalogue::Write(const std::string& filename) const
+  {
+        FILE * fd = fopen(filename.c_str(), "wb");
+        if(!fd){
+                WARN("Could not open %s for writing\n",filename.c_str());
+                return 1;
+        }
+        uint64_t count = entries.size();
+        bool ok = fwrite(catalogue_magic, sizeof(catalogue_magic), 1, fd) == 1 && fwrite(&count, sizeof(count), 1, fd) == 1;
+        for(size_t i = 0; ok && i < entries.size(); i++){
+                int32_t ints[4] = {entries[i].snapshot, entries[i].file_num, entries[i].status, (int32_t) entries[i].file.size()};
+                ok = fwrite(ints, sizeof(ints), 1, fd) == 1 &&
+                        fwrite(entries[i].file.c_str(), 1, entries[i].file.size(), fd) == entries[i].file.size() &&
+                        fwrite(&entries[i].header, sizeof(gadget_header), 1, fd) == 1;
+        }
+        if(fclose(fd) || !ok){
+                WARN("Could not write %s\n",filename.c_str());
+                return 1;
+        }
+        return 0;
+  }
+
+  int GHeaderCatalogue::Read(const std::string& filename)
+  {
+        entries.clear();
+        by_file.clear();
+        FILE * fd = fopen(filename.c_str(), "rb");
+        if(!fd){
+                WARN("Could not open %s\n",filename.c_str());
+                return 1;
+        }
+        char magic[sizeof(catalogue_magic)];
+        uint64_t count = 0;
+        bool ok = fread(magic, sizeof(magic), 1, fd) == 1 && memcmp(magic, catalogue_magic, sizeof(magic)) == 0 &&
+                fread(&count, sizeof(count), 1, fd) == 1;
+        for(uint64_t i = 0; ok && i < count; i++){
+                catalogue_entry entry;
+                int32_t ints[4];
+                ok = fread(ints, sizeof(ints), 1, fd) == 1 && ints[3] >= 0;
+                if(!ok)
+                        break;
+                entry.snapshot = ints[0];
+                entry.file_num = ints[1];
+                entry.status = ints[2];
+                entry.file.resize(ints[3]);
+                ok = (ints[3] == 0 || fread(&entry.file[0], 1, ints[3], fd) == (size_t) ints[3]) &&
+                        fread(&entry.header, sizeof(gadget_header), 1, fd) == 1;
+                entries.push_back(entry);
+        }
+        fclose(fd);
+        if(!ok){
+                WARN("%s is not a header catalogue, or is truncated\n",filename.c_str());
+                entries.clear();
+                return 1;
+        }
+        index();
+        return 0;
+  }
+}
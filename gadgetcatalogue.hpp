@@ -0,0 +1,78 @@
+/* Copyright (c) 2010, Simeon Bird <spb41@cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+/** \file
+ * Catalogue of the headers of many snapshots, read in parallel without scanning any blocks.*/
+#ifndef __GADGETCATALOGUE_H
+#define __GADGETCATALOGUE_H
+
+#include "gadgetreader.hpp"
+#include <map>
+#include <string>
+#include <vector>
+
+namespace GadgetReader{
+
+  /** The header of one file, as found by GHeaderCatalogue*/
+  struct catalogue_entry {
+    /** Name of the file*/
+    std::string file;
+    /** Index of the snapshot in the list given to Build*/
+    int snapshot;
+    /** Number of the file within its snapshot*/
+    int file_num;
+    /** 0 if the header was read and is consistent with file 0 of the snapshot,
+     * 1 if it could not be read, 2 if it is inconsistent (see CheckHeaders).*/
+    int status;
+    /** The header, in native byte order. Zeroed if it could not be read.*/
+    gadget_header header;
+  };
+
+  /** Catalogue of snapshot headers, for planning jobs over many snapshots.
+   * Only the HEAD record of each file is read, using several threads, so this is much faster than a GSnap for each snapshot.
+   * The catalogue can be saved as CSV, for people, or in a compact binary form which Read loads again,
+   * so later runs need not touch the snapshots at all.*/
+  class DLL_PUBLIC GHeaderCatalogue {
+    public:
+    GHeaderCatalogue(bool debug=true): debug(debug) {};
+    /** Read the header of every file of every snapshot, nthreads files at a time.
+     * The first file of each snapshot gives the number of files; see GSnap for naming.
+     * Entries are added in order of snapshot, then file.
+     * @param snapshots Snapshot names, as given to the GSnap constructor.
+     * @return The number of files which could not be read or were inconsistent.*/
+    int64_t Build(const std::vector<std::string>& snapshots, int nthreads=8);
+    /** All entries in the catalogue*/
+    const std::vector<catalogue_entry>& GetEntries() const {
+        return entries;
+    }
+    /** Get the entry for a file, or NULL if it is not in the catalogue*/
+    const catalogue_entry * Find(const std::string& file) const;
+    /** Write the catalogue as CSV, one line per file, with a heading line.
+     * @return 0 on success, 1 on failure.*/
+    int WriteCSV(const std::string& filename) const;
+    /** Write the catalogue in binary. The format is native endian, and may change between versions.
+     * @return 0 on success, 1 on failure.*/
+    int Write(const std::string& filename) const;
+    /** Replace the catalogue with one saved by Write.
+     * @return 0 on success, 1 on failure, in which case the catalogue is empty.*/
+    int Read(const std::string& filename);
+    private:
+    /** Rebuild the index used by Find*/
+    void index();
+    std::vector<catalogue_entry> entries;
+    std::map<std::string, size_t> by_file;
+    bool debug;
+  };
+}
+
+#endif //__GADGETCATALOGUE_H
@@ -0,0 +1,157 @@
+/* Copyright (c) 2010, Simeon Bird <spb41@cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+#include "gadgetconvert.hpp"
+#include "thread_utils.h"
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <stdio.h>
+
+/** \file
+ * Streaming snapshot conversion method file*/
+namespace GadgetConvert{
+
+  using namespace GadgetReader;
+
+  /* A chunk of particles on its way from a reader to the writer*/
+  struct convert_chunk {
+          size_t job;
+          int64_t begin;
+          int64_t np;
+          /*Drawn from the pipeline's pool, so finished chunks are recycled*/
+          pool_vector<char> data;
+  };
+
+  std::vector<convert_job> plan_jobs(GSnap& snap, const std::map<std::string, std::string> *out_names)
+  {
+        std::vector<convert_job> jobs;
+        std::set<std::string> blocks=snap.GetBlocks();
+        std::set<std::string>::iterator it;
+        for(it=blocks.begin() ; it != blocks.end(); it++){
+                convert_job job;
+                job.name = *it;
+                job.partlen = snap.GetPartLen(*it);
+                std::map<std::string, std::string>::const_iterator jt;
+                if(!out_names)
+                        job.out_name = *it;
+                else if((jt = out_names->find(*it)) != out_names->end())
+                        job.out_name = jt->second;
+                else
+                        job.out_name = it->substr(0, it->find_last_not_of(' ')+1);
+                //Keep the element type the reader found, so doubles stay doubles
+                job.items = snap.GetBlockComponents(*it);
+                job.dtype = std::string(1, snap.GetBlockDType(*it)) + std::to_string(job.partlen/job.items);
+                int types = snap.GetBlockTypes(*it);
+                for(int i = 0; i < N_TYPE; i++){
+                        if(!(types & (1<<i)) || snap.GetNpart(i) == 0)
+                                continue;
+                        job.type = i;
+                        job.npart = snap.GetNpart(i);
+                        job.skip_type = (1<<N_TYPE)-1-(1<<i);
+                        jobs.push_back(job);
+                }
+        }
+        return jobs;
+  }
+
+  std::vector<GadgetWriter::block_info> output_blocks(const std::vector<convert_job>& jobs)
+  {
+        std::vector<GadgetWriter::block_info> blocks;
+        for(size_t i = 0; i < jobs.size(); i++){
+                std::vector<GadgetWriter::block_info>::iterator it;
+                for(it = blocks.begin(); it != blocks.end(); ++it)
+                        if(it->name == jobs[i].out_name)
+                                break;
+                if(it == blocks.end()){
+                        blocks.push_back(GadgetWriter::block_info(jobs[i].out_name, std::valarray<bool>(false, N_TYPE), jobs[i].partlen, jobs[i].dtype[0], jobs[i].items));
+                        it = blocks.end()-1;
+                }
+                it->types[jobs[i].type] = true;
+        }
+        return blocks;
+  }
+
+  /* Reader thread: take jobs from the list and read them in chunks into the queue*/
+  static void read_jobs(GSnap& snap, const std::vector<convert_job>& jobs, std::atomic<size_t>& next_job, BoundedQueue<convert_chunk>& queue, int64_t chunk_part, GBufferPool& pool)
+  {
+        size_t j;
+        while((j = next_job++) < jobs.size()){
+                const convert_job& job = jobs[j];
+                for(int64_t begin = 0; begin < job.npart; begin += chunk_part){
+                        convert_chunk chunk;
+                        chunk.data = pool_vector<char>(GPoolAllocator<char>(&pool));
+                        chunk.job = j;
+                        chunk.begin = begin;
+                        chunk.np = std::min(chunk_part, job.npart - begin);
+                        chunk.data.resize(chunk.np*job.partlen);
+                        int64_t read = snap.GetBlock(job.name, &chunk.data[0], chunk.np, begin, job.skip_type);
+                        if(read < chunk.np){
+                                fprintf(stderr, "Only read %ld of %ld particles of type %d in block %s\n",read, chunk.np, job.type, job.name.c_str());
+                                chunk.np = read;
+                        }
+                        if(chunk.np == 0)
+                                break;
+                        //False if the writer has given up
+                        if(!queue.push(std::move(chunk)))
+                                return;
+                }
+        }
+  }
+
+  int run_pipeline(GSnap& snap, const std::vector<convert_job>& jobs, chunk_writer write, int64_t chunk_part, int nreaders, int queue_len, bool verbose)
+  {
+        if(verbose)
+                std::cout<<"Converting "<<jobs.size()<<" blocks, using at most "<<(queue_len+nreaders+1)*chunk_part<<" particles of buffer"<<std::endl;
+        /*Start the readers; the last one to finish closes the queue*/
+        //Chunk buffers are recycled through the pool, which must outlive the queue
+        GBufferPool pool;
+        BoundedQueue<convert_chunk> queue(queue_len);
+        std::atomic<size_t> next_job(0);
+        std::atomic<int> running(nreaders);
+        std::vector<std::thread> readers;
+        for(int i = 0; i < nreaders; i++)
+                readers.push_back(std::thread([&]{
+                        read_jobs(snap, jobs, next_job, queue, chunk_part, pool);
+                        if(--running == 0)
+                                queue.close();
+                }));
+        /*Write chunks as they arrive. If the writer throws,
+         * stop the readers before passing the exception on.*/
+        convert_chunk chunk;
+        int ret = 0;
+        try {
+                while(queue.pop(chunk)){
+                        const convert_job& job = jobs[chunk.job];
+                        if(verbose && chunk.begin == 0)
+                                std::cout<<"Converting type "<<job.type<<" block "<<job.name<<" to "<<job.out_name<<std::endl;
+                        if(write(job, &chunk.data[0], chunk.np, chunk.begin) != chunk.np){
+                                std::cerr<<"Failed writing type "<<job.type<<" block "<<job.out_name<<std::endl;
+                                ret = 1;
+                                break;
+                        }
+                }
+        }
+        catch(...) {
+                queue.close();
+                for(size_t i = 0; i < readers.size(); i++)
+                        readers[i].join();
+                throw;
+        }
+        queue.close();
+        for(size_t i = 0; i < readers.size(); i++)
+                readers[i].join();
+        return ret;
+  }
+}
@@ -0,0 +1,64 @@
+/* Copyright (c) 2010, Simeon Bird <spb41@cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+/** \file
+ * Streaming snapshot conversion, shared by Convert2HDF5 and gconvert.
+ * Blocks are read in fixed-size chunks by several reader threads
+ * and handed through a bounded queue to a single writer,
+ * so memory use is capped and reading overlaps with writing.*/
+#ifndef __GADGETCONVERT_H
+#define __GADGETCONVERT_H
+
+#include "gadgetreader.hpp"
+#include "gadgetwriter.hpp"
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace GadgetConvert{
+
+  /** One (block, type) pair to convert*/
+  struct convert_job {
+          std::string name;
+          std::string out_name;
+          int type;
+          int64_t npart;
+          int skip_type;
+          short partlen;
+          /** Element type, in BigFile notation (f4, f8, i4, i8)*/
+          std::string dtype;
+          /** Elements per particle: 3 for POS and VEL, 1 otherwise*/
+          int items;
+  };
+
+  /** Function which writes np particles of a job, starting at particle begin of that type.
+   * Should return the number of particles written. */
+  typedef std::function<int64_t(const convert_job& job, void *data, int64_t np, int64_t begin)> chunk_writer;
+
+  /** Make one job for each particle type present in each block of the snapshot.
+   * @param out_names Map from input block names to output names. If NULL, names are unchanged.
+   * Names missing from the map have their trailing spaces removed. */
+  std::vector<convert_job> plan_jobs(GadgetReader::GSnap& snap, const std::map<std::string, std::string> *out_names);
+
+  /** Describe the output blocks of a set of jobs, for the GWriteSnap constructor.*/
+  std::vector<GadgetWriter::block_info> output_blocks(const std::vector<convert_job>& jobs);
+
+  /** Read every job in chunks of chunk_part particles using nreaders threads,
+   * and pass each chunk to write on the calling thread.
+   * At most queue_len chunks wait between the readers and the writer.
+   * @return 0 on success, 1 if a write failed. */
+  int run_pipeline(GadgetReader::GSnap& snap, const std::vector<convert_job>& jobs, chunk_writer write, int64_t chunk_part, int nreaders, int queue_len, bool verbose);
+}
+
+#endif //__GADGETCONVERT_H
@@ -0,0 +1,173 @@
+/* Quantities in physical units, derived from blocks as they are read*/
+#include "gadgetreader.hpp"
+#include "read_utils.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <stdio.h>
+
+namespace GadgetReader{
+
+/*Particles handled at once by each thread*/
+#define DERIVED_CHUNK (1<<16)
+
+/*Physical constants, in cgs*/
+#define BOLTZMANN 1.38066e-16
+#define PROTONMASS 1.67262178e-24
+#define GAMMA_MINUS1 (5./3-1)
+#define HYDROGEN_MASSFRAC 0.76
+
+/*Usual Gadget units: kpc/h, 10^10 M_sun/h and km/s*/
+#define DEFAULT_UNIT_LENGTH 3.085678e21
+#define DEFAULT_UNIT_MASS 1.989e43
+#define DEFAULT_UNIT_VELOCITY 1e5
+
+  enum derived_kind {DERIVED_TEMPERATURE, DERIVED_DENSITY, DERIVED_NH};
+
+  /*Old headers have no units, and what is there instead may be anything*/
+  static double header_unit(double unit, double def)
+  {
+          return unit > 1 && unit < 1e100 ? unit : def;
+  }
+
+  /*Block which has one entry for each particle of a derived quantity, or "" if the quantity is unknown*/
+  static std::string derived_base(const std::string& Quantity)
+  {
+          if(Quantity == "Temperature")
+                  return "U   ";
+          if(Quantity == "Density" || Quantity == "nH")
+                  return "RHO ";
+          return "";
+  }
+
+  int64_t GSnap::ReadDerived(const std::string& Quantity, float *out, int64_t npart_toread, int64_t start_part, int skip_type, int nthreads)
+  {
+          const std::string base = derived_base(Quantity);
+          if(base.empty()){
+                  WARN("Unknown derived quantity %s\n",Quantity.c_str());
+                  return 0;
+          }
+          const derived_kind kind = Quantity == "Temperature" ? DERIVED_TEMPERATURE : (Quantity == "Density" ? DERIVED_DENSITY : DERIVED_NH);
+          std::vector<block_handle> inputs(1, GetBlockHandle(base));
+          if(kind == DERIVED_TEMPERATURE){
+                  const block_handle ne = GetBlockHandle("NE  "), nhp = GetBlockHandle("NHP "), nhep = GetBlockHandle("NHEP"), nheq = GetBlockHandle("NHEQ");
+                  if(IsBlock(ne))
+                          inputs.push_back(ne);
+                  else if(IsBlock(nhp) && IsBlock(nhep) && IsBlock(nheq)){
+                          inputs.push_back(nhp);
+                          inputs.push_back(nhep);
+                          inputs.push_back(nheq);
+                  }
+                  else
+                          WARN("No electron abundance in snapshot: assuming fully ionised gas\n");
+          }
+          for(size_t k = 0; k < inputs.size(); k++){
+                  if(!IsBlock(inputs[k])){
+                          WARN("Block %s, needed for %s, is not in this snapshot\n",block_key_name(inputs[k].key).c_str(),Quantity.c_str());
+                          return 0;
+                  }
+                  if(GetBlockComponents(inputs[k]) != 1 || GetBlockTypes(inputs[k]) != GetBlockTypes(inputs[0])){
+                          WARN("Block %s does not match %s\n",block_key_name(inputs[k].key).c_str(),base.c_str());
+                          return 0;
+                  }
+          }
+          //Number of particles there are to read
+          const int types = GetBlockTypes(inputs[0]);
+          int64_t avail = 0;
+          for(int j = 0; j < N_TYPE; j++)
+                  if((types & (1 << j)) && !(skip_type & (1 << j)))
+                          avail += GetBlockSize(inputs[0], j)/GetPartLen(inputs[0]);
+          const int64_t npart = std::max<int64_t>(std::min(npart_toread, avail - start_part), 0);
+          //Conversion from the file to physical units
+          const gadget_header head = GetHeader(0);
+          const double length = header_unit(head.UnitLength_in_cm, DEFAULT_UNIT_LENGTH);
+          const double mass = header_unit(head.UnitMass_in_g, DEFAULT_UNIT_MASS);
+          const double velocity = header_unit(head.UnitVelocity_in_cm_per_s, DEFAULT_UNIT_VELOCITY);
+          const double hubble = head.HubbleParam > 0 ? head.HubbleParam : 1;
+          const double atime = head.Omega0 > 0 && head.time > 0 ? head.time : 1;
+          double scale = mass/(length*length*length)*hubble*hubble/(atime*atime*atime);
+          if(kind == DERIVED_NH)
+                  scale *= HYDROGEN_MASSFRAC/PROTONMASS;
+          //For temperature, T = scale * U / (1 + 3 X + 4 X ne), with X the hydrogen mass fraction and ne the electrons per hydrogen atom
+          if(kind == DERIVED_TEMPERATURE)
+                  scale = GAMMA_MINUS1*velocity*velocity*4*PROTONMASS/BOLTZMANN;
+          const float fscale = scale, mu_a = 1+3*HYDROGEN_MASSFRAC, mu_b = 4*HYDROGEN_MASSFRAC;
+          //Fully ionised hydrogen and helium
+          const float ne_ionised = 1 + 2*(1-HYDROGEN_MASSFRAC)/(4*HYDROGEN_MASSFRAC);
+          const int64_t nchunks = (npart + DERIVED_CHUNK - 1)/DERIVED_CHUNK;
+          std::atomic<int64_t> next(0);
+          //Particles before the first short read
+          std::atomic<int64_t> complete(npart);
+          auto work = [&]{
+                  pool_vector<float> ne(inputs.size() > 1 ? std::min<int64_t>(DERIVED_CHUNK, npart) : 0, GPoolAllocator<float>(pool));
+                  pool_vector<float> extra(inputs.size() > 2 ? std::min<int64_t>(DERIVED_CHUNK, npart) : 0, GPoolAllocator<float>(pool));
+                  int64_t c;
+                  while((c = next++) < nchunks){
+                          const int64_t first = c*DERIVED_CHUNK;
+                          const int64_t n = std::min<int64_t>(DERIVED_CHUNK, npart - first);
+                          float * dest = out + first;
+                          int64_t got = ReadBlock<float,1>(inputs[0], dest, n, start_part + first, skip_type);
+                          if(inputs.size() > 1)
+                                  got = std::min(got, ReadBlock<float,1>(inputs[1], &ne[0], n, start_part + first, skip_type));
+                          //Electrons from singly ionised, then doubly ionised, helium
+                          for(size_t k = 2; k < inputs.size(); k++){
+                                  got = std::min(got, ReadBlock<float,1>(inputs[k], &extra[0], n, start_part + first, skip_type));
+                                  const float electrons = k - 1;
+                                  for(int64_t i = 0; i < got; i++)
+                                          ne[i] += electrons*extra[i];
+                          }
+                          if(kind != DERIVED_TEMPERATURE)
+                                  for(int64_t i = 0; i < got; i++)
+                                          dest[i] *= fscale;
+                          else if(inputs.size() == 1){
+                                  const float factor = fscale/(mu_a + mu_b*ne_ionised);
+                                  for(int64_t i = 0; i < got; i++)
+                                          dest[i] *= factor;
+                          }
+                          else
+                                  for(int64_t i = 0; i < got; i++)
+                                          dest[i] = fscale*dest[i]/(mu_a + mu_b*ne[i]);
+                          if(got < n){
+                                  int64_t prev = complete;
+                                  while(first + got < prev && !complete.compare_exchange_weak(prev, first + got));
+                          }
+                  }
+          };
+          if(nthreads <= 0)
+                  nthreads = std::max<int>(std::thread::hardware_concurrency(), 1);
+          nthreads = std::min<int64_t>(nthreads, nchunks);
+          //Small reads are not worth a thread
+          if(nthreads <= 1)
+                  work();
+          else{
+                  std::vector<std::thread> workers;
+                  for(int i = 0; i < nthreads; i++)
+                          workers.push_back(std::thread(work));
+                  for(size_t i = 0; i < workers.size(); i++)
+                          workers[i].join();
+          }
+          if(complete < npart_toread)
+                  WARN("Read %ld particles of %s out of %ld\n",(int64_t) complete,Quantity.c_str(),npart_toread);
+          return complete;
+  }
+
+  std::vector<float> GSnap::ReadDerived(const std::string& Quantity, int skip_type, int nthreads)
+  {
+          std::vector<float> data;
+          const block_handle base = GetBlockHandle(derived_base(Quantity));
+          if(!IsBlock(base)){
+                  WARN("Cannot find %s in this snapshot\n",Quantity.c_str());
+                  return data;
+          }
+          const int types = GetBlockTypes(base);
+          int64_t npart = 0;
+          for(int j = 0; j < N_TYPE; j++)
+                  if((types & (1 << j)) && !(skip_type & (1 << j)))
+                          npart += GetBlockSize(base, j)/GetPartLen(base);
+          if(npart <= 0)
+                  return data;
+          data.resize(npart);
+          data.resize(ReadDerived(Quantity, &data[0], npart, 0, skip_type, nthreads));
+          return data;
+  }
+}
@@ -0,0 +1,58 @@
+/* Cloud-in-cell density, the reference user of GMapReduce*/
+#include "gadgetmapreduce.hpp"
+#include "read_utils.h"
+#include <math.h>
+#include <stdio.h>
+
+namespace GadgetReader{
+
+  int CICDensity(GSnap& snap, int nmesh, std::vector<double>& grid, int type_mask, int nthreads, bool debug)
+  {
+        const gadget_header head = snap.GetHeader(0);
+        const double box = head.BoxSize;
+        if(nmesh <= 0 || !(box > 0)){
+                WARN("Cannot grid onto %d cells in a box of size %g\n",nmesh,box);
+                return 1;
+        }
+        std::vector<std::string> names;
+        names.push_back("POS ");
+        names.push_back("MASS");
+        const double cell = box/nmesh;
+        const int64_t n = nmesh;
+        grid.assign(n*n*n, 0);
+        GMapReduce<float> mr(snap, names, type_mask, nthreads);
+        int ret = mr.Run(grid, [&](const particle_chunk<float>& chunk, std::vector<double>& mesh){
+                const float * pos = chunk.blocks[0];
+                const float * mass = chunk.blocks[1];
+                if(!pos)
+                        return;
+                for(int64_t p = 0; p < chunk.npart; p++){
+                        const double m = mass ? mass[p] : head.mass[chunk.type];
+                        int64_t lo[3], hi[3];
+                        double w[3];
+                        for(int d = 0; d < 3; d++){
+                                //Position in units of cells, measured from the centre of cell 0
+                                double u = pos[3*p+d]/cell - 0.5;
+                                double f = floor(u);
+                                w[d] = u - f;
+                                //Wrap periodically, including particles just outside the box
+                                int64_t i = ((int64_t) f % n + n) % n;
+                                lo[d] = i;
+                                hi[d] = (i + 1) % n;
+                        }
+                        for(int c = 0; c < 8; c++){
+                                const int64_t i = c & 4 ? hi[0] : lo[0], j = c & 2 ? hi[1] : lo[1], k = c & 1 ? hi[2] : lo[2];
+                                const double weight = (c & 4 ? w[0] : 1-w[0]) * (c & 2 ? w[1] : 1-w[1]) * (c & 1 ? w[2] : 1-w[2]);
+                                mesh[(i*n + j)*n + k] += m*weight;
+                        }
+                }
+        }, [](std::vector<double>& into, const std::vector<double>& from){
+                for(size_t i = 0; i < into.size(); i++)
+                        into[i] += from[i];
+        });
+        const double volume = cell*cell*cell;
+        for(size_t i = 0; i < grid.size(); i++)
+                grid[i] /= volume;
+        return ret;
+  }
+}
@@ -0,0 +1,182 @@
+/* Copyright (c) 2010, Simeon Bird <spb41@cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+/** \file
+ * Map/reduce over the particles of a snapshot: blocks are streamed in chunks,
+ * handed to a map function on several threads, and the results of the threads merged.*/
+#ifndef __GADGETMAPREDUCE_H
+#define __GADGETMAPREDUCE_H
+
+#include "gadgetreader.hpp"
+#include <algorithm>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace GadgetReader{
+
+  /** Particles read at once by each thread of GMapReduce*/
+  #define MAPREDUCE_CHUNK (1<<18)
+
+  /** A chunk of particles of one type, handed to the map function of GMapReduce.*/
+  template <class T> struct particle_chunk {
+    /** Type of the particles*/
+    int type;
+    /** Position of the first particle among the particles of its type, in the order GetBlock gives them*/
+    int64_t first;
+    /** Number of particles in the chunk*/
+    int64_t npart;
+    /** Data of each block, in the order the blocks were named, converted to T.
+     * NULL if the block has no particles of this type.*/
+    std::vector<const T *> blocks;
+    /** Elements per particle of each block*/
+    std::vector<int> ncomp;
+  };
+
+  /** Streams blocks of a snapshot through a map function on several threads, then merges the results.
+   * The caller supplies a result type, which must be copyable, and two functions:
+   * map(const particle_chunk<T>& chunk, Result& partial), which adds a chunk to a partial result,
+   * and reduce(Result& into, const Result& from), which merges two partial results.
+   * Each thread owns a partial result, started from a copy of the result passed to Run, so that must be empty (a zeroed grid, a zero sum).
+   * Thread i handles chunks i, i+nthreads, i+2 nthreads and so on, reading the next of its chunks while mapping the current one,
+   * and the partial results are merged in order of thread. So with the same number of threads the answer is always the same,
+   * even for floating point sums. For example, to find the total mass of gas:
+   * \code
+   * std::vector<std::string> blocks(1, "MASS");
+   * GMapReduce<double> mr(snap, blocks, 1<<BARYON_TYPE);
+   * double total = 0;
+   * mr.Run(total, [](const particle_chunk<double>& c, double& sum){
+   *             for(int64_t i = 0; i < c.npart; i++) sum += c.blocks[0][i];
+   *         }, [](double& into, const double& from){ into += from; });
+   * \endcode
+   * @tparam T Type blocks are converted to: float, double, int32_t or int64_t.*/
+  template <class T=float> class GMapReduce {
+    public:
+    /** @param snap Snapshot to read. It must outlive this object.
+     * @param BlockNames Blocks to read. Blocks without a type are passed as NULL for chunks of that type.
+     * @param type_mask Bitfield of the types to read: bit n set reads type n.
+     * @param nthreads Number of threads. 0 means one for each processor.
+     * @param chunk Particles in each chunk.*/
+    GMapReduce(GSnap& snap, const std::vector<std::string>& BlockNames, int type_mask=(1<<N_TYPE)-1, int nthreads=0, int64_t chunk=MAPREDUCE_CHUNK):
+        snap(snap), type_mask(type_mask), nthreads(nthreads > 0 ? nthreads : std::max<int>(std::thread::hardware_concurrency(), 1)), chunk(std::max<int64_t>(chunk, 1))
+    {
+        for(size_t b = 0; b < BlockNames.size(); b++)
+            blocks.push_back(GSnap::GetBlockHandle(BlockNames[b]));
+    }
+    /** Map every chunk and reduce the results into result.
+     * @return 0 on success, 1 if a read failed, in which case result holds whatever was read.*/
+    template <class Result, class Map, class Reduce> int Run(Result& result, Map map, Reduce reduce)
+    {
+        const std::vector<piece> pieces = plan();
+        const int nworkers = std::max<int>(std::min<int64_t>(nthreads, pieces.size()), 1);
+        std::vector<Result> partials(nworkers, result);
+        std::vector<int> failed(nworkers, 0);
+        std::vector<std::thread> workers;
+        for(int w = 0; w < nworkers; w++)
+            workers.push_back(std::thread([&, w]{
+                particle_chunk<T> current, next;
+                std::vector<std::vector<T> > cur_buf, next_buf;
+                if(w < (int) pieces.size())
+                    failed[w] |= read(pieces[w], current, cur_buf);
+                for(size_t p = w; p < pieces.size(); p += nworkers){
+                    //Read the next chunk of this thread while mapping this one
+                    std::future<int> prefetch;
+                    if(p + nworkers < pieces.size())
+                        prefetch = std::async(std::launch::async, [&]{ return read(pieces[p + nworkers], next, next_buf); });
+                    map(current, partials[w]);
+                    if(prefetch.valid()){
+                        failed[w] |= prefetch.get();
+                        std::swap(current, next);
+                        std::swap(cur_buf, next_buf);
+                    }
+                }
+            }));
+        for(size_t w = 0; w < workers.size(); w++)
+            workers[w].join();
+        result = partials[0];
+        for(int w = 1; w < nworkers; w++)
+            reduce(result, partials[w]);
+        for(int w = 0; w < nworkers; w++)
+            if(failed[w])
+                return 1;
+        return 0;
+    }
+    private:
+    /** Particles first to first+npart of a type*/
+    struct piece {
+        int type;
+        int64_t first, npart;
+    };
+    /** Split each type into chunks. A type has as many particles as the first block which has it.*/
+    std::vector<piece> plan()
+    {
+        std::vector<piece> pieces;
+        for(int type = 0; type < N_TYPE; type++){
+            if(!(type_mask & (1 << type)))
+                continue;
+            int64_t npart = 0;
+            for(size_t b = 0; b < blocks.size() && !npart; b++)
+                if(snap.GetBlockTypes(blocks[b]) & (1 << type))
+                    npart = snap.GetBlockSize(blocks[b], type)/snap.GetPartLen(blocks[b]);
+            for(int64_t first = 0; first < npart; first += chunk){
+                piece p = {type, first, std::min(chunk, npart - first)};
+                pieces.push_back(p);
+            }
+        }
+        return pieces;
+    }
+    /** Read the blocks of a piece into buf, and point chunk at them.
+     * @return 0 on success, 1 if a block was short.*/
+    int read(const piece& p, particle_chunk<T>& out, std::vector<std::vector<T> >& buf)
+    {
+        const int skip_type = ((1 << N_TYPE) - 1) & ~(1 << p.type);
+        out.type = p.type;
+        out.first = p.first;
+        out.npart = p.npart;
+        out.blocks.assign(blocks.size(), NULL);
+        out.ncomp.assign(blocks.size(), 0);
+        buf.resize(blocks.size());
+        int ret = 0;
+        for(size_t b = 0; b < blocks.size(); b++){
+            if(!(snap.GetBlockTypes(blocks[b]) & (1 << p.type)))
+                continue;
+            const int ncomp = snap.GetBlockComponents(blocks[b]);
+            buf[b].resize(p.npart*ncomp);
+            if(snap.ReadBlockAs(blocks[b], &buf[b][0], std::is_integral<T>::value ? 'i' : 'f', sizeof(T), ncomp, p.npart, p.first, skip_type) != p.npart)
+                ret = 1;
+            out.blocks[b] = &buf[b][0];
+            out.ncomp[b] = ncomp;
+        }
+        return ret;
+    }
+    GSnap& snap;
+    std::vector<block_handle> blocks;
+    int type_mask;
+    int nthreads;
+    int64_t chunk;
+  };
+
+  /** Cloud-in-cell density of a snapshot on a periodic grid, the box being BoxSize from the header.
+   * Each particle's mass is shared among the eight cells nearest it, with cell i centred on (i+1/2) BoxSize/nmesh.
+   * Masses come from the MASS block, or from the header for types without one.
+   * Built on GMapReduce, so the result does not change from run to run with the same number of threads.
+   * @param grid Filled with nmesh^3 densities, in internal mass per internal length cubed. Cell (i,j,k) is grid[(i*nmesh+j)*nmesh+k].
+   * @param type_mask Bitfield of the types to include.
+   * @param nthreads Number of threads, each of which needs its own grid. 0 means one for each processor.
+   * @param debug Whether runtime warnings are printed.
+   * @return 0 on success, 1 if a read failed.*/
+  DLL_PUBLIC int CICDensity(GSnap& snap, int nmesh, std::vector<double>& grid, int type_mask=(1<<N_TYPE)-1, int nthreads=0, bool debug=true);
+}
+
+#endif //__GADGETMAPREDUCE_H
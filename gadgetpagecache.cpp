@@ -0,0 +1,179 @@
+/* Cache of file pages, for small reads*/
+#include "gadgetreader.hpp"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace GadgetReader{
+
+  GPageCache::GPageCache(size_t max_bytes, size_t page_size, size_t max_files): max_bytes(max_bytes), page_size(std::max<size_t>(page_size, 4096)), max_files(std::max<size_t>(max_files, 1)), cached(0), hits(0), misses(0), generation(0)
+  {
+  }
+
+  GPageCache::~GPageCache()
+  {
+          Clear();
+  }
+
+  GPageCache::open_file::~open_file()
+  {
+          close(fd);
+  }
+
+  void GPageCache::Clear()
+  {
+          std::lock_guard<std::mutex> guard(lock);
+          generation++;
+          pages.clear();
+          index.clear();
+          cached = 0;
+          fds.clear();
+          open_files.clear();
+          open_pos.clear();
+          file_numbers.clear();
+  }
+
+  GPageCache::file_ref GPageCache::get_file(const std::string& file, int& num)
+  {
+          std::map<std::string, int>::iterator it = file_numbers.find(file);
+          if(it == file_numbers.end()){
+                  num = fds.size();
+                  fds.push_back(file_ref());
+                  open_pos.push_back(open_files.end());
+                  file_numbers[file] = num;
+          }
+          else
+                  num = it->second;
+          if(fds[num]){
+                  open_files.splice(open_files.begin(), open_files, open_pos[num]);
+                  return fds[num];
+          }
+          //Closed, either never opened or closed to make room: the file number, and so its cached pages, stay valid
+          int fd = open(file.c_str(), O_RDONLY);
+          if(fd < 0)
+                  return file_ref();
+          fds[num].reset(new open_file(fd));
+          open_files.push_front(num);
+          open_pos[num] = open_files.begin();
+          while(open_files.size() > max_files){
+                  fds[open_files.back()].reset();
+                  open_pos[open_files.back()] = open_files.end();
+                  open_files.pop_back();
+          }
+          return fds[num];
+  }
+
+  /*Read as much of len bytes at offset as there is, retrying short reads*/
+  static int64_t read_at(int fd, char * buf, int64_t len, int64_t offset)
+  {
+          int64_t done = 0;
+          while(done < len){
+                  ssize_t ret = pread(fd, buf + done, len - done, offset + done);
+                  if(ret < 0 && errno == EINTR)
+                          continue;
+                  if(ret < 0)
+                          return -1;
+                  if(ret == 0)
+                          break;
+                  done += ret;
+          }
+          return done;
+  }
+
+  int64_t GPageCache::read_page(int file, const file_ref& fd, int64_t gen, int64_t pagenum, size_t start, size_t len, char * dest)
+  {
+          const page_key key(file, pagenum);
+          {
+                  std::lock_guard<std::mutex> guard(lock);
+                  std::map<page_key, std::list<page>::iterator>::iterator it = index.find(key);
+                  if(gen == generation && it != index.end()){
+                          //Move to the front of the list
+                          pages.splice(pages.begin(), pages, it->second);
+                          hits++;
+                          const std::vector<char>& data = it->second->data;
+                          const size_t got = start < data.size() ? std::min(len, data.size() - start) : 0;
+                          memcpy(dest, &data[0] + start, got);
+                          return got;
+                  }
+                  misses++;
+          }
+          //Read the page without the lock, so other threads can use the cache meanwhile.
+          //The caller's reference keeps the descriptor open, even if the cache closes it.
+          page fresh;
+          fresh.key = key;
+          fresh.data.resize(page_size);
+          int64_t got = read_at(fd->fd, &fresh.data[0], page_size, pagenum*page_size);
+          if(got < 0)
+                  return -1;
+          fresh.data.resize(got);
+          const size_t copied = start < fresh.data.size() ? std::min(len, fresh.data.size() - start) : 0;
+          memcpy(dest, &fresh.data[0] + start, copied);
+          std::lock_guard<std::mutex> guard(lock);
+          //Another thread may have read the same page meanwhile, or the cache may have been cleared
+          if(gen != generation || index.count(key) || page_size > max_bytes)
+                  return copied;
+          cached += fresh.data.size();
+          pages.push_front(page());
+          pages.front().key = key;
+          pages.front().data.swap(fresh.data);
+          index[key] = pages.begin();
+          //Evict the least recently used pages
+          while(cached > max_bytes && !pages.empty()){
+                  cached -= pages.back().data.size();
+                  index.erase(pages.back().key);
+                  pages.pop_back();
+          }
+          return copied;
+  }
+
+  int64_t GPageCache::Read(const std::string& file, int64_t offset, int64_t bytes, void * dest)
+  {
+          int num;
+          int64_t gen;
+          file_ref fd;
+          {
+                  std::lock_guard<std::mutex> guard(lock);
+                  fd = get_file(file, num);
+                  if(!fd)
+                          return -1;
+                  gen = generation;
+          }
+          //Large reads go straight to the file
+          if(bytes > (int64_t) page_size)
+                  return read_at(fd->fd, (char *) dest, bytes, offset);
+          int64_t done = 0;
+          while(done < bytes){
+                  const int64_t pos = offset + done;
+                  const size_t start = pos % page_size;
+                  const size_t len = std::min<int64_t>(bytes - done, page_size - start);
+                  int64_t got = read_page(num, fd, gen, pos / page_size, start, len, (char *) dest + done);
+                  if(got < 0)
+                          return done > 0 ? done : -1;
+                  done += got;
+                  //End of the file
+                  if((size_t) got < len)
+                          break;
+          }
+          return done;
+  }
+
+  int64_t GPageCache::GetHits()
+  {
+          std::lock_guard<std::mutex> guard(lock);
+          return hits;
+  }
+
+  int64_t GPageCache::GetMisses()
+  {
+          std::lock_guard<std::mutex> guard(lock);
+          return misses;
+  }
+
+  size_t GPageCache::GetCachedBytes()
+  {
+          std::lock_guard<std::mutex> guard(lock);
+          return cached;
+  }
+}
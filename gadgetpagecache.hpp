@@ -0,0 +1,104 @@
+/* Copyright (c) 2010, Simeon Bird <spb41@cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+/** \file
+ * Cache of file pages, so that many small reads from the same part of a snapshot
+ * are served from memory rather than each opening, seeking and reading the file.
+ * Included by gadgetreader.hpp; include that rather than this.*/
+#ifndef __GADGETPAGECACHE_H
+#define __GADGETPAGECACHE_H
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace GadgetReader{
+
+  /** A cache of fixed size pages of files, with least recently used pages evicted beyond a memory limit.
+   * Give one to GSnap::SetPageCache to put GetBlock and the reads built on it through the cache.
+   * Reads of more than a page bypass the cache, so bulk reads do not flush it.
+   * Up to max_files files are kept open, the least recently used being closed beyond that.
+   * The cache assumes files do not change: call Clear if they might have.
+   * Thread-safe; one cache may be shared by several snapshots, and Clear may be called while other threads read.*/
+  class DLL_PUBLIC GPageCache {
+    public:
+    /** @param max_bytes Most memory to use for cached pages.
+     * @param page_size Size of a page, in bytes.
+     * @param max_files Most files to keep open at once.*/
+    GPageCache(size_t max_bytes=256<<20, size_t page_size=1<<20, size_t max_files=64);
+    /** Frees the pages and closes the files*/
+    ~GPageCache();
+    /** Read bytes bytes from offset in file into dest, through the cache.
+     * @return Bytes read, which is less than asked for at the end of the file, or -1 if the file could not be opened.*/
+    int64_t Read(const std::string& file, int64_t offset, int64_t bytes, void * dest);
+    /** Drop every cached page and close the files. Files being read by another thread are closed when that read finishes.*/
+    void Clear();
+    /** Number of pages found in the cache*/
+    int64_t GetHits();
+    /** Number of pages which had to be read from disc*/
+    int64_t GetMisses();
+    /** Bytes held in cached pages*/
+    size_t GetCachedBytes();
+    private:
+    GPageCache(const GPageCache&);
+    GPageCache& operator=(const GPageCache&);
+    /** A page is found by file number and page number*/
+    typedef std::pair<int, int64_t> page_key;
+    struct page {
+        page_key key;
+        /** The data, which is shorter than a page at the end of a file*/
+        std::vector<char> data;
+    };
+    /** An open descriptor, closed when the last reader lets go of it,
+     * so that neither Clear nor closing idle files pulls it from under a read in progress.*/
+    struct open_file {
+        int fd;
+        explicit open_file(int fd): fd(fd) {}
+        ~open_file();
+    };
+    typedef std::shared_ptr<open_file> file_ref;
+    /** Get the descriptor of a file, opening it if needed, and closing the least recently used file if too many are open.
+     * Call with the lock held.
+     * @param num Set to the file number.
+     * @return The descriptor, or empty on failure.*/
+    file_ref get_file(const std::string& file, int& num);
+    /** Copy the part of a cached page we want, or read and cache the page.
+     * @param fd Descriptor of file number file, held for the read.
+     * @param gen Value of generation when file was looked up. If the cache has been cleared since,
+     * the file number may now mean another file, so the cache is not used.
+     * @return Bytes copied, or -1 on error.*/
+    int64_t read_page(int file, const file_ref& fd, int64_t gen, int64_t index, size_t start, size_t len, char * dest);
+    size_t max_bytes, page_size, max_files, cached;
+    int64_t hits, misses;
+    /** Incremented by Clear, which forgets the file numbers*/
+    int64_t generation;
+    /** Pages, most recently used first*/
+    std::list<page> pages;
+    std::map<page_key, std::list<page>::iterator> index;
+    /** Files seen since the last Clear: name to file number, and file number to descriptor, empty if closed*/
+    std::map<std::string, int> file_numbers;
+    std::vector<file_ref> fds;
+    /** Numbers of the open files, most recently used first, and where each is in the list*/
+    std::list<int> open_files;
+    std::vector<std::list<int>::iterator> open_pos;
+    std::mutex lock;
+  };
+}
+
+#endif //__GADGETPAGECACHE_H
@@ -0,0 +1,199 @@
+/* Level of detail pyramids: nested random subsamples of a snapshot, each in its own file*/
+#include "gadgetreader.hpp"
+#include "read_utils.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace GadgetReader{
+
+  /*Particles of one type considered at once when writing a pyramid*/
+  #define PYRAMID_CHUNK (1<<20)
+
+  /*Write all of len bytes to fd at offset*/
+  static int write_at(int fd, const void * data, size_t len, int64_t offset)
+  {
+        const char * cdata = (const char *) data;
+        while(len > 0){
+                ssize_t ret = pwrite(fd, cdata, len, offset);
+                if(ret <= 0)
+                        return 1;
+                cdata += ret;
+                len -= ret;
+                offset += ret;
+        }
+        return 0;
+  }
+
+  /*Write the format 2 record markers before a block of len bytes at offset.
+   * Returns the offset of the data.*/
+  static int64_t write_record(int fd, const std::string& name, uint32_t len, int64_t offset)
+  {
+        uint32_t head[5];
+        head[0] = 8;
+        memcpy(&head[1], name.c_str(), 4);
+        head[2] = len + 2*sizeof(uint32_t);
+        head[3] = 8;
+        head[4] = len;
+        if(write_at(fd, head, sizeof(head), offset))
+                return -1;
+        return offset + sizeof(head);
+  }
+
+  std::string GSnap::GetLevelFileName(const std::string& snap_filename, int level)
+  {
+        std::string base = snap_filename;
+        if(base.size() > 2 && base.compare(base.size()-2,2,".0")==0)
+                base.erase(base.size()-2);
+        char tmp[16];
+        snprintf(tmp,16,".lod%d",level);
+        return base + tmp;
+  }
+
+  GSnap GSnap::OpenLevel(const std::string& snap_filename, int level, bool debug)
+  {
+        return GSnap(level > 0 ? GetLevelFileName(snap_filename, level) : snap_filename, debug);
+  }
+
+  int GSnap::WritePyramid(const std::vector<std::string>& BlockNames, int levels, uint64_t seed)
+  {
+        if(levels < 1 || levels > 20){
+                WARN("Cannot write %d levels\n",levels);
+                return 1;
+        }
+        std::vector<std::string> names(1, "POS ");
+        for(size_t b = 0; b < BlockNames.size(); b++)
+                if(std::find(names.begin(), names.end(), BlockNames[b]) == names.end())
+                        names.push_back(BlockNames[b]);
+        for(size_t b = 0; b < names.size(); b++)
+                if(!IsBlock(names[b])){
+                        WARN("Block %s is not in this snapshot\n",names[b].c_str());
+                        return 1;
+                }
+        std::vector<double> fraction(levels);
+        for(int l = 0; l < levels; l++)
+                fraction[l] = ldexp(1, -3*(l+1));
+        //Particles of each type in each level. A particle not in a level is in none of the later ones.
+        std::vector<std::vector<int64_t> > count(levels, std::vector<int64_t>(N_TYPE, 0));
+        for(int t = 0; t < N_TYPE; t++){
+                const int64_t npart = GetNpart(t, true);
+                for(int64_t i = 0; i < npart; i++)
+                        for(int l = 0; l < levels && in_sample(i, fraction[l], seed); l++)
+                                count[l][t]++;
+        }
+        //Lay out each file: the header, then the blocks which have particles in the level, each with its types in order.
+        //type_pos[l][b][t] is where the particles of type t of block b go in level l.
+        gadget_header head = GetHeader(0);
+        const uint32_t headlen = sizeof(gadget_header);
+        std::vector<int> fds(levels, -1);
+        std::vector<std::vector<std::vector<int64_t> > > type_pos(levels, std::vector<std::vector<int64_t> >(names.size(), std::vector<int64_t>(N_TYPE, -1)));
+        int ret = 0;
+        for(int l = 0; l < levels && !ret; l++){
+                const std::string filename = GetLevelFileName(base_filename, l+1);
+                fds[l] = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if(fds[l] < 0){
+                        WARN("Could not open %s for writing: %s\n",filename.c_str(),strerror(errno));
+                        ret = 1;
+                        break;
+                }
+                gadget_header lhead = head;
+                lhead.num_files = 1;
+                for(int t = 0; t < N_TYPE; t++){
+                        if(count[l][t] > UINT32_MAX){
+                                WARN("Level %d has too many particles of type %d for one file\n",l+1,t);
+                                ret = 1;
+                        }
+                        lhead.npart[t] = count[l][t];
+                        lhead.npartTotal[t] = count[l][t] & 0xffffffffu;
+                        lhead.NallHW[t] = count[l][t] >> 32;
+                }
+                int64_t pos = write_record(fds[l], "HEAD", headlen, 0);
+                if(ret || pos < 0 || write_at(fds[l], &lhead, headlen, pos) || write_at(fds[l], &headlen, sizeof(headlen), pos + headlen)){
+                        ret = 1;
+                        break;
+                }
+                pos += headlen + sizeof(headlen);
+                for(size_t b = 0; b < names.size(); b++){
+                        const int types = GetBlockTypes(names[b]);
+                        const short partlen = GetPartLen(names[b]);
+                        int64_t npart = 0;
+                        for(int t = 0; t < N_TYPE; t++)
+                                if(types & (1 << t))
+                                        npart += count[l][t];
+                        if(npart == 0)
+                                continue;
+                        if(npart*partlen > UINT32_MAX){
+                                WARN("Level %d of block %s is too large for one file\n",l+1,names[b].c_str());
+                                ret = 1;
+                                break;
+                        }
+                        const uint32_t len = npart*partlen;
+                        pos = write_record(fds[l], names[b], len, pos);
+                        if(pos < 0 || write_at(fds[l], &len, sizeof(len), pos + len)){
+                                ret = 1;
+                                break;
+                        }
+                        for(int t = 0; t < N_TYPE; t++)
+                                if(types & (1 << t)){
+                                        type_pos[l][b][t] = pos;
+                                        pos += count[l][t]*partlen;
+                                }
+                        pos += sizeof(len);
+                }
+        }
+        //Read the particles of level 1 a chunk at a time, and hand each level those which are in it
+        std::vector<int64_t> index;
+        std::vector<char> buffer;
+        for(size_t b = 0; b < names.size() && !ret; b++){
+                const int types = GetBlockTypes(names[b]);
+                const short partlen = GetPartLen(names[b]);
+                for(int t = 0; t < N_TYPE && !ret; t++){
+                        if(!(types & (1 << t)) || count[0][t] == 0)
+                                continue;
+                        const int skip_type = ((1 << N_TYPE) - 1) & ~(1 << t);
+                        const int64_t npart = GetBlockSize(names[b], t)/partlen;
+                        for(int64_t first = 0; first < npart && !ret; first += PYRAMID_CHUNK){
+                                index.clear();
+                                for(int64_t i = first; i < std::min<int64_t>(first + PYRAMID_CHUNK, npart); i++)
+                                        if(in_sample(i, fraction[0], seed))
+                                                index.push_back(i);
+                                if(index.empty())
+                                        continue;
+                                buffer.resize(index.size()*partlen);
+                                if(GetBlockIndexed(names[b], &buffer[0], index, skip_type) != (int64_t) index.size()){
+                                        WARN("Could not read block %s for the pyramid\n",names[b].c_str());
+                                        ret = 1;
+                                        break;
+                                }
+                                size_t n = index.size();
+                                for(int l = 0; l < levels && n > 0; l++){
+                                        //Keep only the particles in this level, which are in order at the front
+                                        if(l > 0){
+                                                size_t kept = 0;
+                                                for(size_t k = 0; k < n; k++)
+                                                        if(in_sample(index[k], fraction[l], seed)){
+                                                                index[kept] = index[k];
+                                                                memmove(&buffer[kept*partlen], &buffer[k*partlen], partlen);
+                                                                kept++;
+                                                        }
+                                                n = kept;
+                                        }
+                                        if(n > 0 && write_at(fds[l], &buffer[0], n*partlen, type_pos[l][b][t])){
+                                                WARN("Could not write level %d: %s\n",l+1,strerror(errno));
+                                                ret = 1;
+                                                break;
+                                        }
+                                        type_pos[l][b][t] += n*partlen;
+                                }
+                        }
+                }
+        }
+        for(int l = 0; l < levels; l++)
+                if(fds[l] >= 0 && close(fds[l]))
+                        ret = 1;
+        return ret;
+  }
+}
@@ -13,10 +13,15 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
 #include "gadgetreader.hpp"
 #include "read_utils.h"
+#include "gadgetreadplan.hpp"
+#include "crc32c.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <algorithm>
+#include <atomic>
+#include <thread>
 
 //Swap the endianness of the header correctly.
 //doubles need endian swapping differently to ints.
@@ -32,8 +37,10 @@ void header_endian_swap(gadget_header * header)
     ptr = multi_endian_swap((uint32_t *)ptr, 10);
     //cosmology
     ptr = multi_endian_swap64((uint64_t *)ptr, 4);
-    //Remaining material
-    ptr = multi_endian_swap((uint32_t *)ptr, (sizeof(gadget_header)-11*4-12*8)/4);
+    //Flags, high words of npartTotal and the 2lpt scaling factor
+    ptr = multi_endian_swap((uint32_t *)ptr, 12);
+    //Units and OmegaB. The fill after them is left alone.
+    ptr = multi_endian_swap64((uint64_t *)ptr, 4);
 }
 
 
@@ -43,13 +50,18 @@ namespace GadgetReader{
 
 /*Error output macros*/
 #define ERROR(...) do{ fprintf(stderr,__VA_ARGS__);abort();}while(0)
-#define WARN(...) do{ \
-        if(debug){ \
-                fprintf(stderr,"[GadgetReader]: "); \
-                fprintf(stderr, __VA_ARGS__); \
-        }}while(0)
   //Constructor; this does almost all the hard work of building a "map" of the block positions
-  GSnap::GSnap(std::string snap_filename, bool debug, std::vector<std::string> *BlockNames): debug(debug)
+  GSnap::GSnap(std::string snap_filename, bool debug, std::vector<std::string> *BlockNames): debug(debug), pool(NULL), cache(NULL)
+  {
+        open(snap_filename, BlockNames, NULL);
+  }
+
+  GSnap::GSnap(std::string snap_filename, const GSnap& like, bool debug, std::vector<std::string> *BlockNames): debug(debug), pool(NULL), cache(NULL)
+  {
+        open(snap_filename, BlockNames, &like);
+  }
+
+  void GSnap::open(std::string snap_filename, std::vector<std::string> *BlockNames, const GSnap * like)
   {
         f_name first_file=snap_filename;
         FILE *fd;
@@ -70,7 +82,7 @@ namespace GadgetReader{
         }
         fclose(fd);
         //Read the first file
-        GSnapFile first_map(first_file, debug,BlockNames);
+        GSnapFile first_map = (like && like->file_maps.size() > 0) ? GSnapFile(first_file, like->file_maps[0], debug, BlockNames) : GSnapFile(first_file, debug,BlockNames);
         //Set the global variables. 
         base_filename=first_file;
         //Take the ".0" from the end if needed.
@@ -96,8 +108,9 @@ namespace GadgetReader{
                 char tmp[6];
                 snprintf(tmp,6,".%d",i);
                 c_name+=(std::string(tmp));
-                GSnapFile tmp_map(c_name,debug, BlockNames);
-                if(tmp_map.GetNumBlocks() ==0 || !check_headers(tmp_map.header,file_maps[0].header)){
+                //Only use like if it has every file, so its files line up with ours
+                GSnapFile tmp_map = (like && (int) like->file_maps.size() == files_expected) ? GSnapFile(c_name, like->file_maps[i], debug, BlockNames) : GSnapFile(c_name,debug, BlockNames);
+                if(tmp_map.GetNumBlocks() ==0 || !CheckHeaders(tmp_map.header,file_maps[0].header)){
                         WARN("Headers inconsistent between file 0 and file %d, ignoring file %d\n",i,i);
                         continue;
                 }
@@ -119,6 +132,12 @@ namespace GadgetReader{
         return;
   }
 
+  /*Key of a four byte block name as it is on disc, including any bytes after a terminating zero*/
+  static block_key raw_block_key(const char * name)
+  {
+          return ((block_key) (unsigned char) name[0] << 24) | ((unsigned char) name[1] << 16) | ((unsigned char) name[2] << 8) | (unsigned char) name[3];
+  }
+
   //This takes an open file and constructs a map of where the blocks are within it, and then returns said map.
   //It ought to support endian swapped files as well as Gadget-I files.
    GSnapFile::GSnapFile(const f_name strfile, bool debug, std::vector<std::string>* BlockNames) : name(strfile),swap_endian(false), format_2(true), debug(debug)
@@ -215,8 +234,12 @@ namespace GadgetReader{
                           //Next block
                           continue;
                   }
+                  //Most blocks are one float per particle
+                  c_info.dtype='f';
+                  c_info.ncomp=1;
                   //If POS or VEL block, 3 floats per particle.
                   if(strncmp(c_name,"POS ",4)==0 || strncmp(c_name,"VEL ",4)==0) {
+                      c_info.ncomp=3;
                       //Sometimes blocks are in double precision.
                       if (c_info.length == 3*total_file_part*sizeof(double) )
                           c_info.partlen = 3*sizeof(double);
@@ -225,6 +248,7 @@ namespace GadgetReader{
                   }
                   /*A heuristic to detect LongIDs. Won't always work.*/
                   else if(strncmp(c_name,"ID  ",4)==0){
+                          c_info.dtype='i';
                           if(c_info.length == total_file_part*sizeof(int32_t))
                                 c_info.partlen=sizeof(int32_t);
                           else
@@ -267,10 +291,12 @@ namespace GadgetReader{
                   // which assumes that blocks are either fully present or not for a given particle type
                   if(SetBlockTypes(c_info)){
                     //Append the current info to the map; if there are duplicates move ahead one.
-                    while(blocks.count(c_name) > 0){
-                          c_name[3]++;
+                    //All four bytes go in the key, so this works for short names too.
+                    block_key key = raw_block_key(c_name);
+                    while(blocks.count(key) > 0){
+                          key++;
                     }
-                    blocks[std::string(c_name)] = c_info;
+                    blocks[key] = c_info;
                   }
                   else {
                         WARN("SetBlockTypes failed for block %s in file %s, length %lu\n",c_name,file,c_info.length);
@@ -281,6 +307,54 @@ namespace GadgetReader{
           return;
   }
  
+  GSnapFile::GSnapFile(const f_name strfile, const GSnapFile& like, bool debug, std::vector<std::string>* BlockNames) : GSnapFile(like)
+  {
+          name = strfile;
+          this->debug = debug;
+          if(!same_layout(like))
+                  *this = GSnapFile(strfile, debug, BlockNames);
+  }
+
+  bool GSnapFile::same_layout(const GSnapFile& like)
+  {
+          struct stat st_this, st_like;
+          if(like.blocks.empty() || stat(name.c_str(), &st_this) || stat(like.name.c_str(), &st_like) || st_this.st_size != st_like.st_size)
+                  return false;
+          FILE * fd = fopen(name.c_str(), "r");
+          if(!fd)
+                  return false;
+          bool same = !check_filetype(fd) && swap_endian == like.swap_endian && format_2 == like.format_2;
+          //The header comes after the HEAD block header and record size
+          if(same){
+                  gadget_header head;
+                  same = fseek(fd, (format_2 ? 5 : 1)*sizeof(uint32_t), SEEK_SET) == 0 && fread(&head, sizeof(head), 1, fd) == 1;
+                  if(same && swap_endian)
+                          header_endian_swap(&head);
+                  for(int i = 0; same && i < N_TYPE; i++)
+                          same = head.npart[i] == like.header.npart[i];
+                  if(same)
+                          header = head;
+          }
+          //Check the record markers of the last block are where like has them,
+          //which they will not be if the blocks have changed.
+          if(same){
+                  block_map::const_iterator last = like.blocks.begin();
+                  for(block_map::const_iterator it = like.blocks.begin(); it != like.blocks.end(); ++it)
+                          if(it->second.start_pos > last->second.start_pos)
+                                  last = it;
+                  uint32_t head[5];
+                  const int nhead = format_2 ? 5 : 1;
+                  same = fseek(fd, last->second.start_pos - nhead*sizeof(uint32_t), SEEK_SET) == 0 && fread(head, sizeof(uint32_t), nhead, fd) == (size_t) nhead;
+                  if(same && swap_endian)
+                          multi_endian_swap(head, nhead);
+                  same = same && head[nhead-1] == (uint32_t) last->second.length;
+                  if(same && format_2)
+                          same = raw_block_key((char *) &head[1]) == last->first;
+          }
+          fclose(fd);
+          return same;
+  }
+
  /* Read the header of a Gadget file. This is the "block header" not the file header, and gives the 
   * name and length of the block.
   * Return integer length of block. Arguments are:
@@ -361,10 +435,50 @@ namespace GadgetReader{
           return 0;
   }
   
+  /*Read the header of one file, without mapping its blocks*/
+  int ReadHeader(const std::string& filename, gadget_header& header, bool debug)
+  {
+        FILE * fd = fopen(filename.c_str(), "r");
+        if(!fd){
+                WARN("Could not open %s\n",filename.c_str());
+                return 1;
+        }
+        //The first integer tells us the format and endianness, as in check_filetype:
+        //8 for the block header of format 2, 256 for the header record of format 1.
+        uint32_t head[5];
+        bool swap = false, ok = fread(head, sizeof(uint32_t), 1, fd) == 1;
+        if(ok && (head[0] == 134217728 || head[0] == 65536)){
+                swap = true;
+                endian_swap(&head[0]);
+        }
+        //Skip the name record of format 2 files: name, length, 8, then the header record size
+        if(ok && head[0] == 8){
+                ok = fread(head, sizeof(uint32_t), 4, fd) == 4;
+                if(swap)
+                        multi_endian_swap(head+1, 3);
+                //Accept the name swapped too, as read_block_head would swap it
+                ok = ok && (strncmp((char *) &head[0], "HEAD", 4) == 0 || strncmp((char *) &head[0], "DAEH", 4) == 0) && head[3] == sizeof(gadget_header);
+        }
+        else if(!ok || head[0] != sizeof(gadget_header))
+                ok = false;
+        uint32_t record_size = 0;
+        ok = ok && fread(&header, sizeof(gadget_header), 1, fd) == 1 && fread(&record_size, sizeof(uint32_t), 1, fd) == 1;
+        fclose(fd);
+        if(swap){
+                endian_swap(&record_size);
+                header_endian_swap(&header);
+        }
+        if(!ok || record_size != sizeof(gadget_header)){
+                WARN("Could not read HEAD from %s\n",filename.c_str());
+                return 1;
+        }
+        return 0;
+  }
+
   /*Check the consistency of file headers. This is just a short sanity check 
    * to make sure the user hasn't put two entirely different simulations with the same 
    * snapshot name in the same directory or something*/
-  bool GSnap::check_headers(const gadget_header& head1, const gadget_header& head2)
+  bool CheckHeaders(const gadget_header& head1, const gadget_header& head2)
   {
     /*Check single quantities*/
     /*Even the floats ought to be really identical if we have read them from disc*/
@@ -410,50 +524,75 @@ namespace GadgetReader{
           return (npart << 32) + file_maps[0].header.npartTotal[type];
   }
 
+  block_handle GSnap::GetBlockHandle(const std::string& BlockName)
+  {
+        block_handle block;
+        block.key = make_block_key(BlockName);
+        return block;
+  }
+
   /*Check the given block exists*/
-  bool GSnap::IsBlock(std::string BlockName)
+  bool GSnap::IsBlock(const std::string& BlockName)
+  {
+        return IsBlock(GetBlockHandle(BlockName));
+  }
+
+  bool GSnap::IsBlock(block_handle block)
   {
-        //Find total number of particles needed
         for(unsigned int i=0; i<file_maps.size(); i++)
-                if(file_maps[i].blocks.count(BlockName))
+                if(file_maps[i].blocks.count(block.key))
                         return true;
         return false;
   }
   
   /*Get number of particles a block has data for*/
-  int64_t GSnap::GetBlockParts(std::string BlockName)
+  int64_t GSnap::GetBlockParts(const std::string& BlockName)
+  {
+        return GetBlockParts(GetBlockHandle(BlockName));
+  }
+
+  int64_t GSnap::GetBlockParts(block_handle block)
   {
         int64_t size=0;
         //Find total number of particles needed
-        for(unsigned int i=0; i<file_maps.size(); i++)
-                if(file_maps[i].blocks.count(BlockName))
-                        size+=file_maps[i].blocks[BlockName].length/file_maps[i].blocks[BlockName].partlen;
+        for(unsigned int i=0; i<file_maps.size(); i++){
+                const block_info * cur_block = file_maps[i].blocks.find(block.key);
+                if(cur_block)
+                        size+=cur_block->length/cur_block->partlen;
+        }
         return size;
   }
 
   /*Get total size of a block in the snapshot, in bytes*/
-  int64_t GSnap::GetBlockSize(std::string BlockName, int type)
+  int64_t GSnap::GetBlockSize(const std::string& BlockName, int type)
+  {
+        return GetBlockSize(GetBlockHandle(BlockName), type);
+  }
+
+  int64_t GSnap::GetBlockSize(block_handle block, int type)
   {
         int64_t size=0;
         //Find total number of particles needed
-        for(unsigned int i=0; i<file_maps.size(); i++)
-                if(file_maps[i].blocks.count(BlockName)){
-                        if(type >= 0 && type < N_TYPE)
-                                size+=file_maps[i].header.npart[type]*file_maps[i].blocks[BlockName].partlen;
-                        else
-                                size+=file_maps[i].blocks[BlockName].length;
-                }
+        for(unsigned int i=0; i<file_maps.size(); i++){
+                const block_info * cur_block = file_maps[i].blocks.find(block.key);
+                if(!cur_block)
+                        continue;
+                if(type >= 0 && type < N_TYPE)
+                        size+=file_maps[i].header.npart[type]*cur_block->partlen;
+                else
+                        size+=cur_block->length;
+        }
         return size;
   }
 
   /*Get a set of the block names in the snapshot*/
   std::set<std::string> GSnap::GetBlocks()
   {
-          std::map<std::string,block_info>::iterator it;
+          block_map::iterator it;
           std::set<std::string> names;
           for(unsigned int i=0; i<file_maps.size();i++)
                 for(it=file_maps[i].blocks.begin() ; it != file_maps[i].blocks.end(); it++)
-                          names.insert((*it).first);
+                          names.insert(block_key_name((*it).first));
           return names;
   }
 
@@ -468,14 +607,28 @@ namespace GadgetReader{
    *        Only skip types for which the block is actually present:
    *        Unfortunately there is no way of the library knowing which particle has which type, so 
    *        there is no way of telling that in advance.  */
-  int64_t GSnap::GetBlock(std::string BlockName, void *block, int64_t npart_toread, int64_t start_part, int skip_type)
+  int64_t GSnap::GetBlock(const std::string& BlockName, void *block, int64_t npart_toread, int64_t start_part, int skip_type)
+  {
+        return get_block(make_block_key(BlockName), block, npart_toread, start_part, skip_type, true);
+  }
+
+  int64_t GSnap::GetBlock(block_handle block, void *data, int64_t npart_toread, int64_t start_part, int skip_type)
+  {
+        return get_block(block.key, data, npart_toread, start_part, skip_type, true);
+  }
+
+  int64_t GSnap::get_block(block_key key, void *block, int64_t npart_toread, int64_t start_part, int skip_type, bool swap)
   {
         int64_t npart_read=0;
         //Check the block really exists
-        if(!IsBlock(BlockName)){
-                WARN("Block %s is not in this snapshot\n",BlockName.c_str());
+        block_handle handle = {key};
+        if(!IsBlock(handle)){
+                WARN("Block %s is not in this snapshot\n",block_key_name(key).c_str());
                 return 0;
         }
+        //Nothing to read; a negative count would wrap npart_file below
+        if(npart_toread <= 0)
+                return 0;
         //Read a chunk of particles from a file
         for(unsigned int i=0;i<file_maps.size(); i++){
                 uint32_t read_data,npart_file;
@@ -483,21 +636,24 @@ namespace GadgetReader{
                 FILE *fd;
                 block_info cur_block;
                 //Get current block
-                if(file_maps[i].blocks.count(BlockName))
-                        cur_block=file_maps[i].blocks[BlockName];
+                if(file_maps[i].blocks.count(key))
+                        cur_block=*file_maps[i].blocks.find(key);
                 else{
-                       WARN("Block %s not in file %d\n",BlockName.c_str(),i);
+                       WARN("Block %s not in file %d\n",block_key_name(key).c_str(),i);
                        continue;
                 }
                 npart_file = cur_block.length/cur_block.partlen;
-                //Don't want to read the skip_types
+                //Don't want to read the skip_types.
+                //Types which are not in this block have no data to skip.
                 for(int j=0; j<N_TYPE;j++)
-                        if(skip_type & (1 << j))
+                        if(cur_block.p_types[j] && (skip_type & (1 << j)))
                                 npart_file-=file_maps[i].header.npart[j];
                 //So now we have the amount of data to read, and we want to find the starting position 
                 start_pos=cur_block.start_pos;
                 //Don't want to read the skip_types before the start of our first type.
                 for(int j=0; j<N_TYPE;j++){
+                        if(!cur_block.p_types[j])
+                                continue;
                         if(skip_type & (1 << j))
                                 start_pos+=file_maps[i].header.npart[j]*cur_block.partlen;
                         else 
@@ -520,32 +676,41 @@ namespace GadgetReader{
                 if(npart_file > npart_toread-npart_read)
                        npart_file=npart_toread-npart_read;
                                 
-                //Open file: If this fails skip to the next file.
-                if(!(fd=fopen(file_maps[i].name.c_str(),"r"))){
-                        WARN("Could not open file %d of %lu, continuing\n",i,file_maps.size());
-                        continue;
-                }
                 //Check whether need to swap endianness
-                bool swap_endian = file_maps[i].GetFormat() & 2;
-                //Seek to first particle
-                if(fseek(fd,start_pos,SEEK_SET) == -1)
-                        WARN("Failed to seek\n");
-                //Read the data!
-                read_data=fread(((char *)block)+npart_read*cur_block.partlen,cur_block.partlen,npart_file,fd);
+                bool swap_endian = swap && (file_maps[i].GetFormat() & 2);
+                if(cache){
+                        int64_t bytes = cache->Read(file_maps[i].name, start_pos, (int64_t) npart_file*cur_block.partlen, ((char *)block)+npart_read*cur_block.partlen);
+                        if(bytes < 0){
+                                WARN("Could not open file %d of %lu, continuing\n",i,file_maps.size());
+                                continue;
+                        }
+                        read_data = bytes/cur_block.partlen;
+                }
+                else{
+                        //Open file: If this fails skip to the next file.
+                        if(!(fd=fopen(file_maps[i].name.c_str(),"r"))){
+                                WARN("Could not open file %d of %lu, continuing\n",i,file_maps.size());
+                                continue;
+                        }
+                        //Seek to first particle
+                        if(fseek(fd,start_pos,SEEK_SET) == -1)
+                                WARN("Failed to seek\n");
+                        //Read the data!
+                        read_data=fread(((char *)block)+npart_read*cur_block.partlen,cur_block.partlen,npart_file,fd);
+                        fclose(fd);
+                }
                 if(swap_endian){
-                    //Swap the endianness of the data.
-                    //If we have 1 64-bit entry (say, particle ID) swap it 64-bit wise.
-                    //FIXME: This will fail for, eg, 3D 64-bit entries.
-                    //Otherwise, swap it 32-bit wise.
-                    if (cur_block.partlen == 8)
-                        multi_endian_swap64((uint64_t *)block+npart_read*cur_block.partlen,npart_file);
+                    //Swap the endianness of the data, one element at a time:
+                    //64-bit wise for IDs and double precision blocks, 32-bit wise otherwise.
+                    char * start = ((char *)block)+npart_read*cur_block.partlen;
+                    if (cur_block.partlen / cur_block.ncomp == 8)
+                        multi_endian_swap64((uint64_t *)start,read_data*cur_block.partlen/8);
                     else
-                        multi_endian_swap((uint32_t *)block+npart_read*cur_block.partlen,npart_file*cur_block.partlen/4);
+                        multi_endian_swap((uint32_t *)start,read_data*cur_block.partlen/4);
                 }
                 //Don't die if we read the wrong amount of data; maybe we can find it in the next file.
                 if(read_data !=npart_file)
                         WARN("Only read %u particles of %u from file %d\n",read_data,npart_file,i);
-                fclose(fd);
                 npart_read+=read_data;
                 if(npart_read == npart_toread) //We have enough
                         break;
@@ -569,103 +734,529 @@ namespace GadgetReader{
         return file_maps[i].header;
   }
 
+  /*Get a bitfield of the particle types a block has data for*/
+  int GSnap::GetBlockTypes(const std::string& BlockName)
+  {
+        return GetBlockTypes(GetBlockHandle(BlockName));
+  }
+
+  int GSnap::GetBlockTypes(block_handle block)
+  {
+        int types=0;
+        for(unsigned int i=0; i<file_maps.size(); i++){
+                const block_info * cur_block = file_maps[i].blocks.find(block.key);
+                if(!cur_block)
+                        continue;
+                //Only trust the type heuristic for types actually present in this file
+                for(int j=0; j<N_TYPE; j++)
+                        if(cur_block->p_types[j] && file_maps[i].header.npart[j] > 0)
+                                types |= (1 << j);
+        }
+        return types;
+  }
+
+  /*Get the length per particle*/
+  short GSnap::GetPartLen(const std::string& BlockName)
+  {
+          return GetPartLen(GetBlockHandle(BlockName));
+  }
+
+  short GSnap::GetPartLen(block_handle block)
+  {
+          for(unsigned int i=0; i<file_maps.size();i++){
+                  const block_info * cur_block = file_maps[i].blocks.find(block.key);
+                  if(cur_block)
+                          return cur_block->partlen;
+          }
+          return 0;
+  }
+
+  /*Get the element type*/
+  char GSnap::GetBlockDType(const std::string& BlockName)
+  {
+          return GetBlockDType(GetBlockHandle(BlockName));
+  }
+
+  char GSnap::GetBlockDType(block_handle block)
+  {
+          for(unsigned int i=0; i<file_maps.size();i++){
+                  const block_info * cur_block = file_maps[i].blocks.find(block.key);
+                  if(cur_block)
+                          return cur_block->dtype;
+          }
+          return 0;
+  }
+
+  /*Get the number of elements per particle*/
+  int GSnap::GetBlockComponents(const std::string& BlockName)
+  {
+          return GetBlockComponents(GetBlockHandle(BlockName));
+  }
+
+  int GSnap::GetBlockComponents(block_handle block)
+  {
+          for(unsigned int i=0; i<file_maps.size();i++){
+                  const block_info * cur_block = file_maps[i].blocks.find(block.key);
+                  if(cur_block)
+                          return cur_block->ncomp;
+          }
+          return 0;
+  }
+
+  /*Get the locations of the particles of one type in a block*/
+  std::vector<block_segment> GSnap::GetBlockSegments(const std::string& BlockName, int type)
+  {
+        return GetBlockSegments(GetBlockHandle(BlockName), type);
+  }
+
+  std::vector<block_segment> GSnap::GetBlockSegments(block_handle block, int type)
+  {
+        std::vector<block_segment> segments;
+        if(type < 0 || type >= N_TYPE)
+                return segments;
+        for(unsigned int i=0; i<file_maps.size(); i++){
+                if(!file_maps[i].blocks.count(block.key))
+                        continue;
+                const block_info& cur_block=*file_maps[i].blocks.find(block.key);
+                if(!cur_block.p_types[type] || file_maps[i].header.npart[type] == 0)
+                        continue;
+                block_segment seg;
+                seg.file = i;
+                seg.offset = cur_block.start_pos;
+                //Skip the earlier types in this block
+                for(int j=0; j<type; j++)
+                        if(cur_block.p_types[j])
+                                seg.offset+=file_maps[i].header.npart[j]*cur_block.partlen;
+                seg.npart = file_maps[i].header.npart[type];
+                segments.push_back(seg);
+        }
+        return segments;
+  }
+
+  GSnapData::~GSnapData()
+  {
+          clear();
+  }
+
+  void GSnapData::clear()
+  {
+          if(pool)
+                  pool->Release(arena);
+          else
+                  free(arena);
+          arena = NULL;
+          arena_size = 0;
+          blocks.clear();
+  }
+
+  const loaded_block * GSnapData::GetBlock(const std::string& BlockName) const
+  {
+          std::map<std::string, loaded_block>::const_iterator it = blocks.find(BlockName);
+          if(it == blocks.end())
+                  return NULL;
+          return &(it->second);
+  }
+
+  //Alignment of each block in the arena
+  #define LOAD_ALIGN 64
+  int GSnap::Load(const std::vector<std::string>& BlockNames, int type_mask, GSnapData& out)
+  {
+          out.clear();
+          std::vector<std::string> names;
+          std::vector<int64_t> offsets;
+          size_t total = 0;
+          //Size each block, and give it a place in the arena
+          for(size_t b = 0; b < BlockNames.size(); b++){
+                  const std::string& name = BlockNames[b];
+                  const block_handle handle = GetBlockHandle(name);
+                  if(!IsBlock(handle)){
+                          WARN("Block %s is not in this snapshot\n",name.c_str());
+                          continue;
+                  }
+                  if(out.blocks.count(name))
+                          continue;
+                  loaded_block block;
+                  block.data = NULL;
+                  block.partlen = GetPartLen(handle);
+                  block.dtype = GetBlockDType(handle);
+                  block.ncomp = GetBlockComponents(handle);
+                  block.npart = 0;
+                  for(int j = 0; j < N_TYPE; j++)
+                          if(type_mask & (1 << j)){
+                                  std::vector<block_segment> segs = GetBlockSegments(handle, j);
+                                  for(size_t k = 0; k < segs.size(); k++)
+                                          block.npart += segs[k].npart;
+                          }
+                  out.blocks[name] = block;
+                  names.push_back(name);
+                  offsets.push_back(total);
+                  total += (block.npart*block.partlen + LOAD_ALIGN - 1) / LOAD_ALIGN * LOAD_ALIGN;
+          }
+          if(total > 0 && out.pool)
+                  out.arena = (char *) out.pool->Allocate(total);
+          else if(total > 0 && posix_memalign((void **) &out.arena, LOAD_ALIGN, total))
+                  out.arena = NULL;
+          if(total > 0 && !out.arena){
+                  WARN("Could not allocate %lu bytes to load %lu blocks\n",total,names.size());
+                  out.blocks.clear();
+                  return 1;
+          }
+          out.arena_size = total;
+          //Queue every read: for each block, particles go file by file, then type by type,
+          //as in GetBlock. The planner merges them into a few large reads per file.
+          GReadPlan plan;
+          for(size_t b = 0; b < names.size(); b++){
+                  loaded_block& block = out.blocks[names[b]];
+                  block.data = out.arena + offsets[b];
+                  char * dest = (char *) block.data;
+                  std::vector<std::vector<block_segment> > by_type(N_TYPE);
+                  for(int j = 0; j < N_TYPE; j++)
+                          if(type_mask & (1 << j))
+                                  by_type[j] = GetBlockSegments(names[b], j);
+                  for(int i = 0; i < GetNumFiles(); i++)
+                          for(int j = 0; j < N_TYPE; j++)
+                                  for(size_t k = 0; k < by_type[j].size(); k++){
+                                          if(by_type[j][k].file != i)
+                                                  continue;
+                                          plan.add(i, by_type[j][k].offset, by_type[j][k].npart*block.partlen, dest);
+                                          dest += by_type[j][k].npart*block.partlen;
+                                  }
+          }
+          std::vector<std::string> files;
+          for(size_t i = 0; i < file_maps.size(); i++)
+                  files.push_back(file_maps[i].name);
+          int ret = plan.execute(files, debug);
+          //Endian swap, one element at a time
+          if(GetFormat() & 2){
+                  for(size_t b = 0; b < names.size(); b++){
+                          loaded_block& block = out.blocks[names[b]];
+                          if(block.partlen / block.ncomp == 8)
+                                  multi_endian_swap64((uint64_t *) block.data, block.npart*block.partlen/8);
+                          else
+                                  multi_endian_swap((uint32_t *) block.data, block.npart*block.partlen/4);
+                  }
+          }
+          return ret;
+  }
+
+  //Bytes read at a time when checking a block
+  #define VERIFY_CHUNK (4<<20)
+  /*Check the blocks of one file against its sidecar. Returns 0 if all match, 1 if any do not, 2 if there is no sidecar.*/
+  static int verify_file(const GSnapFile& file, bool debug)
+  {
+          FILE * sums = fopen((file.name+".crc32c").c_str(), "r");
+          if(!sums)
+                  return 2;
+          FILE * fd = fopen(file.name.c_str(), "rb");
+          if(!fd){
+                  WARN("Can't open %s to verify it\n",file.name.c_str());
+                  fclose(sums);
+                  return 1;
+          }
+          std::vector<char> buf(VERIFY_CHUNK);
+          char line[256];
+          int ret = 0;
+          while(fgets(line, sizeof(line), sums)){
+                  //Each line is: checksum, bytes, block name. The name may end with spaces.
+                  unsigned int want;
+                  uint64_t bytes;
+                  int name_at;
+                  if(sscanf(line, "%x %lu %n", &want, &bytes, &name_at) != 2){
+                          WARN("Malformed checksum line in %s.crc32c: %s",file.name.c_str(),line);
+                          ret = 1;
+                          continue;
+                  }
+                  std::string name(line+name_at);
+                  if(!name.empty() && name[name.size()-1] == '\n')
+                          name.erase(name.size()-1);
+                  const block_info * block = file.blocks.find(make_block_key(name));
+                  if(!block || block->length != bytes){
+                          WARN("Block %s of %s is missing or has the wrong length\n",name.c_str(),file.name.c_str());
+                          ret = 1;
+                          continue;
+                  }
+                  uint32_t crc = 0;
+                  uint64_t done = 0;
+                  if(fseek(fd, block->start_pos, SEEK_SET) == 0)
+                          while(done < bytes){
+                                  size_t len = std::min<uint64_t>(bytes - done, VERIFY_CHUNK);
+                                  if(fread(&buf[0], 1, len, fd) != len)
+                                          break;
+                                  crc = crc32c(crc, &buf[0], len);
+                                  done += len;
+                          }
+                  if(done != bytes){
+                          WARN("Could not read block %s of %s\n",name.c_str(),file.name.c_str());
+                          ret = 1;
+                  }
+                  else if(crc != want){
+                          WARN("Checksum mismatch in block %s of %s: %08x, not %08x\n",name.c_str(),file.name.c_str(),crc,want);
+                          ret = 1;
+                  }
+          }
+          fclose(fd);
+          fclose(sums);
+          return ret;
+  }
+
+  int GSnap::Verify(int nthreads)
+  {
+          if(nthreads <= 0)
+                  nthreads = std::max<int>(std::thread::hardware_concurrency(), 1);
+          std::vector<int> results(file_maps.size());
+          std::atomic<size_t> next(0);
+          std::vector<std::thread> workers;
+          for(int i = 0; i < std::max(std::min<int>(nthreads, file_maps.size()), 1); i++)
+                  workers.push_back(std::thread([&]{
+                          size_t j;
+                          while((j = next++) < file_maps.size())
+                                  results[j] = verify_file(file_maps[j], debug);
+                  }));
+          for(size_t i = 0; i < workers.size(); i++)
+                  workers[i].join();
+          int ret = 2;
+          for(size_t i = 0; i < results.size(); i++){
+                  if(results[i] == 1)
+                          return 1;
+                  if(results[i] == 0)
+                          ret = 0;
+          }
+          return ret;
+  }
+
   /*Set the length per particle*/
-  void GSnap::SetPartLen(std::string BlockName, short partlen)
+  void GSnap::SetPartLen(const std::string& BlockName, short partlen)
+  {
+          SetPartLen(GetBlockHandle(BlockName), partlen);
+  }
+
+  void GSnap::SetPartLen(block_handle block, short partlen)
   {
           for(unsigned int i=0; i<file_maps.size();i++){
-                  if(file_maps[i].blocks.count(BlockName))
-                          file_maps[i].blocks[BlockName].partlen=partlen;
+                  block_info * cur_block = file_maps[i].blocks.find(block.key);
+                  if(cur_block)
+                          cur_block->partlen=partlen;
           }
           return;
   }
   
-  #define MIN_READ_SPLIT 6000
-  /*Memory-safe wrapper functions for the bindings. It is not anticipated that people writing codes in C 
-   * will want to use these, as they need to allocate a significant quantity of temporary memory.
-   * We do not attempt to work out whether the block requested is a float or an int.*/
-  std::vector<float> GSnap::GetBlock(std::string BlockName, int64_t npart_toread, int64_t start_part, int skip_type)
+  /*Convert one element of type In, which may need endian swapping, to type Out*/
+  template <class In, class Out> static inline Out convert_element(const char * in, bool swap)
   {
-          std::vector<float> data;
-          float* block=NULL;
-          int64_t read_chunk, total_read=0, read;
-          short partlen;
-          if(!IsBlock(BlockName))
-                  return data;
-          partlen=file_maps[0].blocks[BlockName].partlen;
-          /*If it is a small amount of data, read it all at once*/
-          if(npart_toread < MIN_READ_SPLIT)
-                  read_chunk=npart_toread;
+          In val;
+          if(swap && sizeof(In) == 4){
+              uint32_t bits;
+              memcpy(&bits, in, sizeof(In));
+              endian_swap(&bits);
+              memcpy(&val, &bits, sizeof(In));
+          }
+          else if(swap){
+              uint64_t bits;
+              memcpy(&bits, in, sizeof(In));
+              endian_swap_64(&bits);
+              memcpy(&val, &bits, sizeof(In));
+          }
           else
-          /*Read a third of the data at a time.*/
-                  read_chunk=MIN_READ_SPLIT+1;
-          /*Allocate memory*/
-          if(!(block=(float *)malloc(read_chunk*partlen))){
-                  WARN("Could not allocate temporary memory for particles!\n");
-                  return data;
+              memcpy(&val, in, sizeof(In));
+          return (Out) val;
+  }
+
+  /*Convert n elements of type In to type Out, taking every in_stride-th element of in
+   * and putting them every out_stride-th element of out.
+   * The common cases have constant strides, so the compiler can vectorise them.*/
+  template <class In, class Out> static void convert_elements(const char * in, Out * out, int64_t n, bool swap, int in_stride, int out_stride)
+  {
+          if(in_stride == 1 && out_stride == 1)
+              for(int64_t i=0; i<n; i++)
+                  out[i] = convert_element<In, Out>(in+i*sizeof(In), swap);
+          //One coordinate of POS or VEL
+          else if(in_stride == 3 && out_stride == 1)
+              for(int64_t i=0; i<n; i++)
+                  out[i] = convert_element<In, Out>(in+3*i*sizeof(In), swap);
+          else
+              for(int64_t i=0; i<n; i++)
+                  out[i*out_stride] = convert_element<In, Out>(in+i*in_stride*sizeof(In), swap);
+  }
+
+  /*Convert from whatever is in the file to Out*/
+  template <class Out> static bool convert_from(char dtype, int size, const char * in, void * out, int64_t n, bool swap, int in_stride=1, int out_stride=1)
+  {
+          if(dtype == 'f' && size == 4)
+                  convert_elements<float, Out>(in, (Out *) out, n, swap, in_stride, out_stride);
+          else if(dtype == 'f' && size == 8)
+                  convert_elements<double, Out>(in, (Out *) out, n, swap, in_stride, out_stride);
+          else if(dtype == 'i' && size == 4)
+                  convert_elements<int32_t, Out>(in, (Out *) out, n, swap, in_stride, out_stride);
+          else if(dtype == 'i' && size == 8)
+                  convert_elements<int64_t, Out>(in, (Out *) out, n, swap, in_stride, out_stride);
+          else
+                  return false;
+          return true;
+  }
+
+  //Size of the staging buffer used for converting reads
+  #define CONVERT_CHUNK (1<<22)
+  int64_t GSnap::ReadBlockAs(const std::string& BlockName, void *out, char dtype, int size, int ncomp, int64_t npart_toread, int64_t start_part, int skip_type)
+  {
+          return ReadBlockAs(GetBlockHandle(BlockName), out, dtype, size, ncomp, npart_toread, start_part, skip_type);
+  }
+
+  int64_t GSnap::ReadBlockAs(block_handle block, void *out, char dtype, int size, int ncomp, int64_t npart_toread, int64_t start_part, int skip_type)
+  {
+          if(!IsBlock(block)){
+                  WARN("Block %s is not in this snapshot\n",block_key_name(block.key).c_str());
+                  return 0;
+          }
+          const short partlen = GetPartLen(block);
+          const int ncomp_file = GetBlockComponents(block);
+          const char dtype_file = GetBlockDType(block);
+          if(ncomp != ncomp_file || partlen % ncomp_file){
+                  WARN("Block %s has %d elements per particle (%d bytes), not %d\n",block_key_name(block.key).c_str(),ncomp_file,partlen,ncomp);
+                  return 0;
+          }
+          const int size_file = partlen/ncomp_file;
+          if(npart_toread <= 0)
+                  return 0;
+          //Nothing to convert: read straight into the output
+          if(dtype == dtype_file && size == size_file)
+                  return get_block(block.key, out, npart_toread, start_part, skip_type, true);
+          if((size != 4 && size != 8) || (dtype != 'f' && dtype != 'i') || (size_file != 4 && size_file != 8)){
+                  WARN("Cannot convert block %s from %c%d to %c%d\n",block_key_name(block.key).c_str(),dtype_file,size_file,dtype,size);
+                  return 0;
           }
-          /*Read a segment*/
+          //Files of one snapshot share an endianness
+          const bool swap = GetFormat() & 2;
+          const int64_t chunk = std::max<int64_t>(CONVERT_CHUNK/partlen, 1);
+          pool_vector<char> staging(std::min(chunk, npart_toread)*partlen, GPoolAllocator<char>(pool));
+          int64_t total_read=0;
           while(total_read < npart_toread){
-                  /*For final segment to avoid off-by-one error*/
-                  if(read_chunk > npart_toread-total_read)
-                          read_chunk=npart_toread-total_read;
-                  read= GetBlock(BlockName, block, read_chunk, start_part+total_read, skip_type);
-                  /*Assume we read all of them; otherwise if one day we fail to read, 
-                   * the loop will not stop*/
-                  total_read+=read_chunk;
-                  /*Append what we have to the vector*/
-                  for(uint64_t i=0; i< read*partlen/sizeof(float); i++)
-                          data.push_back(block[i]);
+                  int64_t read = get_block(block.key, &staging[0], std::min(chunk, npart_toread-total_read), start_part+total_read, skip_type, false);
+                  if(read <= 0)
+                          break;
+                  char * dest = ((char *) out) + total_read*ncomp*size;
+                  if(dtype == 'f' && size == 4)
+                          convert_from<float>(dtype_file, size_file, &staging[0], dest, read*ncomp, swap);
+                  else if(dtype == 'f')
+                          convert_from<double>(dtype_file, size_file, &staging[0], dest, read*ncomp, swap);
+                  else if(size == 4)
+                          convert_from<int32_t>(dtype_file, size_file, &staging[0], dest, read*ncomp, swap);
+                  else
+                          convert_from<int64_t>(dtype_file, size_file, &staging[0], dest, read*ncomp, swap);
+                  total_read+=read;
           }
-          free(block);
-          return data;
+          return total_read;
   }
 
-  /*Support getting IDs: is exactly the same as the above*/
-  std::vector<long long> GSnap::GetBlockInt(std::string BlockName, int64_t npart_toread, int64_t start_part, int skip_type)
+  //Size of the staging buffer used by ReadComponentsAs: small, so each chunk is still in cache as every element is picked out
+  #define COMPONENT_CHUNK (1<<18)
+  int64_t GSnap::ReadComponentsAs(block_handle block, void *out, char dtype, int size, int components, int64_t npart_toread, int64_t start_part, int skip_type, bool planar)
   {
-          std::vector<long long> data;
-          int64_t* block=NULL;
-          int64_t read_chunk, total_read=0, read;
-          short partlen;
-          if(!IsBlock(BlockName))
-                  return data;
-          partlen=file_maps[0].blocks[BlockName].partlen;
-          /*If it is a small amount of data, read it all at once*/
-          if(npart_toread < MIN_READ_SPLIT)
-                  read_chunk=npart_toread;
-          else
-          /*Read a third of the data at a time.*/
-                  read_chunk=MIN_READ_SPLIT+1;
-          /*Allocate memory*/
-          if(!(block=(int64_t *)malloc(read_chunk*partlen))){
-                  WARN("Could not allocate temporary memory for particles!\n");
-                  return data;
+          if(!IsBlock(block)){
+                  WARN("Block %s is not in this snapshot\n",block_key_name(block.key).c_str());
+                  return 0;
+          }
+          const short partlen = GetPartLen(block);
+          const int ncomp_file = GetBlockComponents(block);
+          const char dtype_file = GetBlockDType(block);
+          const int size_file = partlen/ncomp_file;
+          if(components <= 0 || components >= (1 << ncomp_file)){
+                  WARN("Block %s has %d elements per particle, so cannot read elements %x\n",block_key_name(block.key).c_str(),ncomp_file,components);
+                  return 0;
+          }
+          if((size != 4 && size != 8) || (dtype != 'f' && dtype != 'i') || (size_file != 4 && size_file != 8)){
+                  WARN("Cannot convert block %s from %c%d to %c%d\n",block_key_name(block.key).c_str(),dtype_file,size_file,dtype,size);
+                  return 0;
           }
-          /*Read a segment*/
+          if(npart_toread <= 0)
+                  return 0;
+          std::vector<int> chosen;
+          for(int c = 0; c < ncomp_file; c++)
+                  if(components & (1 << c))
+                          chosen.push_back(c);
+          const int nchosen = chosen.size();
+          const bool swap = GetFormat() & 2;
+          const int64_t chunk = std::max<int64_t>(COMPONENT_CHUNK/partlen, 1);
+          pool_vector<char> staging(std::min(chunk, npart_toread)*partlen, GPoolAllocator<char>(pool));
+          int64_t total_read=0;
           while(total_read < npart_toread){
-                  /*For final segment to avoid off-by-one error*/
-                  if(read_chunk > npart_toread-total_read)
-                          read_chunk=npart_toread-total_read;
-                  read= GetBlock(BlockName, block, read_chunk, start_part+total_read, skip_type);
-                  /*Assume we read all of them; otherwise if one day we fail to read, 
-                   * the loop will not stop*/
-                  total_read+=read_chunk;
-                  /*Append what we have to the vector*/
-                  if(partlen == sizeof(int)){
-                        int* sblock=(int *) block;
-                        for(uint64_t i=0; i< read*partlen/sizeof(int); i++)
-                          data.push_back(sblock[i]);
-                  }
-                  /*Make it a 64-bit pointer*/
-                  else{
-                        for(uint64_t i=0; i< read*partlen/sizeof(int64_t); i++)
-                          data.push_back(block[i]);
+                  int64_t read = get_block(block.key, &staging[0], std::min(chunk, npart_toread-total_read), start_part+total_read, skip_type, false);
+                  if(read <= 0)
+                          break;
+                  for(int k = 0; k < nchosen; k++){
+                          const char * src = &staging[chosen[k]*size_file];
+                          char * dest = ((char *) out) + (planar ? k*npart_toread + total_read : total_read*nchosen + k)*size;
+                          const int out_stride = planar ? 1 : nchosen;
+                          if(dtype == 'f' && size == 4)
+                                  convert_from<float>(dtype_file, size_file, src, dest, read, swap, ncomp_file, out_stride);
+                          else if(dtype == 'f')
+                                  convert_from<double>(dtype_file, size_file, src, dest, read, swap, ncomp_file, out_stride);
+                          else if(size == 4)
+                                  convert_from<int32_t>(dtype_file, size_file, src, dest, read, swap, ncomp_file, out_stride);
+                          else
+                                  convert_from<int64_t>(dtype_file, size_file, src, dest, read, swap, ncomp_file, out_stride);
                   }
+                  total_read+=read;
           }
-          free(block);
+          return total_read;
+  }
+
+  /*Fill a vector of either allocator with the block, converted to the vector's element type*/
+  template <class V> static V read_vector(GSnap& snap, const std::string& BlockName, int64_t npart_toread, int64_t start_part, int skip_type, V data)
+  {
+          typedef typename V::value_type T;
+          const block_handle block = GSnap::GetBlockHandle(BlockName);
+          if(!snap.IsBlock(block) || npart_toread <= 0)
+                  return data;
+          const int ncomp = snap.GetBlockComponents(block);
+          data.resize(npart_toread*ncomp);
+          int64_t read = snap.ReadBlockAs(block, &data[0], std::is_integral<T>::value ? 'i' : 'f', sizeof(T), ncomp, npart_toread, start_part, skip_type);
+          data.resize(read*ncomp);
+          return data;
+  }
+
+  /*Memory-safe wrapper functions for the bindings. It is not anticipated that people writing codes in C 
+   * will want to use these, as they need to allocate a significant quantity of temporary memory.*/
+  std::vector<float> GSnap::GetBlock(const std::string& BlockName, int64_t npart_toread, int64_t start_part, int skip_type)
+  {
+          return read_vector(*this, BlockName, npart_toread, start_part, skip_type, std::vector<float>());
+  }
+
+  /*Support getting IDs: is exactly the same as the above*/
+  std::vector<long long> GSnap::GetBlockInt(const std::string& BlockName, int64_t npart_toread, int64_t start_part, int skip_type)
+  {
+          return read_vector(*this, BlockName, npart_toread, start_part, skip_type, std::vector<long long>());
+  }
+
+  std::vector<float> GSnap::GetBlockComponent(const std::string& BlockName, int component, int64_t npart_toread, int64_t start_part, int skip_type)
+  {
+          std::vector<float> data;
+          if(!IsBlock(BlockName) || npart_toread <= 0 || component < 0 || component >= 30)
+                  return data;
+          data.resize(npart_toread);
+          data.resize(ReadComponents<float>(BlockName, &data[0], 1 << component, npart_toread, start_part, skip_type));
           return data;
   }
 
+  pool_vector<float> GSnap::GetBlock(const std::string& BlockName, int64_t npart_toread, int64_t start_part, int skip_type, GBufferPool& pool)
+  {
+          return read_vector(*this, BlockName, npart_toread, start_part, skip_type, pool_vector<float>(GPoolAllocator<float>(&pool)));
+  }
+
+  pool_vector<long long> GSnap::GetBlockInt(const std::string& BlockName, int64_t npart_toread, int64_t start_part, int skip_type, GBufferPool& pool)
+  {
+          return read_vector(*this, BlockName, npart_toread, start_part, skip_type, pool_vector<long long>(GPoolAllocator<long long>(&pool)));
+  }
+
+  void GSnap::SetBufferPool(GBufferPool * buffer_pool)
+  {
+          pool = buffer_pool;
+  }
+
+  void GSnap::SetPageCache(GPageCache * page_cache)
+  {
+          cache = page_cache;
+  }
+
   bool GSnapFile::SetBlockTypes(block_info& block)
   {
         /* Set up the particle types in the block, with a heuristic,
@@ -78,7 +78,8 @@
  *
  * skip_types = 2**BARYON_TYPE or 2**N_TYPE -1 -2**STARS_TYPE - 2**DM_TYPE 
  *
- * Note the DM_TYPE is not skipped, as it does not appear in the file.
+ * Note the DM_TYPE need not be skipped, as it does not appear in the block.
+ * Skip bits for types absent from a block are ignored, so (1<<N_TYPE)-1-(1<<STARS_TYPE) also works.
  *
  * Gadget-I format files do not contain block names. GadgetReader attempts to detect the default block order, but
  * this will not work if you are using a modified GADGET. Therefore, in this case, you should pass a vector of 
@@ -110,14 +111,21 @@
     #define DLL_LOCAL
 #endif
 
+#include <algorithm>
+#include <functional>
 #include <map>
 #include <set>
 #include <vector>
 #include <string>
+#include <type_traits>
 #include <stdint.h>
 
 /* Include the file header structure*/
 #include "gadgetheader.h"
+#ifndef SWIG
+#include "gadgetbufferpool.hpp"
+#include "gadgetpagecache.hpp"
+#endif
 
 namespace GadgetReader{
 
@@ -132,9 +140,164 @@ namespace GadgetReader{
     int64_t start_pos;
     uint64_t length; //in bytes, excluding the two integer "record sizes" at either end
     short partlen; //length for a single particle. Likely to be 4 or 12.
+    char dtype; //'f' for floating point, 'i' for integer elements
+    short ncomp; //elements per particle: 3 for POS and VEL, 1 otherwise
     bool p_types[N_TYPE];
   } block_info;
+
+  /** A block name packed into an integer: up to four characters, the first in the top byte,
+   * so that keys sort in the same order as names. Shorter names are padded with zero bytes.*/
+  typedef uint32_t block_key;
+
+  /** Key for names longer than four characters, which no block can have*/
+  #define NO_BLOCK_KEY 0xffffffffu
+
+  /** Pack a block name into a block_key*/
+  inline block_key make_block_key(const std::string& name)
+  {
+    if(name.size() > 4)
+        return NO_BLOCK_KEY;
+    block_key key = 0;
+    for(size_t i = 0; i < 4; i++)
+        key = (key << 8) | (i < name.size() ? (unsigned char) name[i] : 0);
+    return key;
+  }
+
+  /** Get the name back from a block_key*/
+  inline std::string block_key_name(block_key key)
+  {
+    std::string name;
+    for(int i = 3; i >= 0 && (key >> 8*i) & 0xff; i--)
+        name += (char) ((key >> 8*i) & 0xff);
+    return name;
+  }
+
+  /** The blocks of one file, in a flat array sorted by key. There are only a few dozen blocks,
+   * so a binary search over integers is much quicker than a map of strings.*/
+  class DLL_LOCAL block_map {
+    public:
+    typedef std::vector<std::pair<block_key, block_info> >::iterator iterator;
+    typedef std::vector<std::pair<block_key, block_info> >::const_iterator const_iterator;
+    /** Get a block, or NULL if it is not in the file*/
+    block_info * find(block_key key)
+    {
+        iterator it = lower_bound(key);
+        return (it != blocks.end() && it->first == key) ? &it->second : NULL;
+    }
+    const block_info * find(block_key key) const
+    {
+        return const_cast<block_map *>(this)->find(key);
+    }
+    bool count(block_key key) const
+    {
+        return find(key) != NULL;
+    }
+    /** Get a block, adding it if it is not there*/
+    block_info& operator[](block_key key)
+    {
+        iterator it = lower_bound(key);
+        if(it == blocks.end() || it->first != key)
+            it = blocks.insert(it, std::make_pair(key, block_info()));
+        return it->second;
+    }
+    iterator begin() { return blocks.begin(); }
+    iterator end() { return blocks.end(); }
+    const_iterator begin() const { return blocks.begin(); }
+    const_iterator end() const { return blocks.end(); }
+    size_t size() const { return blocks.size(); }
+    bool empty() const { return blocks.empty(); }
+    private:
+    iterator lower_bound(block_key key)
+    {
+        return std::lower_bound(blocks.begin(), blocks.end(), key,
+                [](const std::pair<block_key, block_info>& a, block_key k){ return a.first < k; });
+    }
+    std::vector<std::pair<block_key, block_info> > blocks;
+  };
+
+  /** A contiguous run of particles of one type in one block of one file.
+   * Returned by GSnap::GetBlockSegments, for callers which do their own I/O. */
+  typedef struct{
+    /** Index of the file within the snapshot, as for GetHeader*/
+    int file;
+    /** Position of the first particle in the file, in bytes*/
+    int64_t offset;
+    /** Number of particles in the run*/
+    int64_t npart;
+  } block_segment;
+
+  /** Whether particle index is in the random sample with the given fraction and seed, as read by GSnap::GetBlockSample.
+   * Each particle is kept if a hash of its index and the seed, taken as a number in [0,1), is below fraction.
+   * So a sample is the same every time, and the sample for a smaller fraction is part of that for a larger one with the same seed.*/
+  inline bool in_sample(uint64_t index, double fraction, uint64_t seed)
+  {
+    //The splitmix64 mixing function
+    uint64_t z = seed*0x9e3779b97f4a7c15ull + index + 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    return (z >> 11) * (1.0/9007199254740992.0) < fraction;
+  }
+
+  /** A test of a block with one element per particle, for GSnap::Select.
+   * A particle passes if min <= value <= max, so use -INFINITY or INFINITY for a one-sided test.
+   * For example, {"RHO ", 1e-4, INFINITY} selects particles with density above 1e-4.*/
+  typedef struct{
+    /** Name of the block to test*/
+    std::string block;
+    double min;
+    double max;
+  } block_predicate;
   
+  /** One block of a snapshot loaded into memory by GSnap::Load.*/
+  typedef struct{
+    /** The particles, in the same order GetBlock would give them: by file, then by type within a file*/
+    void * data;
+    /** Number of particles loaded*/
+    int64_t npart;
+    /** Bytes per particle*/
+    short partlen;
+    /** Element type, 'f' or 'i', and elements per particle, as for GSnap::GetBlockDType*/
+    char dtype;
+    short ncomp;
+  } loaded_block;
+
+  /** Structure-of-arrays container filled by GSnap::Load.
+   * All blocks live in one arena, which is freed with the container.
+   * Blocks need not have the same number of particles, as not every block has every type. */
+  class DLL_PUBLIC GSnapData {
+    public:
+    /** @param pool If not NULL, the arena comes from and goes back to this pool,
+     * so loading the next snapshot into the same container, or another sharing the pool, reuses the memory.*/
+    GSnapData(GBufferPool * pool=NULL): arena(NULL), arena_size(0), pool(pool) {};
+    ~GSnapData();
+    /** Get a loaded block, or NULL if it was not loaded*/
+    const loaded_block * GetBlock(const std::string& BlockName) const;
+    /** Get the data of a loaded block as an array of T, or NULL if it was not loaded
+     * or does not hold elements of size sizeof(T).*/
+    template <class T> T * Get(const std::string& BlockName) const
+    {
+        const loaded_block * block = GetBlock(BlockName);
+        if(!block || block->partlen != block->ncomp*(int) sizeof(T))
+            return NULL;
+        return (T *) block->data;
+    }
+    /** Total bytes held*/
+    size_t GetSize() const {
+        return arena_size;
+    }
+    private:
+    GSnapData(const GSnapData&);
+    GSnapData& operator=(const GSnapData&);
+    friend class GSnap;
+    /** Free the arena and forget all blocks*/
+    void clear();
+    std::map<std::string, loaded_block> blocks;
+    char * arena;
+    size_t arena_size;
+    GBufferPool * pool;
+  };
+
   /** This private structure stores information about each file. 
    * May change without warning, don't use it.
    * Stores block maps, caches headers
@@ -146,7 +309,7 @@ namespace GadgetReader{
     //The header is stored inline, as it is small
     gadget_header header;
     //The block map
-    std::map<std::string,block_info> blocks;
+    block_map blocks;
 
     /** Stores whether the file is endian swapped*/
     bool swap_endian;
@@ -162,6 +325,9 @@ namespace GadgetReader{
     /** Private function that does the hard work of looking over a file
      * and constructing a map of where the blocks start and finish. */
     GSnapFile(f_name filename, bool debug=true, std::vector<std::string> *BlockNames=NULL);
+    /** Copy the block map of like, the same file of an earlier output, if this file has the same layout.
+     * Otherwise scan the file as above.*/
+    GSnapFile(f_name filename, const GSnapFile& like, bool debug=true, std::vector<std::string> *BlockNames=NULL);
     /** Get the file format. 
      * First bit is format 2, second is swap_endian.
      * Allows us to test if we have Gadget 1 or endian swapped files. */
@@ -181,10 +347,20 @@ namespace GadgetReader{
     uint32_t read_block_head(char* name, FILE *fd, const char * file);
     
     bool SetBlockTypes(block_info& block);
+    /** Check whether this file has the block map of like: same size, format and particle numbers,
+     * and the last block where like has it. Reads the header if so.*/
+    bool same_layout(const GSnapFile& like);
   
   } ;
     
 #endif
+
+  /** A block name resolved once with GSnap::GetBlockHandle, for calls made many times, such as small reads in a loop.
+   * Calls given a handle look the block up with no string work. A handle is not tied to a snapshot.*/
+  typedef struct{
+    /** The name packed into an integer*/
+    uint32_t key;
+  } block_handle;
   
   /** Main class for reading Gadget snapshots. */
   class DLL_PUBLIC GSnap{
@@ -199,6 +375,13 @@ namespace GadgetReader{
                    * @param BlockNames A list of block names, for format 1 files where we can't autodetect. If NULL,
                    * a default value is returned. */
                   GSnap(std::string snap_filename, bool debug=true, std::vector<std::string> *BlockNames=NULL);
+                #ifndef SWIG
+                  /** Open a snapshot which probably has the same layout as like, such as the next output of a simulation.
+                   * The block map of each file is copied from like, rather than found by seeking through the file,
+                   * if the file has the same size and particle numbers and its last block is in the same place.
+                   * Files which differ are scanned as usual. Headers are always read afresh.*/
+                  GSnap(std::string snap_filename, const GSnap& like, bool debug=true, std::vector<std::string> *BlockNames=NULL);
+                #endif
                   /** Reads particles from a file block into the memory pointed to by block.
                    *This function is insanity with respect to bindings, for
                    * reasons which probably have to do with the total lack of memory or type safety.
@@ -210,29 +393,104 @@ namespace GadgetReader{
                    * @param start_part  Starting particle 
                    * @param skip_type   Types to skip, as a bitfield. 
                    * Pass 1 to skip baryons, 2 to skip dm, 3 to skip baryons and dm, etc.
-                   * Only skip types for which the block is actually present:
-                   * Unfortunately there is no way of the library knowing
-                   * which particle has which type,
-                   * so there is no way of telling that in advance.
+                   * Bits for types which are not present in the block are ignored,
+                   * so to read a single type use (1<<N_TYPE)-1-(1<<type).
+                   * Which types a block contains is guessed from its length; see GetBlockTypes.
                    * FIXME: Do not try to read two non-contiguous types from the file in one call.*/
                 #ifndef SWIG
-                  int64_t GetBlock(std::string BlockName, void *block, int64_t npart_toread, int64_t start_part, int skip_type);
+                  int64_t GetBlock(const std::string& BlockName, void *block, int64_t npart_toread, int64_t start_part, int skip_type);
+                #endif
+                #ifndef SWIG
+                  /** Typed version of GetBlock: reads particles into out, converting each element to T.
+                   * For example, ReadBlock<float,3>("POS ", pos, n, 0, 0) gives single precision positions
+                   * whether the file holds floats or doubles, and ReadBlock<int64_t,1>("ID  ", ...) gives 64-bit IDs
+                   * from 32- or 64-bit files.
+                   * If the file already holds T, data is read straight into out. Otherwise it is read through
+                   * a small staging buffer, and endian swapping and conversion are done in the same pass,
+                   * so no full-size temporary is needed.
+                   * @param N Elements per particle. Must match the block (3 for POS and VEL, 1 otherwise), or nothing is read.
+                   * Other arguments and return value are as for GetBlock. */
+                  template <class T, int N> int64_t ReadBlock(const std::string& BlockName, T *out, int64_t npart_toread, int64_t start_part, int skip_type)
+                  {
+                          static_assert(std::is_arithmetic<T>::value && (sizeof(T) == 4 || sizeof(T) == 8), "ReadBlock needs a 4 or 8 byte numeric type");
+                          return ReadBlockAs(BlockName, out, std::is_integral<T>::value ? 'i' : 'f', sizeof(T), N, npart_toread, start_part, skip_type);
+                  }
+                  /** Untyped back end of ReadBlock.
+                   * @param dtype 'f' for floating point or 'i' for integer output
+                   * @param size Size of an output element in bytes: 4 or 8
+                   * @param ncomp Elements per particle*/
+                  int64_t ReadBlockAs(const std::string& BlockName, void *out, char dtype, int size, int ncomp, int64_t npart_toread, int64_t start_part, int skip_type);
+                  /** Read only some of the elements of each particle of a block, converted to T, such as the z coordinate of POS.
+                   * Particles are read a cache-sized chunk at a time, and the chosen elements picked out of each chunk,
+                   * converted and endian swapped in one pass, so no copy of the whole block is made.
+                   * For example, ReadComponents<float>("POS ", z, 4, n, 0, skip) gives n z coordinates,
+                   * and ReadComponents<float>("POS ", xyz, 7, n, 0, skip, true) gives x, y and z as three arrays of n.
+                   * @param components Elements to read, as a bitfield: bit c set reads element c.
+                   * @param planar If false, out holds the chosen elements of each particle in turn. If true, out holds one array
+                   * of npart_toread for each chosen element, in order, so element k of particle i is out[k*npart_toread+i].
+                   * Other arguments and return value are as for GetBlock. */
+                  template <class T> int64_t ReadComponents(const std::string& BlockName, T *out, int components, int64_t npart_toread, int64_t start_part, int skip_type, bool planar=false)
+                  {
+                          static_assert(std::is_arithmetic<T>::value && (sizeof(T) == 4 || sizeof(T) == 8), "ReadComponents needs a 4 or 8 byte numeric type");
+                          return ReadComponentsAs(GetBlockHandle(BlockName), out, std::is_integral<T>::value ? 'i' : 'f', sizeof(T), components, npart_toread, start_part, skip_type, planar);
+                  }
+                  /** Untyped back end of ReadComponents. dtype and size are as for ReadBlockAs.*/
+                  int64_t ReadComponentsAs(block_handle block, void *out, char dtype, int size, int components, int64_t npart_toread, int64_t start_part, int skip_type, bool planar);
+                  /** Read a quantity derived from one or more blocks, in physical cgs units.
+                   * The input blocks are read a chunk at a time and combined as each chunk arrives,
+                   * with several chunks handled at once, so no full size copy of any input is made.
+                   * Known quantities are:
+                   * - "Temperature": gas temperature in K, from "U   " and the electron abundance "NE  ".
+                   *   Without NE, the abundance comes from "NHP ", "NHEP " and "NHEQ", or else the gas is taken to be fully ionised.
+                   * - "Density": physical density in g/cm^3, from "RHO ".
+                   * - "nH": physical number density of hydrogen in cm^-3, from "RHO ".
+                   *
+                   * Units come from the header, with the usual Gadget units (kpc/h, 10^10 M_sun/h, km/s) if it has none.
+                   * Densities are comoving in the file; if the header has Omega0 > 0 time is taken to be the scale factor.
+                   * @param Quantity Name of the quantity, as above.
+                   * @param out Space for npart_toread floats.
+                   * @param nthreads Number of chunks to handle at once. 0 means one for each processor.
+                   * Other arguments and return value are as for GetBlock, applied to the input blocks.
+                   * Nothing is read if the quantity is unknown or an input block is missing.*/
+                  int64_t ReadDerived(const std::string& Quantity, float *out, int64_t npart_toread, int64_t start_part, int skip_type, int nthreads=0);
                 #endif
+                  /** ReadDerived overload returning a vector of every particle of the types not in skip_type.
+                   * For example, ReadDerived("Temperature", 0) gives the temperature of all gas particles.*/
+                  std::vector<float> ReadDerived(const std::string& Quantity, int skip_type, int nthreads=0);
                   /** GetBlock overload returning a vector.
                    * @see GetBlock
                    * Memory-safe wrapper functions for the bindings. It is not anticipated that people writing codes in C
                    * will want to use these, as they need to allocate a significant quantity of temporary memory.
-                   * We do not attempt to work out whether the block requested is a float or an int.*/
-                  std::vector<float> GetBlock(std::string BlockName, int64_t npart_toread, int64_t start_part, int skip_type);
+                   * Elements are converted to float, so double precision blocks are returned correctly.*/
+                  std::vector<float> GetBlock(const std::string& BlockName, int64_t npart_toread, int64_t start_part, int skip_type);
                   /** GetBlock overload returning an int.
                    * @see GetBlock
-                   * This is here to support getting IDs, it is exactly the same as the earlier GetBlock overload*/
-                  std::vector<long long> GetBlockInt(std::string BlockName, int64_t npart_toread, int64_t start_part, int skip_type);
+                   * This is here to support getting IDs, it is exactly the same as the earlier GetBlock overload,
+                   * but converts to 64-bit integers.*/
+                  std::vector<long long> GetBlockInt(const std::string& BlockName, int64_t npart_toread, int64_t start_part, int skip_type);
+                  /** GetBlock overload returning one element of each particle, such as the z coordinate of POS, as float.
+                   * @see ReadComponents
+                   * @param component Element to read: 0 for x, 1 for y, 2 for z.*/
+                  std::vector<float> GetBlockComponent(const std::string& BlockName, int component, int64_t npart_toread, int64_t start_part, int skip_type);
+                #ifndef SWIG
+                  /** Vector-returning GetBlock, with the memory taken from pool.
+                   * When the vector is destroyed its memory goes back to the pool for the next read.*/
+                  pool_vector<float> GetBlock(const std::string& BlockName, int64_t npart_toread, int64_t start_part, int skip_type, GBufferPool& pool);
+                  /** Vector-returning GetBlockInt, with the memory taken from pool.*/
+                  pool_vector<long long> GetBlockInt(const std::string& BlockName, int64_t npart_toread, int64_t start_part, int skip_type, GBufferPool& pool);
+                  /** Take temporary buffers, such as those used to convert between types, from pool.
+                   * The pool must outlive this object. NULL, the default, uses the heap.*/
+                  void SetBufferPool(GBufferPool * pool);
+                  /** Read block data through cache, so that repeated small reads, such as of a few particles at a time,
+                   * are served from memory. Reads of more than a page still go to the file.
+                   * The cache must outlive this object. NULL, the default, reads the files directly.*/
+                  void SetPageCache(GPageCache * cache);
+                #endif
                   /* Ideally here we would have a wrapper for returning 3-float blocks such as POS and VEL, 
                    * BUT SWIG can't handle nested classes, so we can't do that.*/
 
                   /** Tests whether a particular block exists.  */
-                  bool IsBlock(std::string BlockName);
+                  bool IsBlock(const std::string& BlockName);
                   /** Gets a file header.
                    * Note this means GetHeader().Npart[0] != GetNpart(0)
                    * This has to be the case to avoid overflow issues. 
@@ -242,6 +500,12 @@ namespace GadgetReader{
                   std::string GetFileName(){
                           return base_filename;
                   }
+                  /** Get the name of file i of the snapshot, or an empty string if there is no such file*/
+                  std::string GetFileName(int i){
+                          if(i < 0 || i >= GetNumFiles())
+                                  return std::string();
+                          return file_maps[i].name;
+                  }
                   /** Get the number of files we actually found in the snapshot.
                    *  Note this is not necessarily the number the snapshot thinks is there */
                   int GetNumFiles(){
@@ -266,23 +530,163 @@ namespace GadgetReader{
                   int64_t GetNpart(int type, bool found=false);
                   /** Get total size of a block in the snapshot, in bytes.
                    * Useful for allocating memory. -1 is all types*/
-                  int64_t GetBlockSize(std::string BlockName, int type=-1);
+                  int64_t GetBlockSize(const std::string& BlockName, int type=-1);
                  /** Get number of particles a block has data for, Same as GetBlockSize with type=-1, but divided by partlen */
-                  int64_t GetBlockParts(std::string BlockName);
+                  int64_t GetBlockParts(const std::string& BlockName);
                  /** Get a list of all blocks present in the snapshot, as a set. */
                   std::set<std::string> GetBlocks();
+                 /** Get a bitfield of the particle types which have data in a block.
+                   * Bit n is set if type n is present. Useful for building skip_type. */
+                  int GetBlockTypes(const std::string& BlockName);
+                 /** Get the per-particle length for a given block, in bytes. 0 if the block does not exist. */
+                  short GetPartLen(const std::string& BlockName);
+                 /** Get the element type of a block: 'f' for floating point, 'i' for integer, 0 if the block does not exist.
+                   * Like partlen, this is guessed from the block name.*/
+                  char GetBlockDType(const std::string& BlockName);
+                 /** Get the number of elements per particle of a block: 3 for POS and VEL, 1 otherwise.
+                   * The size of one element is GetPartLen/GetBlockComponents. 0 if the block does not exist.*/
+                  int GetBlockComponents(const std::string& BlockName);
+                #ifndef SWIG
+                 /** Get the locations on disc of the particles of one type in a block.
+                   * Segments are returned in particle order, one for each file containing the type.
+                   * Lengths are in particles; multiply by GetPartLen for bytes.*/
+                  std::vector<block_segment> GetBlockSegments(const std::string& BlockName, int type);
+                #endif
+                #ifndef SWIG
+                 /** Load several blocks at once into a structure-of-arrays container.
+                   * The reads from every block are sorted by position on disc and done in a single forward
+                   * sweep over each file, so each file is opened once and read sequentially.
+                   * Particles come in the same order as GetBlock; unlike GetBlock any set of types may be asked for.
+                   * @param BlockNames Blocks to load. Missing blocks are skipped with a warning.
+                   * @param type_mask Bitfield of the types to load: bit n set loads type n.
+                   * @param out Container to fill. Anything already in it is discarded.
+                   * @return 0 on success, 1 if any read failed.*/
+                  int Load(const std::vector<std::string>& BlockNames, int type_mask, GSnapData& out);
+                 /** Find the particles of one type which pass every predicate.
+                   * The predicate blocks are read a chunk at a time, and only the matching particles are kept.
+                   * If WriteZoneMaps has saved the range of values in each chunk, chunks which cannot match are skipped without being read.
+                   * The result is for ReadSelected, so that only the matching particles of other blocks need be read. For example:
+                   * \code
+                   * std::vector<block_predicate> dense(1, block_predicate{"RHO ", 1e-4, INFINITY});
+                   * std::vector<int64_t> index;
+                   * if(!snap.Select(dense, BARYON_TYPE, index)){
+                   *     std::vector<float> pos(3*index.size());
+                   *     snap.ReadSelected("POS ", BARYON_TYPE, index, &pos[0]);
+                   * }
+                   * \endcode
+                   * @param predicates Tests to apply. Each block must have one element per particle, and particles of type.
+                   * @param type Particle type to select from.
+                   * @param index Filled with the positions of the matching particles among the particles of type,
+                   * in the order GetBlock gives them, ascending.
+                   * @param skipped If not NULL, set to the number of particles not read thanks to zone maps.
+                   * @return 0 on success, 1 if a predicate is unusable or a read failed.*/
+                  int Select(const std::vector<block_predicate>& predicates, int type, std::vector<int64_t>& index, int64_t * skipped=NULL);
+                 /** Read only some of the particles of one type in a block.
+                   * Runs of nearby particles are merged into single reads, as in Load.
+                   * @param index Positions of the particles to read among the particles of type, as found by Select.
+                   * Need not be sorted: particles are stored in the order given.
+                   * @param out Space for index.size() particles, which are as GetBlock would give them.
+                   * @return The number of particles read: index.size(), or 0 on failure.*/
+                  int64_t ReadSelected(const std::string& BlockName, int type, const std::vector<int64_t>& index, void * out);
+                 /** Save zone maps for Select: for each chunk of particles of each type in each block, the least and greatest values.
+                   * The maps of file i go in GetFileName(i)+".zones". Maps whose block has since moved or changed size are ignored,
+                   * but maps are not otherwise checked against the data, so write them again if a file changes.
+                   * Maps already saved for other blocks are kept; those for the blocks in BlockNames are replaced.
+                   * @param BlockNames Blocks to map. Each must have one element per particle.
+                   * @param chunk Particles in each chunk. Smaller chunks make finer maps, which can skip more.
+                   * @return 0 on success, 1 if a block could not be mapped or a file written.*/
+                  int WriteZoneMaps(const std::vector<std::string>& BlockNames, int64_t chunk=65536);
+                 /** Read some of the particles GetBlock would give.
+                   * The reads are queued a window at a time in a read planner, which reads runs of nearby particles,
+                   * and the gaps between them, with a single vectored read, and widely spaced particles with separate reads.
+                   * So the I/O is close to that of a full read for dense selections, and proportional to the selection for sparse ones.
+                   * @param out Space for index.size() particles.
+                   * @param index Positions of the particles to read, among those GetBlock would give with this skip_type. Need not be sorted.
+                   * @return The number of particles read: index.size(), or 0 on failure.*/
+                  int64_t GetBlockIndexed(const std::string& BlockName, void *out, const std::vector<int64_t>& index, int skip_type);
+                 /** Read every stride-th particle that GetBlock would give, starting with particle start_part, as GetBlockIndexed.
+                   * @param out Space for (N - start_part + stride - 1)/stride particles, N being the number of particles GetBlock would give.
+                   * @return The number of particles read, or 0 on failure.*/
+                  int64_t GetBlockStrided(const std::string& BlockName, void *out, int64_t stride, int64_t start_part, int skip_type);
+                 /** Read a random sample of the particles GetBlock would give, each chosen with probability fraction by in_sample.
+                   * The sample is reproducible: it depends only on fraction and seed.
+                   * @param out Space for GetSampleSize particles.
+                   * @return The number of particles read, or 0 on failure.*/
+                  int64_t GetBlockSample(const std::string& BlockName, void *out, double fraction, uint64_t seed, int skip_type);
+                 /** Number of particles GetBlockSample will read. Reads nothing from disc.*/
+                  int64_t GetSampleSize(const std::string& BlockName, double fraction, uint64_t seed, int skip_type);
+                #endif
+                 /** Write a level of detail pyramid beside the snapshot, for quick coarse views.
+                   * Level l, for l = 1 to levels, holds a random 1/8^l of the particles of each type, chosen by in_sample with seed,
+                   * so each level is part of the one before. It holds POS and the named blocks, and is written to GetLevelFileName(l)
+                   * as a single format 2 file in native byte order, with the header of this snapshot but its own particle numbers.
+                   * Particle data and header masses are unchanged, so a level has 1/8^l of the mass.
+                   * All levels are written in one pass over the snapshot, which reads only the particles of level 1.
+                   * @param BlockNames Blocks to keep as well as POS.
+                   * @return 0 on success, 1 if a block is missing or a file could not be written.*/
+                  int WritePyramid(const std::vector<std::string>& BlockNames, int levels, uint64_t seed=0);
+                 /** Name of the file holding a level of the pyramid written by WritePyramid: the base filename, then ".lod" and the level.
+                   * @param snap_filename Filename of the snapshot, as given to the constructor*/
+                  static std::string GetLevelFileName(const std::string& snap_filename, int level);
+                 /** Open a level of the pyramid of a snapshot, without opening the snapshot itself.
+                   * Level 0 is the snapshot.*/
+                  static GSnap OpenLevel(const std::string& snap_filename, int level, bool debug=true);
+                 /** Check the blocks of each file against the checksums saved when it was written
+                   * (see GadgetWriter::GWriteBaseSnap::SetChecksums). The checksums of file i are read from GetFileName(i)+".crc32c",
+                   * and each block listed there is streamed from disc and its CRC-32C compared. Files are checked in parallel.
+                   * @param nthreads Number of files to check at once. 0 means one for each processor.
+                   * @return 0 if every checksum matched, 1 if any did not or a block could not be read,
+                   * 2 if there were no checksums to check.*/
+                  int Verify(int nthreads=0);
                  /** Set the per-particle length for a given block to partlen.
-                   * This could be useful if the automatic detection failed.*/
-                  void SetPartLen(std::string BlockName, short partlen);
+                   * This could be useful if the automatic detection failed.
+                   * The number of elements per particle is kept, so 24 for POS means double precision.*/
+                  void SetPartLen(const std::string& BlockName, short partlen);
+                #ifndef SWIG
+                 /** Resolve a block name into a handle, for the overloads below.
+                   * Each overload behaves as the one taking the name, but finds the block by comparing integers,
+                   * so the name is not copied or compared on every call. For example:
+                   * \code
+                   * block_handle pos = GSnap::GetBlockHandle("POS ");
+                   * for(int64_t i = 0; i < n; i += 1024)
+                   *     snap.GetBlock(pos, &buf[3*i], 1024, i, 0);
+                   * \endcode */
+                  static block_handle GetBlockHandle(const std::string& BlockName);
+                  bool IsBlock(block_handle block);
+                  int64_t GetBlock(block_handle block, void *data, int64_t npart_toread, int64_t start_part, int skip_type);
+                  template <class T, int N> int64_t ReadBlock(block_handle block, T *out, int64_t npart_toread, int64_t start_part, int skip_type)
+                  {
+                          static_assert(std::is_arithmetic<T>::value && (sizeof(T) == 4 || sizeof(T) == 8), "ReadBlock needs a 4 or 8 byte numeric type");
+                          return ReadBlockAs(block, out, std::is_integral<T>::value ? 'i' : 'f', sizeof(T), N, npart_toread, start_part, skip_type);
+                  }
+                  int64_t ReadBlockAs(block_handle block, void *out, char dtype, int size, int ncomp, int64_t npart_toread, int64_t start_part, int skip_type);
+                  int64_t GetBlockSize(block_handle block, int type=-1);
+                  int64_t GetBlockParts(block_handle block);
+                  int GetBlockTypes(block_handle block);
+                  short GetPartLen(block_handle block);
+                  char GetBlockDType(block_handle block);
+                  int GetBlockComponents(block_handle block);
+                  std::vector<block_segment> GetBlockSegments(block_handle block, int type);
+                  void SetPartLen(block_handle block, short partlen);
+                #endif
           private:
-                  /** Private function to check whether two headers are
-                   * consistent with being from the same snapshot. */
-                  DLL_LOCAL bool check_headers(const gadget_header& head1, const gadget_header& head2);
+                  /** Does the work of the constructors. If like is not NULL, block maps are copied from it where possible.*/
+                  DLL_LOCAL void open(std::string snap_filename, std::vector<std::string> *BlockNames, const GSnap * like);
+                  /** Does the work of GetBlock. If swap is false, endian swapped files are left as they are on disc.*/
+                  DLL_LOCAL int64_t get_block(block_key key, void *block, int64_t npart_toread, int64_t start_part, int skip_type, bool swap);
+                  /** Does the work of GetBlockIndexed, reading the particles next returns, until it returns -1.*/
+                  DLL_LOCAL int64_t read_indexed(block_key key, void *out, int skip_type, const std::function<int64_t()>& next);
+                  /** Number of particles GetBlock would give with skip_type*/
+                  DLL_LOCAL int64_t count_parts(block_key key, int skip_type);
                   /** Base filename for the snapshot*/
                   f_name base_filename;
 
                   /** Flag to control whether WARN prints anything */
                   bool debug;
+                  /** Where temporary buffers come from*/
+                  GBufferPool * pool;
+                  /** Page cache for block reads, or NULL*/
+                  GPageCache * cache;
                   /** This flag is a silly hack to indicate whether the header is setting
                    * the long word part of nparttotal incorrectly, as some versions of Genics do*/
                   bool bad_head64;
@@ -292,6 +696,18 @@ namespace GadgetReader{
 
   };
 
+#ifndef SWIG
+  /** Read only the header of one snapshot file, without looking at its blocks.
+   * Format 1, format 2 and endian swapped files are all understood; the header is returned in native byte order.
+   * This is much cheaper than constructing a GSnap, which seeks through every block of every file.
+   * @param filename Name of a single file, including any .0 suffix
+   * @return 0 on success, 1 if the file could not be opened or its HEAD record is corrupt.*/
+  DLL_PUBLIC int ReadHeader(const std::string& filename, gadget_header& header, bool debug=false);
+  /** Check whether two file headers are consistent with being from the same snapshot.
+   * This is the test GSnap applies to each file after the first. */
+  DLL_PUBLIC bool CheckHeaders(const gadget_header& head1, const gadget_header& head2);
+#endif
+
 }
 
 #endif //__GADGETREADER_H
@@ -0,0 +1,110 @@
+/* Read planner, merging nearby reads from snapshot files*/
+#include "gadgetreadplan.hpp"
+#include "read_utils.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+namespace GadgetReader{
+
+  GReadPlan::GReadPlan(int64_t max_gap): max_gap(max_gap), nreads(0)
+  {
+  }
+
+  void GReadPlan::add(int file, int64_t offset, int64_t bytes, void * dest)
+  {
+          if(bytes <= 0)
+                  return;
+          read_request req;
+          req.file = file;
+          req.offset = offset;
+          req.bytes = bytes;
+          req.dest = (char *) dest;
+          pending.push_back(req);
+  }
+
+  /*Read into all of iov, starting at offset, carrying on after short reads.
+   * Returns 0 on success, 1 on error or end of file.*/
+  static int read_vec(int fd, std::vector<struct iovec>& iov, int64_t offset, int64_t& nreads)
+  {
+          size_t i = 0;
+          while(i < iov.size()){
+                  ssize_t ret = preadv(fd, &iov[i], std::min<size_t>(iov.size()-i, IOV_MAX), offset);
+                  nreads++;
+                  if(ret < 0 && errno == EINTR)
+                          continue;
+                  if(ret <= 0)
+                          return 1;
+                  offset += ret;
+                  //Skip the buffers we have filled, and move along the one we are part way through
+                  while(i < iov.size() && (size_t) ret >= iov[i].iov_len){
+                          ret -= iov[i].iov_len;
+                          i++;
+                  }
+                  if(i < iov.size()){
+                          iov[i].iov_base = (char *) iov[i].iov_base + ret;
+                          iov[i].iov_len -= ret;
+                  }
+          }
+          return 0;
+  }
+
+  int GReadPlan::execute(const std::vector<std::string>& files, bool debug)
+  {
+          std::sort(pending.begin(), pending.end());
+          //The bytes in the gaps between merged reads all go here.
+          //Sized once, as the iovecs of a run point into it.
+          std::vector<char> scratch(std::max<int64_t>(max_gap, 1));
+          std::vector<struct iovec> iov;
+          nreads = 0;
+          int ret = 0;
+          size_t r = 0;
+          while(r < pending.size()){
+                  const int file = pending[r].file;
+                  int fd = -1;
+                  if(file < 0 || (size_t) file >= files.size() || (fd = open(files[file].c_str(), O_RDONLY)) < 0){
+                          WARN("Could not open file %d for reading\n",file);
+                          ret = 1;
+                          while(r < pending.size() && pending[r].file == file)
+                                  r++;
+                          continue;
+                  }
+                  while(r < pending.size() && pending[r].file == file){
+                          //Gather a run of reads which are close together
+                          const int64_t start = pending[r].offset;
+                          int64_t end = start;
+                          iov.clear();
+                          while(r < pending.size() && pending[r].file == file && iov.size() < IOV_MAX-1){
+                                  const int64_t gap = pending[r].offset - end;
+                                  //Overlapping reads go in separate runs
+                                  if(gap < 0 || gap > max_gap)
+                                          break;
+                                  if(gap > 0){
+                                          struct iovec skip = {&scratch[0], (size_t) gap};
+                                          iov.push_back(skip);
+                                  }
+                                  struct iovec dest = {pending[r].dest, (size_t) pending[r].bytes};
+                                  iov.push_back(dest);
+                                  end = pending[r].offset + pending[r].bytes;
+                                  r++;
+                          }
+                          if(read_vec(fd, iov, start, nreads)){
+                                  WARN("Could not read %ld bytes at %ld from %s\n",end-start,start,files[file].c_str());
+                                  ret = 1;
+                          }
+                  }
+                  close(fd);
+          }
+          pending.clear();
+          return ret;
+  }
+}
@@ -0,0 +1,49 @@
+/* This file contains the read planner used by GSnap to batch up reads from snapshot files.
+ * It is private to the reader library.*/
+#ifndef GADGETREADPLAN_H
+#define GADGETREADPLAN_H
+#include "gadgetreader.hpp"
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+/** Largest gap between two reads which is read through rather than skipped.
+ * In format 2 files blocks are separated by 24 bytes of record markers,
+ * so this merges neighbouring blocks, and small blocks of other types between them.*/
+#define READ_PLAN_GAP (64*1024)
+
+namespace GadgetReader{
+  /** Collects reads from the files of a snapshot, then does them all at once.
+   * The reads are sorted by file and offset, and reads separated by less than max_gap bytes
+   * are merged into a single vectored read, which scatters the bytes straight into the destination buffers.
+   * The bytes in the gaps are read into a scratch buffer and thrown away. */
+  class DLL_LOCAL GReadPlan {
+         public:
+                GReadPlan(int64_t max_gap=READ_PLAN_GAP);
+                /** Queue a read of bytes bytes, from offset in file number file, into dest.*/
+                void add(int file, int64_t offset, int64_t bytes, void * dest);
+                /** Do all the queued reads, then forget them.
+                 * @param files Names of the files, indexed by the file number given to add.
+                 * @return 0 if everything was read, 1 otherwise.*/
+                int execute(const std::vector<std::string>& files, bool debug);
+                /** Number of queued reads*/
+                size_t size() const {return pending.size();}
+                /** Number of read system calls made by the last call to execute*/
+                int64_t GetNumReads() const {return nreads;}
+         private:
+                struct read_request {
+                        int file;
+                        int64_t offset;
+                        int64_t bytes;
+                        char * dest;
+                        bool operator<(const read_request& other) const {
+                                return file < other.file || (file == other.file && offset < other.offset);
+                        }
+                };
+                std::vector<read_request> pending;
+                int64_t max_gap;
+                int64_t nreads;
+  };
+}
+#endif
@@ -0,0 +1,152 @@
+/* Reads of a subset of the particles of a block: listed, strided or randomly sampled*/
+#include "gadgetreader.hpp"
+#include "gadgetreadplan.hpp"
+#include "read_utils.h"
+#include <algorithm>
+#include <stdio.h>
+
+namespace GadgetReader{
+
+  /*Particles queued before the planner is run, which bounds its memory*/
+  #define INDEXED_WINDOW 65536
+
+  /*Runs of particles of a block in the order GetBlock gives them: by file, then by type*/
+  static std::vector<block_segment> getblock_segments(GSnap& snap, block_handle block, int skip_type)
+  {
+        std::vector<block_segment> segs;
+        for(int j = 0; j < N_TYPE; j++){
+                if(skip_type & (1 << j))
+                        continue;
+                std::vector<block_segment> type_segs = snap.GetBlockSegments(block, j);
+                segs.insert(segs.end(), type_segs.begin(), type_segs.end());
+        }
+        //Types were added in order, so a stable sort by file leaves them in order within each file
+        std::stable_sort(segs.begin(), segs.end(), [](const block_segment& a, const block_segment& b){ return a.file < b.file; });
+        return segs;
+  }
+
+  int64_t GSnap::count_parts(block_key key, int skip_type)
+  {
+        const block_handle block = {key};
+        const std::vector<block_segment> segs = getblock_segments(*this, block, skip_type);
+        int64_t total = 0;
+        for(size_t s = 0; s < segs.size(); s++)
+                total += segs[s].npart;
+        return total;
+  }
+
+  int64_t GSnap::read_indexed(block_key key, void *out, int skip_type, const std::function<int64_t()>& next)
+  {
+        const block_handle block = {key};
+        if(!IsBlock(block)){
+                WARN("Block %s is not in this snapshot\n",block_key_name(key).c_str());
+                return 0;
+        }
+        const std::vector<block_segment> segs = getblock_segments(*this, block, skip_type);
+        //Position of the first particle of each segment, and one past the last
+        std::vector<int64_t> starts(1, 0);
+        for(size_t s = 0; s < segs.size(); s++)
+                starts.push_back(starts.back() + segs[s].npart);
+        std::vector<std::string> files;
+        for(size_t i = 0; i < file_maps.size(); i++)
+                files.push_back(file_maps[i].name);
+        const short partlen = GetPartLen(block);
+        GReadPlan plan;
+        char * dest = (char *) out;
+        int64_t count = 0, queued = 0;
+        //The current run of consecutive particles in one segment
+        int64_t run_first = 0, run_len = 0;
+        size_t run_seg = 0, s = 0;
+        for(;;){
+                const int64_t i = next();
+                const bool done = i < 0;
+                if(!done && i >= starts.back()){
+                        WARN("Particle %ld is not in block %s, which has %ld\n",i,block_key_name(key).c_str(),starts.back());
+                        return 0;
+                }
+                if(!done && run_len && i == run_first + run_len && i < starts[run_seg+1]){
+                        run_len++;
+                        continue;
+                }
+                if(run_len){
+                        plan.add(segs[run_seg].file, segs[run_seg].offset + (run_first - starts[run_seg])*partlen, run_len*partlen, dest);
+                        dest += run_len*partlen;
+                        queued += run_len;
+                        count += run_len;
+                        run_len = 0;
+                }
+                if(done || queued >= INDEXED_WINDOW){
+                        if(plan.execute(files, debug))
+                                return 0;
+                        queued = 0;
+                }
+                if(done)
+                        break;
+                //Usually the next particle is in the same segment or the one after
+                if(i < starts[s] || i >= starts[s+1])
+                        s = std::upper_bound(starts.begin(), starts.end(), i) - starts.begin() - 1;
+                run_seg = s;
+                run_first = i;
+                run_len = 1;
+        }
+        if(GetFormat() & 2){
+                if(partlen / GetBlockComponents(block) == 8)
+                        multi_endian_swap64((uint64_t *) out, count*partlen/8);
+                else
+                        multi_endian_swap((uint32_t *) out, count*partlen/4);
+        }
+        return count;
+  }
+
+  int64_t GSnap::GetBlockIndexed(const std::string& BlockName, void *out, const std::vector<int64_t>& index, int skip_type)
+  {
+        //A negative index would end the read early
+        for(size_t j = 0; j < index.size(); j++)
+                if(index[j] < 0){
+                        WARN("Particle %ld is not in block %s\n",index[j],BlockName.c_str());
+                        return 0;
+                }
+        size_t i = 0;
+        return read_indexed(make_block_key(BlockName), out, skip_type, [&]{ return i < index.size() ? index[i++] : -1; });
+  }
+
+  int64_t GSnap::GetBlockStrided(const std::string& BlockName, void *out, int64_t stride, int64_t start_part, int skip_type)
+  {
+        const block_key key = make_block_key(BlockName);
+        if(stride <= 0 || start_part < 0){
+                WARN("Bad stride %ld or start %ld\n",stride,start_part);
+                return 0;
+        }
+        const int64_t total = count_parts(key, skip_type);
+        int64_t i = start_part;
+        return read_indexed(key, out, skip_type, [&]{
+                        if(i >= total)
+                                return (int64_t) -1;
+                        int64_t cur = i;
+                        i += stride;
+                        return cur;
+                });
+  }
+
+  int64_t GSnap::GetBlockSample(const std::string& BlockName, void *out, double fraction, uint64_t seed, int skip_type)
+  {
+        const block_key key = make_block_key(BlockName);
+        const int64_t total = count_parts(key, skip_type);
+        int64_t i = 0;
+        return read_indexed(key, out, skip_type, [&]{
+                        for(; i < total; i++)
+                                if(in_sample(i, fraction, seed))
+                                        return i++;
+                        return (int64_t) -1;
+                });
+  }
+
+  int64_t GSnap::GetSampleSize(const std::string& BlockName, double fraction, uint64_t seed, int skip_type)
+  {
+        const int64_t total = count_parts(make_block_key(BlockName), skip_type);
+        int64_t count = 0;
+        for(int64_t i = 0; i < total; i++)
+                count += in_sample(i, fraction, seed);
+        return count;
+  }
+}
@@ -0,0 +1,252 @@
+/* Filtered reads: select particles by the values of a block, and read only those*/
+#include "gadgetreader.hpp"
+#include "read_utils.h"
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace GadgetReader{
+
+  /*Identifies a zone map file, and its version*/
+  static const char zone_magic[8] = {'G','Z','O','N','E','0','0','1'};
+
+  /*Least and greatest values of one block, for each chunk of the particles of one type in one file*/
+  struct zone_map {
+        block_key key;
+        int32_t type;
+        /*Where the block was when the map was made, so stale maps can be spotted*/
+        int64_t start_pos;
+        uint64_t length;
+        int64_t chunk;
+        std::vector<double> mins, maxs;
+  };
+
+  /*Load the zone maps of one file, dropping any whose block no longer matches*/
+  static std::vector<zone_map> read_zone_maps(const GSnapFile& file)
+  {
+        std::vector<zone_map> maps;
+        FILE * fd = fopen((file.name+".zones").c_str(), "rb");
+        if(!fd)
+                return maps;
+        char magic[sizeof(zone_magic)];
+        uint64_t count = 0;
+        bool ok = fread(magic, sizeof(magic), 1, fd) == 1 && memcmp(magic, zone_magic, sizeof(magic)) == 0 &&
+                fread(&count, sizeof(count), 1, fd) == 1;
+        for(uint64_t i = 0; ok && i < count; i++){
+                zone_map map;
+                uint64_t nchunks;
+                ok = fread(&map.key, sizeof(map.key), 1, fd) == 1 && fread(&map.type, sizeof(map.type), 1, fd) == 1 &&
+                        fread(&map.start_pos, sizeof(map.start_pos), 1, fd) == 1 && fread(&map.length, sizeof(map.length), 1, fd) == 1 &&
+                        fread(&map.chunk, sizeof(map.chunk), 1, fd) == 1 && fread(&nchunks, sizeof(nchunks), 1, fd) == 1 &&
+                        map.chunk > 0 && nchunks < (1ull << 40);
+                if(!ok)
+                        break;
+                map.mins.resize(nchunks);
+                map.maxs.resize(nchunks);
+                ok = nchunks == 0 || (fread(&map.mins[0], sizeof(double), nchunks, fd) == nchunks &&
+                                fread(&map.maxs[0], sizeof(double), nchunks, fd) == nchunks);
+                const block_info * block = file.blocks.find(map.key);
+                if(ok && block && block->start_pos == map.start_pos && block->length == map.length)
+                        maps.push_back(map);
+        }
+        fclose(fd);
+        if(!ok)
+                maps.clear();
+        return maps;
+  }
+
+  static const zone_map * find_zone_map(const std::vector<zone_map>& maps, block_key key, int type)
+  {
+        for(size_t i = 0; i < maps.size(); i++)
+                if(maps[i].key == key && maps[i].type == type)
+                        return &maps[i];
+        return NULL;
+  }
+
+  /*Can any of particles first to first+n of a segment lie in [min, max]? True if the map does not say.*/
+  static bool zone_may_match(const zone_map * map, int64_t first, int64_t n, double min, double max)
+  {
+        if(!map)
+                return true;
+        const int64_t last = (first + n - 1)/map->chunk;
+        if(last >= (int64_t) map->mins.size())
+                return true;
+        for(int64_t c = first/map->chunk; c <= last; c++)
+                if(map->maxs[c] >= min && map->mins[c] <= max)
+                        return true;
+        return false;
+  }
+
+  /*Particles tested at once*/
+  #define SELECT_CHUNK 65536
+
+  int GSnap::Select(const std::vector<block_predicate>& predicates, int type, std::vector<int64_t>& index, int64_t * skipped)
+  {
+        index.clear();
+        if(skipped)
+                *skipped = 0;
+        if(type < 0 || type >= N_TYPE || predicates.empty()){
+                WARN("Nothing to select: type %d, %lu predicates\n",type,predicates.size());
+                return 1;
+        }
+        std::vector<block_handle> handles;
+        for(size_t k = 0; k < predicates.size(); k++){
+                const block_handle handle = GetBlockHandle(predicates[k].block);
+                if(!IsBlock(handle) || GetBlockComponents(handle) != 1 || !(GetBlockTypes(handle) & (1 << type))){
+                        WARN("Cannot select on block %s for type %d\n",predicates[k].block.c_str(),type);
+                        return 1;
+                }
+                handles.push_back(handle);
+        }
+        //Every block must have the same particles
+        const std::vector<block_segment> segs = GetBlockSegments(handles[0], type);
+        for(size_t k = 1; k < handles.size(); k++){
+                std::vector<block_segment> other = GetBlockSegments(handles[k], type);
+                bool same = other.size() == segs.size();
+                for(size_t s = 0; same && s < segs.size(); s++)
+                        same = other[s].file == segs[s].file && other[s].npart == segs[s].npart;
+                if(!same){
+                        WARN("Blocks %s and %s do not have the same particles\n",predicates[0].block.c_str(),predicates[k].block.c_str());
+                        return 1;
+                }
+        }
+        const int skip_type = ((1 << N_TYPE) - 1) & ~(1 << type);
+        std::vector<double> values(SELECT_CHUNK);
+        std::vector<char> pass(SELECT_CHUNK);
+        //Position of the first particle of the segment among the particles of type
+        int64_t base = 0;
+        for(size_t s = 0; s < segs.size(); base += segs[s].npart, s++){
+                const std::vector<zone_map> maps = read_zone_maps(file_maps[segs[s].file]);
+                std::vector<const zone_map *> zones;
+                for(size_t k = 0; k < handles.size(); k++)
+                        zones.push_back(find_zone_map(maps, handles[k].key, type));
+                //Go through the particles a zone at a time, so each zone may be skipped
+                int64_t step = SELECT_CHUNK;
+                for(size_t k = 0; k < zones.size(); k++)
+                        if(zones[k])
+                                step = std::min(step, zones[k]->chunk);
+                for(int64_t first = 0; first < segs[s].npart; first += step){
+                        const int64_t n = std::min<int64_t>(step, segs[s].npart - first);
+                        bool may_match = true;
+                        for(size_t k = 0; may_match && k < handles.size(); k++)
+                                may_match = zone_may_match(zones[k], first, n, predicates[k].min, predicates[k].max);
+                        if(!may_match){
+                                if(skipped)
+                                        *skipped += n;
+                                continue;
+                        }
+                        int64_t npass = n;
+                        for(size_t k = 0; npass > 0 && k < handles.size(); k++){
+                                if(ReadBlock<double,1>(handles[k], &values[0], n, base + first, skip_type) != n){
+                                        WARN("Could not read block %s for selection\n",predicates[k].block.c_str());
+                                        index.clear();
+                                        return 1;
+                                }
+                                const double min = predicates[k].min, max = predicates[k].max;
+                                npass = 0;
+                                for(int64_t i = 0; i < n; i++){
+                                        pass[i] = (k == 0 || pass[i]) && values[i] >= min && values[i] <= max;
+                                        npass += pass[i];
+                                }
+                        }
+                        for(int64_t i = 0; npass > 0 && i < n; i++)
+                                if(pass[i])
+                                        index.push_back(base + first + i);
+                }
+        }
+        return 0;
+  }
+
+  int64_t GSnap::ReadSelected(const std::string& BlockName, int type, const std::vector<int64_t>& index, void * out)
+  {
+        if(type < 0 || type >= N_TYPE || !(GetBlockTypes(BlockName) & (1 << type))){
+                WARN("Block %s has no particles of type %d\n",BlockName.c_str(),type);
+                return 0;
+        }
+        return GetBlockIndexed(BlockName, out, index, ((1 << N_TYPE) - 1) & ~(1 << type));
+  }
+
+  /*Binary format: magic, number of maps, then for each map
+   * block key, type, start_pos and length of the block, chunk size, number of chunks, the least values and the greatest.
+   * Native endian.*/
+  int GSnap::WriteZoneMaps(const std::vector<std::string>& BlockNames, int64_t chunk)
+  {
+        if(chunk <= 0)
+                return 1;
+        int ret = 0;
+        std::vector<std::vector<zone_map> > maps(file_maps.size());
+        std::vector<block_key> mapped;
+        std::vector<double> values(std::min<int64_t>(chunk, SELECT_CHUNK));
+        for(size_t b = 0; b < BlockNames.size(); b++){
+                const block_handle handle = GetBlockHandle(BlockNames[b]);
+                if(!IsBlock(handle) || GetBlockComponents(handle) != 1){
+                        WARN("Cannot make a zone map of block %s\n",BlockNames[b].c_str());
+                        ret = 1;
+                        continue;
+                }
+                mapped.push_back(handle.key);
+                for(int type = 0; type < N_TYPE; type++){
+                        const std::vector<block_segment> segs = GetBlockSegments(handle, type);
+                        const int skip_type = ((1 << N_TYPE) - 1) & ~(1 << type);
+                        int64_t base = 0;
+                        for(size_t s = 0; s < segs.size(); base += segs[s].npart, s++){
+                                const block_info * block = file_maps[segs[s].file].blocks.find(handle.key);
+                                zone_map map;
+                                map.key = handle.key;
+                                map.type = type;
+                                map.start_pos = block->start_pos;
+                                map.length = block->length;
+                                map.chunk = chunk;
+                                const int64_t nchunks = (segs[s].npart + chunk - 1)/chunk;
+                                map.mins.assign(nchunks, INFINITY);
+                                map.maxs.assign(nchunks, -INFINITY);
+                                //Read in pieces of at most SELECT_CHUNK, which may be smaller than a zone
+                                for(int64_t first = 0; first < segs[s].npart; first += values.size()){
+                                        const int64_t n = std::min<int64_t>(values.size(), segs[s].npart - first);
+                                        if(ReadBlock<double,1>(handle, &values[0], n, base + first, skip_type) != n){
+                                                WARN("Could not read block %s to map it\n",BlockNames[b].c_str());
+                                                return 1;
+                                        }
+                                        for(int64_t i = 0; i < n; i++){
+                                                const int64_t c = (first + i)/chunk;
+                                                map.mins[c] = std::min(map.mins[c], values[i]);
+                                                map.maxs[c] = std::max(map.maxs[c], values[i]);
+                                        }
+                                }
+                                maps[segs[s].file].push_back(map);
+                        }
+                }
+        }
+        for(size_t i = 0; i < file_maps.size(); i++){
+                //Keep the maps already saved for other blocks
+                const std::vector<zone_map> old = read_zone_maps(file_maps[i]);
+                for(size_t m = 0; m < old.size(); m++)
+                        if(std::find(mapped.begin(), mapped.end(), old[m].key) == mapped.end())
+                                maps[i].push_back(old[m]);
+                const std::string filename = file_maps[i].name+".zones";
+                FILE * fd = fopen(filename.c_str(), "wb");
+                if(!fd){
+                        WARN("Could not open %s for writing\n",filename.c_str());
+                        ret = 1;
+                        continue;
+                }
+                uint64_t count = maps[i].size();
+                bool ok = fwrite(zone_magic, sizeof(zone_magic), 1, fd) == 1 && fwrite(&count, sizeof(count), 1, fd) == 1;
+                for(size_t m = 0; ok && m < maps[i].size(); m++){
+                        const zone_map& map = maps[i][m];
+                        uint64_t nchunks = map.mins.size();
+                        ok = fwrite(&map.key, sizeof(map.key), 1, fd) == 1 && fwrite(&map.type, sizeof(map.type), 1, fd) == 1 &&
+                                fwrite(&map.start_pos, sizeof(map.start_pos), 1, fd) == 1 && fwrite(&map.length, sizeof(map.length), 1, fd) == 1 &&
+                                fwrite(&map.chunk, sizeof(map.chunk), 1, fd) == 1 && fwrite(&nchunks, sizeof(nchunks), 1, fd) == 1 &&
+                                (nchunks == 0 || (fwrite(&map.mins[0], sizeof(double), nchunks, fd) == nchunks &&
+                                        fwrite(&map.maxs[0], sizeof(double), nchunks, fd) == nchunks));
+                }
+                if(fclose(fd) || !ok){
+                        WARN("Could not write %s\n",filename.c_str());
+                        ret = 1;
+                }
+        }
+        return ret;
+  }
+}
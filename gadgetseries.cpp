@@ -0,0 +1,91 @@
+/* Time series of snapshots, with the next snapshot loaded in the background*/
+#include "gadgetseries.hpp"
+#include "read_utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+namespace GadgetReader{
+
+  /*Whether pattern is safe to give to snprintf with four ints: every conversion is %d or %i,
+   * optionally with flags, a width and a precision, and there are at most four of them.*/
+  static bool valid_pattern(const std::string& pattern)
+  {
+          int conversions = 0;
+          for(size_t i = 0; i < pattern.size(); i++){
+                  if(pattern[i] != '%')
+                          continue;
+                  i++;
+                  if(i < pattern.size() && pattern[i] == '%')
+                          continue;
+                  while(i < pattern.size() && strchr("0-+ ", pattern[i]))
+                          i++;
+                  while(i < pattern.size() && isdigit(pattern[i]))
+                          i++;
+                  if(i < pattern.size() && pattern[i] == '.')
+                          for(i++; i < pattern.size() && isdigit(pattern[i]); i++);
+                  if(i >= pattern.size() || (pattern[i] != 'd' && pattern[i] != 'i'))
+                          return false;
+                  conversions++;
+          }
+          return conversions <= 4;
+  }
+
+  GSnapSeries::GSnapSeries(const std::string& pattern, int first, int last, const std::vector<std::string>& BlockNames, int type_mask, bool debug): pattern(pattern), last(last), BlockNames(BlockNames), type_mask(type_mask), debug(debug), index(first-1), status(1), next_index(first), next_status(1)
+  {
+          if(!valid_pattern(pattern)){
+                  WARN("Snapshot name pattern %s may only have up to four %%d or %%i conversions\n",pattern.c_str());
+                  this->pattern.clear();
+                  return;
+          }
+          if(first <= last)
+                  prefetch(first, NULL);
+  }
+
+  GSnapSeries::~GSnapSeries()
+  {
+          if(worker.joinable())
+                  worker.join();
+  }
+
+  std::string GSnapSeries::GetFilename(int i) const
+  {
+          //The same index for up to four conversions
+          std::vector<char> name(pattern.size()+64);
+          snprintf(&name[0], name.size(), pattern.c_str(), i, i, i, i);
+          return std::string(&name[0]);
+  }
+
+  void GSnapSeries::prefetch(int i, const GSnap * like)
+  {
+          next_index = i;
+          layout.reset(like ? new GSnap(*like) : NULL);
+          worker = std::thread([this]{
+                  const std::string name = GetFilename(next_index);
+                  next_snap.reset(layout ? new GSnap(name, *layout, debug) : new GSnap(name, debug));
+                  next_snap->SetBufferPool(&pool);
+                  next_data.reset(new GSnapData(&pool));
+                  if(next_snap->GetNumFiles() < 1)
+                          next_status = 1;
+                  else
+                          next_status = next_snap->Load(BlockNames, type_mask, *next_data);
+          });
+  }
+
+  bool GSnapSeries::Next()
+  {
+          if(!worker.joinable())
+                  return false;
+          worker.join();
+          //Free the current snapshot first, so the prefetch below can reuse its buffers
+          data.reset();
+          snap.reset();
+          index = next_index;
+          status = next_status;
+          snap = std::move(next_snap);
+          data = std::move(next_data);
+          if(index < last)
+                  prefetch(index+1, snap.get());
+          return true;
+  }
+}
@@ -0,0 +1,106 @@
+/* Copyright (c) 2010, Simeon Bird <spb41@cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+/** \file
+ * Reader for a time series of snapshots, which loads the next snapshot
+ * in the background while the current one is being used.*/
+#ifndef __GADGETSERIES_H
+#define __GADGETSERIES_H
+
+#include "gadgetreader.hpp"
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace GadgetReader{
+
+  /** Steps through the snapshots of a simulation in order, loading the same blocks from each.
+   * While the caller works on one snapshot, the next is opened and its blocks loaded on a background thread.
+   * Each snapshot is opened with the previous one as a template, so unchanged block maps are copied
+   * rather than rebuilt, and load buffers are recycled through a GBufferPool.
+   * At most two snapshots are in memory at once: the current one and the one being prefetched.
+   *
+   * Use it like this:
+   * \code
+   * GSnapSeries series("output/snapdir_%03d/snap_%03d", 0, 300, blocks, 1<<BARYON_TYPE);
+   * while(series.Next()){
+   *     const float * pos = series.GetData().Get<float>("POS ");
+   *     ...
+   * }
+   * \endcode
+   */
+  class DLL_PUBLIC GSnapSeries {
+    public:
+    /** @param pattern printf format for the snapshot names, with integer conversions for the index.
+     * Every conversion is given the same index, so "snapdir_%03d/snap_%03d" works.
+     * Only up to four %d or %i conversions (with flags, width and precision) and %% are allowed;
+     * any other pattern gives an empty series, for which Next() returns false at once.
+     * @param first, last Range of indices to read, inclusive.
+     * @param BlockNames Blocks to load from each snapshot. Blocks missing from a snapshot are skipped.
+     * @param type_mask Bitfield of the types to load, as for GSnap::Load.
+     * @param debug Whether runtime warnings are printed.
+     * The first snapshot starts loading straight away.*/
+    GSnapSeries(const std::string& pattern, int first, int last, const std::vector<std::string>& BlockNames, int type_mask=(1<<N_TYPE)-1, bool debug=true);
+    /** Waits for any prefetch to finish.*/
+    ~GSnapSeries();
+    /** Move to the next snapshot, which is the first one on the first call, and start prefetching the one after.
+     * The previous snapshot and its data are freed.
+     * @return false once every snapshot in the range has been visited.*/
+    bool Next();
+    /** Index of the current snapshot*/
+    int GetIndex() const {
+        return index;
+    }
+    /** Filename of snapshot number i, empty if the pattern was rejected*/
+    std::string GetFilename(int i) const;
+    /** The current snapshot. Check GetNumFiles() to see whether it could be opened.*/
+    GSnap& GetSnap() {
+        return *snap;
+    }
+    /** The blocks loaded from the current snapshot*/
+    const GSnapData& GetData() const {
+        return *data;
+    }
+    /** Result of loading the current snapshot: 0 if all was read, 1 if it could not be opened or a read failed.*/
+    int GetStatus() const {
+        return status;
+    }
+    private:
+    GSnapSeries(const GSnapSeries&);
+    GSnapSeries& operator=(const GSnapSeries&);
+    /** Start opening and loading snapshot i on the background thread.
+     * like is the layout template, copied so the caller may keep using the original.*/
+    void prefetch(int i, const GSnap * like);
+    std::string pattern;
+    int last;
+    std::vector<std::string> BlockNames;
+    int type_mask;
+    bool debug;
+    /** Load buffers, shared between snapshots. Declared before the data, so it is destroyed after it.*/
+    GBufferPool pool;
+    /** The current snapshot*/
+    int index, status;
+    std::unique_ptr<GSnap> snap;
+    std::unique_ptr<GSnapData> data;
+    /** The snapshot being prefetched*/
+    int next_index, next_status;
+    std::unique_ptr<GSnap> next_snap;
+    std::unique_ptr<GSnapData> next_data;
+    /** Copy of the previous snapshot, for the background thread to use as a layout template*/
+    std::unique_ptr<GSnap> layout;
+    std::thread worker;
+  };
+}
+
+#endif //__GADGETSERIES_H
@@ -0,0 +1,345 @@
+/* Sorting the particles of a snapshot by ID: a parallel radix sort, then permutation of the blocks in memory or on disc*/
+#include "gadgetsort.hpp"
+#include "read_utils.h"
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <stdio.h>
+#include <string.h>
+
+namespace GadgetReader{
+
+  /*Keys each thread should have at least, for the radix sort to use it*/
+  #define RADIX_MIN_PER_THREAD (1<<16)
+  /*Particles read at once when streaming a block*/
+  #define SORT_CHUNK (1<<16)
+  /*How far ahead ApplyPermutation prefetches*/
+  #define PERMUTE_PREFETCH 16
+  /*Most bucket files SortByIDToFiles has open at once*/
+  #define SORT_MAX_BUCKETS 256
+
+  static int default_threads(int nthreads)
+  {
+        return nthreads > 0 ? nthreads : std::max<int>(std::thread::hardware_concurrency(), 1);
+  }
+
+  /*Run work(t) for t = 0 to nthreads-1, each on its own thread*/
+  static void run_threads(int nthreads, const std::function<void(int)>& work)
+  {
+        if(nthreads <= 1){
+                work(0);
+                return;
+        }
+        std::vector<std::thread> workers;
+        for(int t = 0; t < nthreads; t++)
+                workers.push_back(std::thread(work, t));
+        for(size_t t = 0; t < workers.size(); t++)
+                workers[t].join();
+  }
+
+  void RadixSortPermutation(std::vector<uint64_t>& keys, std::vector<int64_t>& perm, int key_bits, int nthreads)
+  {
+        const int64_t n = keys.size();
+        perm.resize(n);
+        for(int64_t i = 0; i < n; i++)
+                perm[i] = i;
+        key_bits = std::min(std::max(key_bits, 8), 64);
+        if(key_bits < 64)
+                for(int64_t i = 0; i < n; i++)
+                        keys[i] &= (1ull << key_bits) - 1;
+        nthreads = std::max<int64_t>(std::min<int64_t>(default_threads(nthreads), n/RADIX_MIN_PER_THREAD), 1);
+        std::vector<uint64_t> key_tmp(n);
+        std::vector<int64_t> perm_tmp(n);
+        //Thread t handles keys first[t] to first[t+1], and counts each byte into count[256*t+byte]
+        std::vector<int64_t> first(nthreads+1);
+        for(int t = 0; t <= nthreads; t++)
+                first[t] = n*t/nthreads;
+        std::vector<int64_t> count(256*nthreads);
+        for(int shift = 0; shift < key_bits; shift += 8){
+                run_threads(nthreads, [&](int t){
+                        int64_t * c = &count[256*t];
+                        std::fill(c, c+256, 0);
+                        for(int64_t i = first[t]; i < first[t+1]; i++)
+                                c[(keys[i] >> shift) & 0xff]++;
+                });
+                //Nothing moves if every key has the same byte here
+                bool uniform = false;
+                for(int d = 0; d < 256 && !uniform; d++){
+                        int64_t total = 0;
+                        for(int t = 0; t < nthreads; t++)
+                                total += count[256*t+d];
+                        uniform = total == n;
+                }
+                if(uniform)
+                        continue;
+                //Turn the counts into where each thread puts its first key with each byte: all of byte 0, thread by thread, then byte 1...
+                int64_t offset = 0;
+                for(int d = 0; d < 256; d++)
+                        for(int t = 0; t < nthreads; t++){
+                                const int64_t c = count[256*t+d];
+                                count[256*t+d] = offset;
+                                offset += c;
+                        }
+                run_threads(nthreads, [&](int t){
+                        int64_t * c = &count[256*t];
+                        for(int64_t i = first[t]; i < first[t+1]; i++){
+                                const int64_t dest = c[(keys[i] >> shift) & 0xff]++;
+                                key_tmp[dest] = keys[i];
+                                perm_tmp[dest] = perm[i];
+                        }
+                });
+                keys.swap(key_tmp);
+                perm.swap(perm_tmp);
+        }
+  }
+
+  /*Gather particles first to last of out from in. A constant partlen lets the copy be inlined.*/
+  template <int P> static void gather(const char * in, char * out, int partlen, const int64_t * perm, int64_t first, int64_t last)
+  {
+        const int len = P > 0 ? P : partlen;
+        for(int64_t i = first; i < last; i++){
+#ifdef __GNUC__
+                if(i + PERMUTE_PREFETCH < last)
+                        __builtin_prefetch(in + perm[i + PERMUTE_PREFETCH]*len);
+#endif
+                memcpy(out + i*len, in + perm[i]*len, len);
+        }
+  }
+
+  void ApplyPermutation(const char * in, char * out, int partlen, const std::vector<int64_t>& perm, int nthreads)
+  {
+        const int64_t n = perm.size();
+        nthreads = std::max<int64_t>(std::min<int64_t>(default_threads(nthreads), n/RADIX_MIN_PER_THREAD), 1);
+        run_threads(nthreads, [&](int t){
+                const int64_t first = n*t/nthreads, last = n*(t+1)/nthreads;
+                switch(partlen){
+                        case 4:
+                                gather<4>(in, out, partlen, &perm[0], first, last);
+                                break;
+                        case 8:
+                                gather<8>(in, out, partlen, &perm[0], first, last);
+                                break;
+                        case 12:
+                                gather<12>(in, out, partlen, &perm[0], first, last);
+                                break;
+                        case 24:
+                                gather<24>(in, out, partlen, &perm[0], first, last);
+                                break;
+                        default:
+                                gather<0>(in, out, partlen, &perm[0], first, last);
+                }
+        });
+  }
+
+  /*Particles of each type to sort: those of the types in type_mask which have IDs*/
+  static void sort_types(GSnap& snap, block_handle id, int type_mask, int64_t nparts[N_TYPE])
+  {
+        const int types = snap.GetBlockTypes(id) & type_mask;
+        for(int t = 0; t < N_TYPE; t++)
+                nparts[t] = (types & (1 << t)) ? snap.GetBlockSize(id, t)/snap.GetPartLen(id) : 0;
+  }
+
+  /*Load the IDs of the particles to sort, as unsigned 64-bit integers, and sort them*/
+  static int load_and_sort_ids(GSnap& snap, const int64_t nparts[N_TYPE], std::vector<uint64_t>& keys, std::vector<int64_t>& perm, int nthreads, bool debug)
+  {
+        const block_handle id = GSnap::GetBlockHandle("ID  ");
+        int64_t n = 0;
+        for(int t = 0; t < N_TYPE; t++)
+                n += nparts[t];
+        keys.resize(n);
+        int64_t offset = 0;
+        for(int t = 0; t < N_TYPE; t++){
+                if(!nparts[t])
+                        continue;
+                const int skip_type = ((1 << N_TYPE) - 1) & ~(1 << t);
+                if(snap.ReadBlockAs(id, &keys[offset], 'i', sizeof(uint64_t), 1, nparts[t], 0, skip_type) != nparts[t]){
+                        WARN("Could not read the IDs of type %d\n",t);
+                        return 1;
+                }
+                offset += nparts[t];
+        }
+        //32-bit IDs were sign extended
+        RadixSortPermutation(keys, perm, snap.GetPartLen(id) == 4 ? 32 : 64, nthreads);
+        return 0;
+  }
+
+  /*Whether a block has the same particles as the IDs to sort*/
+  static bool block_matches(GSnap& snap, block_handle block, const int64_t nparts[N_TYPE])
+  {
+        if(!snap.IsBlock(block))
+                return false;
+        for(int t = 0; t < N_TYPE; t++)
+                if(nparts[t] && (!(snap.GetBlockTypes(block) & (1 << t)) || snap.GetBlockSize(block, t)/snap.GetPartLen(block) != nparts[t]))
+                        return false;
+        return true;
+  }
+
+  int SortByID(GSnap& snap, const std::vector<std::string>& BlockNames, int type_mask, sorted_blocks& result, int nthreads, bool debug)
+  {
+        const block_handle id = GSnap::GetBlockHandle("ID  ");
+        result.ids.clear();
+        result.order.clear();
+        result.blocks.clear();
+        result.partlen.clear();
+        if(!snap.IsBlock(id)){
+                WARN("There are no IDs to sort by\n");
+                return 1;
+        }
+        int64_t nparts[N_TYPE];
+        sort_types(snap, id, type_mask, nparts);
+        std::vector<block_handle> blocks;
+        for(size_t b = 0; b < BlockNames.size(); b++){
+                blocks.push_back(GSnap::GetBlockHandle(BlockNames[b]));
+                if(!block_matches(snap, blocks[b], nparts)){
+                        WARN("Block %s does not have the same particles as ID\n",BlockNames[b].c_str());
+                        return 1;
+                }
+        }
+        if(load_and_sort_ids(snap, nparts, result.ids, result.order, nthreads, debug))
+                return 1;
+        const int64_t n = result.ids.size();
+        std::vector<char> loaded;
+        for(size_t b = 0; b < blocks.size(); b++){
+                const short partlen = snap.GetPartLen(blocks[b]);
+                loaded.resize(n*partlen);
+                int64_t offset = 0;
+                for(int t = 0; t < N_TYPE; t++){
+                        if(!nparts[t])
+                                continue;
+                        const int skip_type = ((1 << N_TYPE) - 1) & ~(1 << t);
+                        if(snap.GetBlock(blocks[b], &loaded[offset*partlen], nparts[t], 0, skip_type) != nparts[t]){
+                                WARN("Could not read block %s\n",BlockNames[b].c_str());
+                                return 1;
+                        }
+                        offset += nparts[t];
+                }
+                result.blocks.push_back(std::vector<char>(n*partlen));
+                result.partlen.push_back(partlen);
+                if(n > 0)
+                        ApplyPermutation(&loaded[0], &result.blocks[b][0], partlen, result.order, nthreads);
+        }
+        return 0;
+  }
+
+  int SortByIDToFiles(GSnap& snap, const std::vector<std::string>& BlockNames, int type_mask, const std::string& prefix, int64_t max_bytes, int nthreads, bool debug)
+  {
+        const block_handle id = GSnap::GetBlockHandle("ID  ");
+        if(!snap.IsBlock(id)){
+                WARN("There are no IDs to sort by\n");
+                return 1;
+        }
+        int64_t nparts[N_TYPE];
+        sort_types(snap, id, type_mask, nparts);
+        for(size_t b = 0; b < BlockNames.size(); b++)
+                if(!block_matches(snap, GSnap::GetBlockHandle(BlockNames[b]), nparts)){
+                        WARN("Block %s does not have the same particles as ID\n",BlockNames[b].c_str());
+                        return 1;
+                }
+        //Only the destination of each particle is kept once the IDs are sorted
+        std::vector<int64_t> dest;
+        {
+                std::vector<uint64_t> keys;
+                std::vector<int64_t> perm;
+                if(load_and_sort_ids(snap, nparts, keys, perm, nthreads, debug))
+                        return 1;
+                dest.resize(perm.size());
+                for(size_t i = 0; i < perm.size(); i++)
+                        dest[perm[i]] = i;
+        }
+        const int64_t n = dest.size();
+        for(size_t b = 0; b < BlockNames.size(); b++){
+                const block_handle block = GSnap::GetBlockHandle(BlockNames[b]);
+                const short partlen = snap.GetPartLen(block);
+                std::string name = BlockNames[b];
+                name.erase(name.find_last_not_of(' ') + 1);
+                const std::string outname = prefix + "." + name;
+                //Each bucket holds a contiguous part of the output, small enough to fit in memory
+                const int64_t bucket_parts = std::max<int64_t>(max_bytes/partlen, 1);
+                const int64_t nbuckets = (n + bucket_parts - 1)/bucket_parts;
+                std::vector<char> bucket(std::min(bucket_parts, n)*partlen);
+                std::vector<char> chunk(std::min<int64_t>(SORT_CHUNK, n)*partlen);
+                FILE * out = fopen(outname.c_str(), "wb");
+                int ret = 0;
+                if(!out){
+                        WARN("Could not open %s for writing\n",outname.c_str());
+                        ret = 1;
+                }
+                //Buckets are filled SORT_MAX_BUCKETS at a time, so as not to run out of file descriptors.
+                //The block is read once for each group, which writes the next part of the output.
+                for(int64_t group = 0; group < nbuckets && !ret; group += SORT_MAX_BUCKETS){
+                        const int64_t ngroup = std::min<int64_t>(SORT_MAX_BUCKETS, nbuckets - group);
+                        const int64_t lo = group*bucket_parts, hi = std::min(n, (group + ngroup)*bucket_parts);
+                        std::vector<FILE *> tmp;
+                        std::vector<std::string> tmpnames;
+                        for(int64_t k = group; nbuckets > 1 && k < group + ngroup && !ret; k++){
+                                char suffix[32];
+                                snprintf(suffix, 32, ".bucket%ld", k);
+                                tmpnames.push_back(outname + suffix);
+                                tmp.push_back(fopen(tmpnames.back().c_str(), "w+b"));
+                                if(!tmp.back()){
+                                        WARN("Could not open %s\n",tmpnames.back().c_str());
+                                        tmp.pop_back();
+                                        ret = 1;
+                                }
+                        }
+                        //First pass: read the block in order, putting each particle bound for this group in its bucket,
+                        //or straight in place if there is only one
+                        int64_t src = 0;
+                        for(int t = 0; t < N_TYPE && !ret; t++){
+                                const int skip_type = ((1 << N_TYPE) - 1) & ~(1 << t);
+                                for(int64_t first = 0; first < nparts[t] && !ret; first += SORT_CHUNK){
+                                        const int64_t m = std::min<int64_t>(SORT_CHUNK, nparts[t] - first);
+                                        if(snap.GetBlock(block, &chunk[0], m, first, skip_type) != m){
+                                                WARN("Could not read block %s\n",BlockNames[b].c_str());
+                                                ret = 1;
+                                                break;
+                                        }
+                                        for(int64_t i = 0; i < m; i++, src++){
+                                                const int64_t d = dest[src];
+                                                if(d < lo || d >= hi)
+                                                        continue;
+                                                if(nbuckets == 1){
+                                                        memcpy(&bucket[d*partlen], &chunk[i*partlen], partlen);
+                                                        continue;
+                                                }
+                                                FILE * fd = tmp[d/bucket_parts - group];
+                                                if(fwrite(&d, sizeof(d), 1, fd) != 1 || fwrite(&chunk[i*partlen], partlen, 1, fd) != 1){
+                                                        WARN("Could not write %s\n",tmpnames[d/bucket_parts - group].c_str());
+                                                        ret = 1;
+                                                        break;
+                                                }
+                                        }
+                                }
+                        }
+                        //Second pass: put the particles of each bucket in place, and write it out
+                        for(int64_t k = group; k < group + ngroup && !ret; k++){
+                                const int64_t base = k*bucket_parts, len = std::min(bucket_parts, n - base);
+                                if(nbuckets > 1){
+                                        FILE * fd = tmp[k - group];
+                                        rewind(fd);
+                                        int64_t d;
+                                        for(int64_t i = 0; i < len && !ret; i++)
+                                                if(fread(&d, sizeof(d), 1, fd) != 1 || d < base || d >= base + len ||
+                                                                fread(&bucket[(d - base)*partlen], partlen, 1, fd) != 1){
+                                                        WARN("Could not read back %s\n",tmpnames[k - group].c_str());
+                                                        ret = 1;
+                                                }
+                                }
+                                if(!ret && fwrite(&bucket[0], partlen, len, out) != (size_t) len){
+                                        WARN("Could not write %s\n",outname.c_str());
+                                        ret = 1;
+                                }
+                        }
+                        for(size_t k = 0; k < tmp.size(); k++){
+                                fclose(tmp[k]);
+                                remove(tmpnames[k].c_str());
+                        }
+                }
+                if(out && fclose(out))
+                        ret = 1;
+                if(ret)
+                        return 1;
+        }
+        return 0;
+  }
+}
@@ -0,0 +1,81 @@
+/* Copyright (c) 2010, Simeon Bird <spb41@cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+/** \file
+ * Put the particles of a snapshot in order of ID, so that snapshots written with different domain decompositions
+ * can be compared particle by particle. IDs are sorted with a parallel radix sort, and the blocks then permuted,
+ * either in memory or, for blocks too large for memory, through temporary files on disc.*/
+#ifndef __GADGETSORT_H
+#define __GADGETSORT_H
+
+#include "gadgetreader.hpp"
+#include <string>
+#include <vector>
+
+namespace GadgetReader{
+
+  /** Blocks of a snapshot in order of particle ID, as filled by SortByID*/
+  typedef struct{
+    /** Particle IDs, in ascending order*/
+    std::vector<uint64_t> ids;
+    /** Where each particle was in the snapshot: its position among the particles of the types sorted,
+     * taking each type in turn in the order GetBlock gives them*/
+    std::vector<int64_t> order;
+    /** Data of each block, in the order the blocks were named: GetPartLen bytes for each particle,
+     * as in the file but in native byte order, in the order of ids*/
+    std::vector<std::vector<char> > blocks;
+    /** Bytes per particle of each block*/
+    std::vector<short> partlen;
+  } sorted_blocks;
+
+  /** Sort keys into ascending order with a least significant digit first radix sort on several threads.
+   * The sort is stable. Each thread counts and then moves its own part of the keys a byte at a time,
+   * and passes for bytes which are the same in every key are skipped.
+   * It needs scratch copies of keys and perm, so 32 bytes for each key in all.
+   * @param keys Keys to sort, sorted on return
+   * @param perm Set to the original position of each key, so that keys[i] was at perm[i]
+   * @param key_bits Bits in each key: 32 or 64. Higher bits are ignored.
+   * @param nthreads Number of threads. 0 means one for each processor.*/
+  DLL_PUBLIC void RadixSortPermutation(std::vector<uint64_t>& keys, std::vector<int64_t>& perm, int key_bits=64, int nthreads=0);
+
+  /** Reorder particles by a permutation from RadixSortPermutation: particle i of out is particle perm[i] of in.
+   * Each thread fills its own contiguous part of out, prefetching the particles it will read next.
+   * @param partlen Bytes per particle
+   * @param nthreads Number of threads. 0 means one for each processor.*/
+  DLL_PUBLIC void ApplyPermutation(const char * in, char * out, int partlen, const std::vector<int64_t>& perm, int nthreads=0);
+
+  /** Load the IDs and some other blocks of the types in type_mask, and put them all in order of ID.
+   * 32-bit IDs are treated as unsigned. Sorting the IDs takes 32 bytes for each particle, as for RadixSortPermutation.
+   * Each block is then loaded and permuted in turn, so at most two copies of one block are in memory beyond the result.
+   * @param BlockNames Blocks to load. Each must have every type in type_mask that "ID  " has.
+   * @param type_mask Bitfield of the types to sort together: bit n set includes type n.
+   * @param result Filled with the sorted IDs, the original order and the blocks.
+   * @param nthreads Number of threads. 0 means one for each processor.
+   * @param debug Whether runtime warnings are printed.
+   * @return 0 on success, 1 if there are no IDs, a block does not match them or a read failed.*/
+  DLL_PUBLIC int SortByID(GSnap& snap, const std::vector<std::string>& BlockNames, int type_mask, sorted_blocks& result, int nthreads=0, bool debug=true);
+
+  /** Out of core version of SortByID, for blocks larger than memory.
+   * Only the IDs and the permutation are held in memory: 32 bytes for each particle while sorting them, and 8 while permuting.
+   * Each block is written, in order of ID, to prefix + "." + the block name without trailing spaces, as raw particles
+   * in native byte order, like one entry of sorted_blocks::blocks. Blocks larger than max_bytes are permuted in two passes
+   * of sequential I/O: each particle is first appended to a temporary bucket file for the part of the output it belongs in,
+   * then each bucket is loaded and its particles put in place. At most 256 bucket files are open at once;
+   * a block needing more is read once for each 256 buckets.
+   * @param max_bytes Memory to use for each bucket.
+   * @param debug Whether runtime warnings are printed.
+   * @return 0 on success, 1 on failure.*/
+  DLL_PUBLIC int SortByIDToFiles(GSnap& snap, const std::vector<std::string>& BlockNames, int type_mask, const std::string& prefix, int64_t max_bytes=1<<30, int nthreads=0, bool debug=true);
+}
+
+#endif //__GADGETSORT_H
@@ -7,10 +7,15 @@
 #include "bigfile.h"
 #endif
 #include <iostream>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
 #include <valarray>
 #include <string>
 #include <stdint.h>
 #include "gadgetwritebigfile.hpp"
+#include "gadgetwritequeue.hpp"
 
 #ifdef BIGFILE_MPI
 #define BIG_FILE_CREATE(bf, filename) big_file_mpi_create(bf, filename, MPI_COMM_WORLD)
@@ -41,8 +46,8 @@ int big_file_create_block_wrapper(BigFile * bf, BigBlock * block, const char * b
 
 namespace GadgetWriter {
 
-  GWriteBigSnap::GWriteBigSnap(const std::string snap_filename, std::valarray<int64_t> npart_in,int num_files, bool debug) :
-      GWriteBaseSnap(4, npart_in, num_files, debug)
+  GWriteBigSnap::GWriteBigSnap(const std::string snap_filename, std::valarray<int64_t> npart_in,int num_files, bool debug, int nthreads) :
+      GWriteBaseSnap(4, npart_in, num_files, debug), nthreads(nthreads)
   {
           //Create file
           bf = {0};
@@ -55,12 +60,32 @@ namespace GadgetWriter {
 
   GWriteBigSnap::~GWriteBigSnap()
   {
+      StopAsync();
+      std::map<std::string, open_block>::iterator it;
+      for(it = blocks.begin(); it != blocks.end(); ++it){
+          /*Attributes are saved when the block is closed*/
+          if(checksums) {
+              BigBlock& block = it->second.block;
+              uint32_t crc;
+              if(!it->second.sums.get((uint64_t) block.size * block.nmemb * dtype_itemsize(block.dtype), crc)) {
+                  if(debug)
+                      std::cerr<<"[GadgetWriter]: Block "<<it->first<<" was not written completely: no checksum"<<std::endl;
+              }
+              else if(0 != big_block_set_attr(&block, "CRC32C", &crc, "u4", 1) && debug)
+                  std::cerr<<"[GadgetWriter]: Failed writing checksum of "<<it->first<<":"<<big_file_get_error_message()<<std::endl;
+          }
+          if(0 != BIG_BLOCK_CLOSE(&it->second.block) && debug)
+              std::cerr<<"[GadgetWriter]: Failed closing block "<<it->first<<":"<<big_file_get_error_message()<<std::endl;
+      }
       BIG_FILE_CLOSE(&bf);
   }
 
   int GWriteBigSnap::WriteHeaders(gadget_header header)
   {
+      if(Flush())
+          return 1;
       BigBlock bheader = {};
+      std::lock_guard<std::mutex> lock(blocks_lock);
       int ret = BIG_FILE_CREATE_BLOCK(&bf, &bheader, "Header", NULL, 0, 0, 0);
       if (ret != 0)
           return ret;
@@ -89,9 +114,51 @@ namespace GadgetWriter {
       return 0;
   }
 
-  int64_t GWriteBigSnap::WriteBlocks(const std::string& BlockName, int type, void *data, uint64_t np_write, uint64_t begin, const char * dtype, int items_per_particle)
+  GWriteBigSnap::open_block& GWriteBigSnap::get_block(const std::string& FullString, const char * dtype, int items_per_particle, int type)
+  {
+      std::lock_guard<std::mutex> lock(blocks_lock);
+      std::map<std::string, open_block>::iterator it = blocks.find(FullString);
+      if(it != blocks.end())
+          return it->second;
+      open_block& ob = blocks[FullString];
+      ob.block = BigBlock();
+      /*Try to open the block*/
+      int opened = BIG_FILE_OPEN_BLOCK(&bf, &ob.block, FullString.c_str());
+      /* If we couldn't open it, try to create it. Note that the last argument, size of the array, is not dims[0],
+       * as the array could be split over different processors.*/
+      if(opened < 0 && BIG_FILE_CREATE_BLOCK(&bf, &ob.block, FullString.c_str(), dtype, items_per_particle, num_files, npart[type]) != 0) {
+              blocks.erase(FullString);
+              throw std::ios_base::failure("Unable to create block: "+FullString+ ":" + big_file_get_error_message());
+      }
+      /*Force a seek on the first write*/
+      ob.next_begin = UINT64_MAX;
+      return ob;
+  }
+
+  int64_t GWriteBigSnap::WriteBlocks(const std::string& BlockName, int type, void *data, uint64_t np_write, uint64_t begin, const char * dtype, int items_per_particle, void (*release)(void *))
+  {
+      if(queue) {
+          std::string name(BlockName), type_str(dtype);
+          return queue->push([this, name, type, np_write, begin, type_str, items_per_particle](void * buf) {
+                      return write_blocks(name, type, buf, np_write, begin, type_str.c_str(), items_per_particle);
+                  }, data, np_write * items_per_particle * dtype_itemsize(dtype), np_write, release);
+      }
+      int64_t ret;
+      try {
+          ret = write_blocks(BlockName, type, data, np_write, begin, dtype, items_per_particle);
+      }
+      catch(...) {
+          if(release)
+              release(data);
+          throw;
+      }
+      if(release)
+          release(data);
+      return ret;
+  }
+
+  int64_t GWriteBigSnap::write_blocks(const std::string& BlockName, int type, void *data, uint64_t np_write, uint64_t begin, const char * dtype, int items_per_particle)
   {
-      BigBlock block = {};
       BigArray array = {0};
       BigBlockPtr ptr = {0};
       size_t dims[2];
@@ -103,25 +170,89 @@ namespace GadgetWriter {
       strides[0] = items_per_particle * strides[1];
       /*Initialise the BigArray with this data.*/
       big_array_init(&array, data, dtype, 2, dims, strides);
-    
+
       std::string FullString(std::to_string(type)+"/"+BlockName);
-      /*Try to open the block*/
-      int opened = BIG_FILE_OPEN_BLOCK(&bf, &block, FullString.c_str());
-     
-      /* If we couldn't open it, try to create it. Note that the last argument, size of the array, is not dims[0], 
-       * as the array could be split over different processors.*/
-      if(opened < 0 && BIG_FILE_CREATE_BLOCK(&bf, &block, FullString.c_str(), dtype, items_per_particle, num_files, npart[type]) != 0) {
-              throw std::ios_base::failure("Unable to create block: "+FullString+ ":" + big_file_get_error_message());
+      open_block& ob = get_block(FullString, dtype, items_per_particle, type);
+      /*Checksum before taking the block lock, so writes to one block from several threads are checksummed at once*/
+      if(checksums)
+          ob.sums.add(begin * strides[0], data, np_write * strides[0]);
+      std::lock_guard<std::mutex> lock(ob.lock);
+#ifndef BIGFILE_MPI
+      /*Find the files this write touches. If there are several, write them at once.*/
+      if(nthreads > 1) {
+          std::vector<int> shards;
+          for(int f = 0; f < ob.block.Nfile; f++)
+              if(ob.block.foffset[f] < begin + np_write && ob.block.foffset[f+1] > begin)
+                  shards.push_back(f);
+          if(shards.size() > 1) {
+              write_shards(ob, FullString, shards, data, np_write, begin, dtype, items_per_particle);
+              return np_write;
+          }
       }
-      if(0 != big_block_seek(&block, &ptr, begin)) {
+#endif
+      /*Appending to the last write: the pointer is already in the right place*/
+      if(begin == ob.next_begin)
+          ptr = ob.next;
+      else if(0 != big_block_seek(&ob.block, &ptr, begin)) {
           throw std::ios_base::failure("Failed seeking in " + FullString + " to " + std::to_string(begin) + ":" + big_file_get_error_message());
       }
-      if(0 != big_block_write(&block, &ptr, &array)) {
+      /*Work out where this write ends before writing, so it does not matter whether big_block_write moves ptr*/
+      BigBlockPtr next = ptr;
+      if(0 != big_block_write(&ob.block, &ptr, &array)) {
           throw std::ios_base::failure("Failed writing " + FullString + ":" + big_file_get_error_message());
       }
-      BIG_BLOCK_CLOSE(&block);
+      if(0 == big_block_seek_rel(&ob.block, &next, np_write)) {
+          ob.next = next;
+          ob.next_begin = begin + np_write;
+      }
+      else
+          ob.next_begin = UINT64_MAX;
       return np_write;
   }
+
+  void GWriteBigSnap::write_shards(open_block& ob, const std::string& FullString, const std::vector<int>& shards, void *data, uint64_t np_write, uint64_t begin, const char * dtype, int items_per_particle)
+  {
+      const ptrdiff_t itemsize = dtype_itemsize(dtype);
+      const uint64_t end = begin + np_write;
+      std::atomic<size_t> next_shard(0);
+      /*big_file_get_error_message returns a buffer shared by the whole process, which a failing call in another thread may replace.
+       * So workers only note which files failed, and the message is read once they have all finished.*/
+      std::mutex error_lock;
+      std::vector<int> failed;
+      /*Each file of a block has its own checksum and file handle, so different files can be written at once*/
+      auto write_some = [&]{
+          size_t i;
+          while((i = next_shard++) < shards.size()) {
+              const int f = shards[i];
+              const uint64_t first = std::max<uint64_t>(begin, ob.block.foffset[f]);
+              const uint64_t last = std::min<uint64_t>(end, ob.block.foffset[f+1]);
+              BigArray array = {0};
+              BigBlockPtr ptr = {0};
+              size_t dims[2] = {last - first, (size_t) items_per_particle};
+              ptrdiff_t strides[2] = {items_per_particle * itemsize, itemsize};
+              big_array_init(&array, ((char *) data) + (first - begin) * strides[0], dtype, 2, dims, strides);
+              if(0 != big_block_seek(&ob.block, &ptr, first) || 0 != big_block_write(&ob.block, &ptr, &array)) {
+                  std::lock_guard<std::mutex> lock(error_lock);
+                  failed.push_back(f);
+              }
+          }
+      };
+      std::vector<std::thread> threads;
+      for(int t = 1; t < std::min<int>(nthreads, shards.size()); t++)
+          threads.push_back(std::thread(write_some));
+      write_some();
+      for(size_t t = 0; t < threads.size(); t++)
+          threads[t].join();
+      if(!failed.empty()) {
+          std::sort(failed.begin(), failed.end());
+          std::string files;
+          for(size_t i = 0; i < failed.size(); i++)
+              files += (i ? "," : "") + std::to_string(failed[i]);
+          throw std::ios_base::failure("Failed writing " + FullString + " file " + files + ":" + big_file_get_error_message());
+      }
+      /*The next sequential write will need to seek*/
+      ob.next_begin = UINT64_MAX;
+  }
 }
 
 #endif
@@ -4,23 +4,59 @@
 
 #include <valarray>
 #include <string>
+#include <map>
+#include <vector>
+#include <mutex>
 #include <stdint.h>
 #include "gadgetwriter.hpp"
 #include "gadgetheader.h"
 #include "bigfile.h"
 
 namespace GadgetWriter {
-  /** Main class for reading Gadget BigFile snapshots. */
+  /** Main class for writing Gadget BigFile snapshots.
+   * WriteBlocks may be called from several threads at once. Writes to different blocks
+   * (or types) proceed in parallel; writes to the same block take turns, as they share its checksums.
+   * With SetChecksums, each block also gets a CRC32C attribute covering all its files.
+   * With BIGFILE_MPI each rank sees only its own writes, so no such attribute is saved.*/
   class DLL_PUBLIC GWriteBigSnap : public GWriteBaseSnap{
           public:
-                  /** Base constructor. If you want an HDF5 snapshot, pass a filename ending in .hdf5 */
-                  GWriteBigSnap(const std::string snap_filename, std::valarray<int64_t> npart_in,int num_files=1, bool debug=true);
-                  int64_t WriteBlocks(const std::string& BlockName, int type, void *data, uint64_t np_write, uint64_t begin, const char * dtype, int items_per_particle);
+                  /** Base constructor. If you want an HDF5 snapshot, pass a filename ending in .hdf5
+                   * @param num_files Number of files each block is split into.
+                   * @param nthreads Without BIGFILE_MPI, a write which spans several files
+                   * is split between up to this many threads, one file each. Ignored with BIGFILE_MPI.*/
+                  GWriteBigSnap(const std::string snap_filename, std::valarray<int64_t> npart_in,int num_files=1, bool debug=true, int nthreads=1);
+                  /** Write np_write particles of type, starting at particle begin of that type.
+                   * @param release If not NULL, the writer takes ownership of data, and calls release(data) once written.
+                   * Throws std::ios_base::failure on error; in asynchronous mode the exception comes from Flush.*/
+                  int64_t WriteBlocks(const std::string& BlockName, int type, void *data, uint64_t np_write, uint64_t begin, const char * dtype, int items_per_particle, void (*release)(void *)=NULL);
                   //Note the value of npart used is that from npart_in, not the header.
                   int WriteHeaders(gadget_header head);
+                  /** Closes all the blocks opened by WriteBlocks, then the file.*/
                   ~GWriteBigSnap();
           private:
                   BigFile bf;
+                  int nthreads;
+                  /** A block kept open between calls to WriteBlocks, so that a block written
+                   * in many slices is only opened and closed once.*/
+                  struct open_block {
+                          BigBlock block;
+                          /** Where the last write finished, so a sequential append need not seek*/
+                          BigBlockPtr next;
+                          uint64_t next_begin;
+                          /** Held while writing to this block*/
+                          std::mutex lock;
+                          /** Checksum of the data written, if checksums are on*/
+                          crc32c_pieces sums;
+                  };
+                  /** Open blocks, by "type/BlockName"*/
+                  std::map<std::string, open_block> blocks;
+                  /** Guards blocks, and opening or creating a block*/
+                  std::mutex blocks_lock;
+                  /** Get an open block, opening or creating it if needed. Thread-safe.*/
+                  open_block& get_block(const std::string& FullString, const char * dtype, int items_per_particle, int type);
+                  int64_t write_blocks(const std::string& BlockName, int type, void *data, uint64_t np_write, uint64_t begin, const char * dtype, int items_per_particle);
+                  /** Write the parts of a WriteBlocks call falling in each of the given files in parallel*/
+                  void write_shards(open_block& ob, const std::string& FullString, const std::vector<int>& shards, void *data, uint64_t np_write, uint64_t begin, const char * dtype, int items_per_particle);
   };
 
 }
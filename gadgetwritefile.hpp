@@ -5,6 +5,8 @@
 #include "gadgetwriter.hpp"
 
 #include <stdio.h>
+#include <unistd.h>
+#include <mutex>
 /*Error output macros*/
 #define ERROR(...) do{ fprintf(stderr,__VA_ARGS__);exit(1);}while(0)
 #define WARN(...) do{ \
@@ -14,7 +16,9 @@
         }}while(0)
 
 namespace GadgetWriter{
-/** Specialise to the old style binary gadget output*/
+/** Specialise to the old style binary gadget output.
+ * Writes are positional (pwrite), so WriteBlock may be called from several threads at once,
+ * as long as they write different (block, type, particle range) targets.*/
   class DLL_LOCAL GWriteFile: public GBaseWriteFile {
          public:
                 GWriteFile(std::string filename, std::valarray<uint32_t> npart_in, std::vector<block_info>* BlockNames, bool format_2, bool debug);
@@ -22,31 +26,43 @@ namespace GadgetWriter{
                 int64_t WriteBlock(std::string BlockName, int type, void *data, int partlen, uint32_t np_write, uint32_t begin);
                 /** Note npart is silently ignored.*/
                 int WriteHeader(gadget_header& head);
-                ~GWriteFile()
-                {
-                        if(fd)
-                           fclose(fd);
-                }
+                /** Closes the file, and writes the checksum sidecar if checksums are on*/
+                ~GWriteFile();
          private:
                 bool format_2;
                 bool debug;
                 int header_size,footer_size;
-                FILE * fd;
+                int fd;
+                /** Guards the lazy open of fd*/
+                std::mutex open_lock;
+                /** Open the file if it is not already open.
+                 * @return 1 if error, 0 if fine.*/
+                int open_file();
+                /** Write all of len bytes at offset, retrying short writes.
+                 * @return bytes written.*/
+                int64_t write_at(const void * buf, int64_t len, int64_t offset);
                 //Go from Key = <BlockName> Value = <Type, start>
                 std::map<std::string,std::map<int, int64_t> > blocks;
+                /** Bytes per particle of each block*/
+                std::map<std::string, short> partlens;
                 /** Private function to populate the above */
                 void construct_blocks(std::vector<block_info> * BlockNames);
                 /** Private function to calculate the size of a block*/
                 uint32_t calc_block_size(std::string name);
                 /**Function to write the block header
                  * @return 1 if error, 0 if fine.*/
-                int write_block_header(FILE * fd, std::string name, uint32_t blocksize);
-                /**Function to write the block header; all else as write_block_header() */
-                int write_block_footer(FILE * fd, std::string name, uint32_t blocksize);
+                int write_block_header(int64_t offset, std::string name, uint32_t blocksize);
+                /**Function to write the block footer; all else as write_block_header() */
+                int write_block_footer(int64_t offset, std::string name, uint32_t blocksize);
+                /** Write the checksums of complete blocks to <filename>.crc32c, one line per block:
+                 * checksum in hex, bytes, block name.
+                 * @return 1 if error, 0 if fine.*/
+                int write_checksums();
   };
 
 #ifdef HAVE_HDF5
-    /*Specialise to HDF5*/
+    /*Specialise to HDF5. The HDF5 library is not thread-safe, so calls into it
+     * from all files are serialised by a single lock.*/
   class DLL_LOCAL GWriteHDFFile: public GBaseWriteFile{
          public:
                 GWriteHDFFile(std::string filename, std::valarray<uint32_t> npart_in, std::vector<block_info>* BlockNames, bool format_2, bool debug);
@@ -54,14 +70,20 @@ namespace GadgetWriter{
                 int64_t WriteBlock(std::string BlockName, int type, void *data, int partlen, uint32_t np_write, uint32_t begin);
                 /** Note npart is silently ignored.*/
                 int WriteHeader(gadget_header& head);
-                ~GWriteHDFFile(){};
+                /** Saves the checksums of complete datasets as attributes, if checksums are on*/
+                ~GWriteHDFFile();
          private:
                 bool debug;
                 //For storing group names: PartType0, etc.
                 char g_name[N_TYPE][20];
-                /** Private function to find block datatype (int64 or float)*/
-                std::set<std::string> m_ints;
-                char get_block_type(std::string BlockName);
+                /** Element type and elements per particle of each block*/
+                std::map<std::string, std::pair<char, short> > m_types;
+                /** Size in bytes of each dataset written, by path, for the checksums*/
+                std::map<std::string, uint64_t> m_bytes;
+                /** Private function to find the HDF5 type of a block's elements.
+                 * Sets ncomp to the number of elements per particle. Returns a negative value if unknown.
+                 * Call with the HDF5 lock held.*/
+                int64_t get_block_type(const std::string& BlockName, int partlen, int& ncomp);
   };
 
 #endif
@@ -7,8 +7,12 @@
 #include <hdf5_hl.h>
 #include <iostream>
 #include <sstream>
+#include <mutex>
 
 namespace GadgetWriter{
+  /*Serialises calls into the HDF5 library, which is not thread-safe*/
+  static std::mutex hdf5_lock;
+
   GWriteHDFFile::GWriteHDFFile(std::string filename, std::valarray<uint32_t> npart_in, std::vector<block_info>* BlockNames, bool format_2, bool debug) : GBaseWriteFile(filename, npart_in), debug(debug)
   {
           //Create file
@@ -25,24 +29,53 @@ namespace GadgetWriter{
                 if (group < 0)
                     throw  std::ios_base::failure(std::string("Unable to create group: ")+std::string(g_name[i]));
           }
-          //Create metadata about datablocks: we only actually use partlen.
+          //Create metadata about datablocks: element types, so each is written in its own precision.
           std::vector<block_info>::iterator it;
-          for(it=(*BlockNames).begin(); it<(*BlockNames).end(); ++it){
-              //Detect an integer type
-              if ((*it).partlen == sizeof(int64_t))
-                  m_ints.insert((*it).name);
-          }
+          for(it=(*BlockNames).begin(); it<(*BlockNames).end(); ++it)
+              m_types[(*it).name] = std::make_pair((*it).dtype, (*it).ncomp);
           return;
 
   }
 
-  char GWriteHDFFile::get_block_type(std::string BlockName)
+  GWriteHDFFile::~GWriteHDFFile()
   {
-      if (m_ints.count(BlockName) != 0)
-          return 'i';
-      else
-          return 'f';
+          if(!checksums)
+              return;
+          std::lock_guard<std::mutex> lock(hdf5_lock);
+          hid_t handle = H5Fopen(filename.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
+          if (handle < 0) {
+              WARN("Could not open %s to write checksums\n",filename.c_str());
+              return;
+          }
+          std::map<std::string, uint64_t>::iterator it;
+          for(it = m_bytes.begin(); it != m_bytes.end(); ++it){
+              unsigned int crc;
+              if(!sums[it->first].get(it->second, crc)){
+                  WARN("Dataset %s in file %s was not written completely: no checksum\n",it->first.c_str(), filename.c_str());
+                  continue;
+              }
+              if(H5LTset_attribute_uint(handle, it->first.c_str(), "CRC32C", &crc, 1) < 0)
+                  WARN("Could not write checksum of %s in file %s\n",it->first.c_str(), filename.c_str());
+          }
+          H5Fclose(handle);
+  }
 
+  int64_t GWriteHDFFile::get_block_type(const std::string& BlockName, int partlen, int& ncomp)
+  {
+      std::map<std::string, std::pair<char, short> >::iterator it = m_types.find(BlockName);
+      if (it == m_types.end() || it->second.second <= 0 || partlen % it->second.second)
+          return -1;
+      ncomp = it->second.second;
+      const int size = partlen / ncomp;
+      if(it->second.first == 'f' && size == sizeof(float))
+          return H5T_NATIVE_FLOAT;
+      if(it->second.first == 'f' && size == sizeof(double))
+          return H5T_NATIVE_DOUBLE;
+      if(it->second.first == 'i' && size == sizeof(int32_t))
+          return H5T_NATIVE_INT32;
+      if(it->second.first == 'i' && size == sizeof(int64_t))
+          return H5T_NATIVE_INT64;
+      return -1;
   }
 
   int GWriteHDFFile::WriteHeader(gadget_header& header)
@@ -51,6 +84,7 @@ namespace GadgetWriter{
             for(int i=0; i<N_TYPE; i++){
                 header.npart[i]=npart[i];
             }
+            std::lock_guard<std::mutex> lock(hdf5_lock);
             hid_t handle = H5Fopen(filename.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
             if (handle < 0)
                 return -1*handle;
@@ -99,26 +133,24 @@ namespace GadgetWriter{
   int64_t GWriteHDFFile::WriteBlock(std::string BlockName, int type, void *data, int partlen, uint32_t np_write, uint32_t begin)
   {
             herr_t herr;
-            hid_t handle = H5Fopen(filename.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
-            hid_t group = H5Gopen2(handle, g_name[type], H5P_DEFAULT);
-            if(group < 0)
-                return group;
             hsize_t size[2];
             int rank=1;
+            //Checksum before taking the lock, so files can be checksummed in parallel
+            if(checksums)
+                add_checksum(std::string(g_name[type])+"/"+BlockName, (uint64_t) begin*partlen, data, (uint64_t) np_write*partlen);
+            std::lock_guard<std::mutex> lock(hdf5_lock);
             //Get type
-            char b_type = get_block_type(BlockName);
-            hid_t dtype;
-            if(b_type == 'f') {
-                size[1] = partlen/sizeof(float);
-                dtype=H5T_NATIVE_FLOAT;
-            }else if (b_type == 'i') {
-                size[1] = partlen/sizeof(int64_t);
-                //Hopefully this is 64 bits; the HDF5 manual is not clear.
-                dtype = H5T_NATIVE_LLONG;
-            }
-            else{
+            int ncomp;
+            hid_t dtype = get_block_type(BlockName, partlen, ncomp);
+            if(dtype < 0){
+                WARN("Unknown element type for block %s\n",BlockName.c_str());
                 return -1000;
             }
+            size[1] = ncomp;
+            hid_t handle = H5Fopen(filename.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
+            hid_t group = H5Gopen2(handle, g_name[type], H5P_DEFAULT);
+            if(group < 0)
+                return group;
             if (size[1] > 1) {
                     rank = 2;
             }
@@ -131,9 +163,12 @@ namespace GadgetWriter{
             //Make space in memory for the whole array
             //Create a hyperslab that we will write to
             size[0] = npart[type];
+            if(checksums)
+                m_bytes[std::string(g_name[type])+"/"+BlockName] = (uint64_t) npart[type]*partlen;
             hid_t full_space_id = H5Screate_simple(rank, size, NULL);
-            //If this is the first write, create the dataset
-            if (begin==0) {
+            //If this is the first write, create the dataset.
+            //Writes may come in any order when several threads are writing.
+            if (H5Lexists(group, BlockName.c_str(), H5P_DEFAULT) <= 0) {
                 H5Dcreate2(group,BlockName.c_str(),dtype, full_space_id, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
             }
             hid_t dset = H5Dopen2(group,BlockName.c_str(),H5P_DEFAULT);
@@ -1,6 +1,9 @@
 /* Class specialising to the gadget binary format*/
 #include "gadgetwritefile.hpp"
 #include <cassert>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
 
 namespace GadgetWriter{
   GWriteFile::GWriteFile(std::string filename, std::valarray<uint32_t> npart_in, std::vector<block_info>* BlockNames, bool format_2,bool debug) : GBaseWriteFile(filename, npart_in), format_2(format_2), debug(debug)
@@ -10,24 +13,54 @@ namespace GadgetWriter{
                   header_size+=3*sizeof(int32_t)+4*sizeof(char);
           footer_size=sizeof(int32_t);
           construct_blocks(BlockNames);
-          fd=NULL;
+          fd=-1;
           return;
   }
+
+  GWriteFile::~GWriteFile()
+  {
+          if(checksums)
+                  write_checksums();
+          if(fd >= 0)
+                  close(fd);
+  }
+
+  int GWriteFile::open_file()
+  {
+        std::lock_guard<std::mutex> lock(open_lock);
+        if(fd < 0 && (fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0){
+               WARN("Can't open '%s' for writing: %s\n", filename.c_str(), strerror(errno));
+               return 1;
+        }
+        return 0;
+  }
+
+  int64_t GWriteFile::write_at(const void * buf, int64_t len, int64_t offset)
+  {
+        int64_t done = 0;
+        while(done < len){
+                ssize_t ret = pwrite(fd, (const char *) buf + done, len - done, offset + done);
+                if(ret < 0 && errno == EINTR)
+                        continue;
+                if(ret <= 0)
+                        break;
+                done += ret;
+        }
+        return done;
+  }
   
   int GWriteFile::WriteHeader(gadget_header& head)
   {
         for(int i=0; i<N_TYPE; i++){
                 head.npart[i]=npart[i];
         }
-        if(!fd && !(fd = fopen(filename.c_str(), "w"))){
-               WARN("Can't open '%s' for writing!\n", filename.c_str());
+        if(open_file())
                return 1;
-        }
         assert(sizeof(head) == 256);
-        fseek(fd,0,SEEK_SET); //Header always at start of file
-        if(write_block_header(fd, "HEAD", sizeof(head)) || 
-                fwrite(&head, sizeof(head), 1, fd)!=1 ||
-                write_block_footer(fd, "HEAD", sizeof(head)) ){
+        //Header always at start of file
+        if(write_block_header(0, "HEAD", sizeof(head)) ||
+                write_at(&head, sizeof(head), header_size) != sizeof(head) ||
+                write_block_footer(header_size+sizeof(head), "HEAD", sizeof(head)) ){
                 WARN("Could not write header for %s\n",filename.c_str());
                 return 1;
         }
@@ -41,10 +74,8 @@ namespace GadgetWriter{
                   WARN("Block %s, file %s. Truncated to %d particles\n",BlockName.c_str(), filename.c_str(),npart[type]);
                   np_write=npart[type]-begin;
           }
-          if(!fd && !(fd = fopen(filename.c_str(),"w"))){
-                 WARN("Can't open '%s' for writing!\n", filename.c_str());
+          if(open_file())
                  return 0;
-          }
           std::map<std::string, std::map<int,int64_t> >::iterator ip=blocks.find(BlockName);
           if(ip == blocks.end()) {
                   WARN("Block %s not found\n",BlockName.c_str());
@@ -63,34 +94,28 @@ namespace GadgetWriter{
                 WARN("Type %d not found in block %s\n",type,BlockName.c_str());
                 return 0;
           }
+          //Start of the data for this type: the first type also has the block header
+          int64_t type_start = (*it).second;
+          if(type==MinType)
+                  type_start+=header_size;
           //If we are writing from the beginning, write the block header
           if(begin == 0 && type == MinType){
-                if(fseek(fd, (*it).second,SEEK_SET)) {
-                    WARN("Could not seek to %lu in file %s\n",(*it).second, filename.c_str());
-                    return 0;
-                }
-                if(write_block_header(fd, BlockName, partlen*calc_block_size(BlockName))){
+                if(write_block_header((*it).second, BlockName, partlen*calc_block_size(BlockName))){
                         WARN("Could not write block header %s in file %s\n",BlockName.c_str(), filename.c_str());
                         return 0;
                 }
           }
-          else {
-                int64_t init_fpos = (*it).second+begin*partlen;
-                if(type==MinType)
-                        init_fpos+=header_size;
-                if(fseek(fd,init_fpos, SEEK_SET) < 0) {
-                    WARN("Could not seek to correct location\n");
-                    return 0;
-                }
-          }
-          int64_t ret=fwrite(data, partlen, np_write, fd);
+          int64_t ret=write_at(data, (int64_t) partlen*np_write, type_start+(int64_t) begin*partlen)/partlen;
+          //Offsets for the checksum are from the start of the block's data
+          if(checksums)
+                  add_checksum(BlockName, type_start+(int64_t) begin*partlen-(ip->second.begin()->second+header_size), data, (int64_t) partlen*ret);
           if(ret != np_write){
                   WARN("Wrote only %ld particles of %d\n",ret,np_write);
                   return ret;
           }
-          //If this is the last write to this segment, write the footer and close the file
+          //If this is the last write to this segment, write the footer
           if(type == MaxType && (np_write+begin == npart[type])){
-                  if(write_block_footer(fd, BlockName, partlen*calc_block_size(BlockName))){
+                  if(write_block_footer(type_start+(int64_t) partlen*npart[type], BlockName, partlen*calc_block_size(BlockName))){
                         WARN("Could not write block footer %s in file %s\n",BlockName.c_str(), filename.c_str());
                         return np_write+1;
                   }
@@ -124,6 +149,7 @@ namespace GadgetWriter{
                                   }
                           }
                           blocks[block.name]=p;
+                          partlens[block.name]=block.partlen;
                           /*Only add a footer if we have also added a header*/
                           if(!first)
                                 cur_pos+=footer_size;
@@ -147,29 +173,59 @@ namespace GadgetWriter{
           return total;
   }
 
-  int GWriteFile::write_block_header(FILE * fd, std::string name, uint32_t blocksize)
+  int GWriteFile::write_checksums()
+  {
+        FILE * sidecar = NULL;
+        std::map<std::string,std::map<int, int64_t> >::iterator it;
+        for(it=blocks.begin(); it != blocks.end(); ++it){
+                const uint64_t bytes = (uint64_t) partlens[it->first]*calc_block_size(it->first);
+                uint32_t crc;
+                if(!bytes)
+                        continue;
+                if(!sums[it->first].get(bytes, crc)){
+                        WARN("Block %s in file %s was not written completely: no checksum\n",it->first.c_str(), filename.c_str());
+                        continue;
+                }
+                if(!sidecar && !(sidecar = fopen((filename+".crc32c").c_str(), "w"))){
+                        WARN("Can't open '%s.crc32c' for writing\n",filename.c_str());
+                        return 1;
+                }
+                fprintf(sidecar, "%08x %lu %s\n", crc, bytes, it->first.c_str());
+        }
+        if(sidecar && fclose(sidecar)){
+                WARN("Could not write '%s.crc32c'\n",filename.c_str());
+                return 1;
+        }
+        return 0;
+  }
+
+  int GWriteFile::write_block_header(int64_t offset, std::string name, uint32_t blocksize)
   {
+      char buf[5*sizeof(int32_t)];
+      int len=0;
       if(format_2){
         /*This is the block header record, which we want for format two files*/
         int32_t blkheadsize = sizeof(int32_t) + 4 * sizeof(char);
         uint32_t nextblock = blocksize + 2 * sizeof(uint32_t);
-        /*Write format 2 header header*/
-        if ( fwrite(&blkheadsize,sizeof(int32_t),1,fd) != 1 ||
-             fwrite(name.c_str(), sizeof(char), 4, fd) != 4 ||
-             fwrite(&nextblock, sizeof(uint32_t), 1, fd) != 1 || 
-             fwrite(&blkheadsize,sizeof(int32_t),1,fd) !=1)
-                return 1;
+        /*Format 2 header header*/
+        memcpy(buf, &blkheadsize, sizeof(int32_t));
+        memcpy(buf+4, name.c_str(), 4);
+        memcpy(buf+8, &nextblock, sizeof(uint32_t));
+        memcpy(buf+12, &blkheadsize, sizeof(int32_t));
+        len=16;
       }
       /*This is the record size, which we want for all files*/
-      if(fwrite(&blocksize, sizeof(int32_t), 1, fd) !=1)
+      memcpy(buf+len, &blocksize, sizeof(int32_t));
+      len+=sizeof(int32_t);
+      if(write_at(buf, len, offset) != len)
               return 1;
       return 0;
   }
 
-  int GWriteFile::write_block_footer(FILE * fd, std::string name, uint32_t blocksize)
+  int GWriteFile::write_block_footer(int64_t offset, std::string name, uint32_t blocksize)
   {
         /*This is the record size, which we want for all files*/
-        if(fwrite(&blocksize, sizeof(uint32_t), 1, fd) !=1)
+        if(write_at(&blocksize, sizeof(uint32_t), offset) != sizeof(uint32_t))
                 return 1;
         return 0;
   }
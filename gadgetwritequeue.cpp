@@ -0,0 +1,116 @@
+/* Background write queue, for asynchronous snapshot output*/
+#include "gadgetwritequeue.hpp"
+#include <string.h>
+
+namespace GadgetWriter{
+
+  /*How many staging buffers to keep for reuse*/
+  #define MAX_POOL 8
+
+  GWriteQueue::GWriteQueue(size_t max_bytes): max_bytes(max_bytes), pending_bytes(0), stopping(false), busy(false), failed(0)
+  {
+          worker = std::thread(&GWriteQueue::run, this);
+  }
+
+  GWriteQueue::~GWriteQueue()
+  {
+          {
+                  std::lock_guard<std::mutex> guard(lock);
+                  stopping = true;
+                  changed.notify_all();
+          }
+          //The worker drains the queue before it exits
+          worker.join();
+  }
+
+  int64_t GWriteQueue::push(write_func write, void * data, size_t bytes, int64_t np, void (*release)(void *))
+  {
+          std::unique_lock<std::mutex> guard(lock);
+          if(failed){
+                  if(release)
+                          release(data);
+                  return 0;
+          }
+          //Wait for space, unless nothing is pending: a single write larger than the cap still has to go
+          changed.wait(guard, [&]{ return pending_bytes == 0 || pending_bytes + bytes <= max_bytes; });
+          pending_bytes += bytes;
+          write_job job;
+          job.write = write;
+          job.data = data;
+          job.bytes = bytes;
+          job.np = np;
+          job.release = release;
+          if(!release){
+                  //Find the smallest staging buffer which is big enough, or failing that the biggest one
+                  std::vector<std::vector<char> >::iterator it, best=pool.end();
+                  for(it = pool.begin(); it != pool.end(); ++it){
+                          if(best == pool.end()){
+                                  best = it;
+                                  continue;
+                          }
+                          const bool fits = it->capacity() >= bytes, best_fits = best->capacity() >= bytes;
+                          if(fits ? (!best_fits || it->capacity() < best->capacity()) : (!best_fits && it->capacity() > best->capacity()))
+                                  best = it;
+                  }
+                  if(best != pool.end()){
+                          job.staging.swap(*best);
+                          pool.erase(best);
+                  }
+                  guard.unlock();
+                  job.staging.resize(bytes);
+                  memcpy(&job.staging[0], data, bytes);
+                  guard.lock();
+          }
+          jobs.push_back(std::move(job));
+          changed.notify_all();
+          return np;
+  }
+
+  int GWriteQueue::wait()
+  {
+          std::unique_lock<std::mutex> guard(lock);
+          changed.wait(guard, [this]{ return jobs.empty() && !busy; });
+          int ret = failed;
+          failed = 0;
+          if(exception){
+                  std::exception_ptr e = exception;
+                  exception = std::exception_ptr();
+                  std::rethrow_exception(e);
+          }
+          return ret;
+  }
+
+  void GWriteQueue::run()
+  {
+          std::unique_lock<std::mutex> guard(lock);
+          while(true){
+                  changed.wait(guard, [this]{ return stopping || !jobs.empty(); });
+                  if(jobs.empty())
+                          return;
+                  write_job job = std::move(jobs.front());
+                  jobs.pop_front();
+                  busy = true;
+                  guard.unlock();
+                  bool ok = false;
+                  std::exception_ptr e;
+                  try {
+                        ok = (job.write(job.release ? job.data : &job.staging[0]) == job.np);
+                  }
+                  catch(...) {
+                        e = std::current_exception();
+                  }
+                  if(job.release)
+                          job.release(job.data);
+                  guard.lock();
+                  if(!ok)
+                          failed = 1;
+                  if(e && !exception)
+                          exception = e;
+                  pending_bytes -= job.bytes;
+                  if(!job.staging.empty() && pool.size() < MAX_POOL)
+                          pool.push_back(std::move(job.staging));
+                  busy = false;
+                  changed.notify_all();
+          }
+  }
+}
@@ -0,0 +1,56 @@
+/* This file contains the background write queue used by the asynchronous mode of the snapshot writers.
+ * It is private to the writer library.*/
+#ifndef GADGETWRITEQUEUE_H
+#define GADGETWRITEQUEUE_H
+#include "gadgetwriter.hpp"
+
+#include <deque>
+#include <vector>
+#include <functional>
+#include <exception>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+namespace GadgetWriter{
+  /** Runs queued writes on a background thread, so the caller can carry on computing.
+   * At most max_bytes of particle data is held at once; push waits for space beyond that.*/
+  class DLL_LOCAL GWriteQueue {
+         public:
+                /** Does the actual write from a buffer; should return the number of particles written*/
+                typedef std::function<int64_t(void *)> write_func;
+                GWriteQueue(size_t max_bytes);
+                /** Waits for all queued writes, then stops the thread.*/
+                ~GWriteQueue();
+                /** Queue a write of np particles, bytes long.
+                 * If release is NULL, data is copied into a staging buffer and the caller keeps it.
+                 * Otherwise the queue owns data, and calls release(data) once it is written.
+                 * @return np, or 0 if an earlier write failed. */
+                int64_t push(write_func write, void * data, size_t bytes, int64_t np, void (*release)(void *));
+                /** Wait for all queued writes to finish.
+                 * @return 0 if they all succeeded, 1 otherwise.
+                 * An exception thrown by a queued write is rethrown here.*/
+                int wait();
+         private:
+                struct write_job {
+                        write_func write;
+                        void * data;
+                        std::vector<char> staging;
+                        size_t bytes;
+                        int64_t np;
+                        void (*release)(void *);
+                };
+                void run();
+                size_t max_bytes, pending_bytes;
+                bool stopping, busy;
+                int failed;
+                std::exception_ptr exception;
+                std::deque<write_job> jobs;
+                /** Staging buffers, kept for reuse*/
+                std::vector<std::vector<char> > pool;
+                std::mutex lock;
+                std::condition_variable changed;
+                std::thread worker;
+  };
+}
+#endif
@@ -13,6 +13,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
 #include "gadgetwriter.hpp"
 #include "gadgetwritefile.hpp"
+#include "gadgetwritequeue.hpp"
 #include <stdlib.h>
 #include <iostream>
 #include <sstream>
@@ -32,6 +33,50 @@ namespace GadgetWriter{
           return npart[type];
   }
 
+  void GBaseWriteFile::add_checksum(const std::string& key, uint64_t offset, const void * data, uint64_t len)
+  {
+          crc32c_pieces * piece;
+          {
+                std::lock_guard<std::mutex> lock(sums_lock);
+                piece = &sums[key];
+          }
+          piece->add(offset, data, len);
+  }
+
+  GWriteBaseSnap::~GWriteBaseSnap()
+  {
+          StopAsync();
+  }
+
+  void GWriteBaseSnap::SetAsync(size_t max_bytes)
+  {
+          StopAsync();
+          if(max_bytes > 0)
+                  queue = new GWriteQueue(max_bytes);
+  }
+
+  int GWriteBaseSnap::Flush()
+  {
+          if(!queue)
+                  return 0;
+          return queue->wait();
+  }
+
+  void GWriteBaseSnap::StopAsync()
+  {
+          if(!queue)
+                  return;
+          try {
+                if(queue->wait())
+                        WARN("Some queued writes failed\n");
+          }
+          catch(const std::exception& e) {
+                WARN("Queued write failed: %s\n", e.what());
+          }
+          delete queue;
+          queue = NULL;
+  }
+
   bool name_compare(const block_info& i1, const std::string& name)
   {
       if(i1.name == name)
@@ -67,9 +112,9 @@ namespace GadgetWriter{
           if (hdf5)
           {
                 format=3;
-                BlockNames.push_back(block_info("Coordinates",std::valarray<bool>(true,N_TYPE),3*sizeof(float)));
-                BlockNames.push_back(block_info("Velocities",std::valarray<bool>(true,N_TYPE),3*sizeof(float)));
-                BlockNames.push_back(block_info("ParticleIDs",std::valarray<bool>(true,N_TYPE),idsize));
+                BlockNames.push_back(block_info("Coordinates",std::valarray<bool>(true,N_TYPE),3*sizeof(float),'f',3));
+                BlockNames.push_back(block_info("Velocities",std::valarray<bool>(true,N_TYPE),3*sizeof(float),'f',3));
+                BlockNames.push_back(block_info("ParticleIDs",std::valarray<bool>(true,N_TYPE),idsize,'i',1));
                 //By default MASS is given in the header (hence 0's)
                 //but the user may wish to override it.
                 BlockNames.push_back(block_info("Masses",std::valarray<bool>(false,N_TYPE),sizeof(float)));
@@ -80,9 +125,9 @@ namespace GadgetWriter{
           else
           {
                 format = 1 + format_2;
-                BlockNames.push_back(block_info("POS ",std::valarray<bool>(true,N_TYPE),3*sizeof(float)));
-                BlockNames.push_back(block_info("VEL ",std::valarray<bool>(true,N_TYPE),3*sizeof(float)));
-                BlockNames.push_back(block_info("ID  ",std::valarray<bool>(true,N_TYPE),idsize));
+                BlockNames.push_back(block_info("POS ",std::valarray<bool>(true,N_TYPE),3*sizeof(float),'f',3));
+                BlockNames.push_back(block_info("VEL ",std::valarray<bool>(true,N_TYPE),3*sizeof(float),'f',3));
+                BlockNames.push_back(block_info("ID  ",std::valarray<bool>(true,N_TYPE),idsize,'i',1));
                 //By default MASS is given in the header (hence 0's)
                 //but the user may wish to override it.
                 BlockNames.push_back(block_info("MASS",std::valarray<bool>(false,N_TYPE),sizeof(float)));
@@ -140,17 +185,15 @@ namespace GadgetWriter{
           return;
 
   }
-  int64_t GWriteSnap::WriteBlocks(std::string BlockName, int type, void *data, int64_t np_write, int64_t begin)
+  int64_t GWriteSnap::WriteBlocks(std::string BlockName, int type, void *data, int64_t np_write, int64_t begin, void (*release)(void *))
   {
-        std::vector<GBaseWriteFile *>::iterator it;
         std::vector<block_info>::iterator jt;
         short partlen=0;
-        uint32_t ret;
-        int64_t np_written=0;
-        if(type < 0 || type >= N_TYPE)
-                return 0;
-        if(np_write == 0)
+        if(type < 0 || type >= N_TYPE || np_write == 0){
+                if(release)
+                        release(data);
                 return 0;
+        }
         for(jt=BlockNames.begin();jt<BlockNames.end();++jt){
                 if((*jt).name == BlockName){
                         partlen=(*jt).partlen;
@@ -159,11 +202,31 @@ namespace GadgetWriter{
         }
         if(jt == BlockNames.end()){
                 WARN("No block %s specified in constructor\n",BlockName.c_str());
+                if(release)
+                        release(data);
                 return 0;
         }
+        if(queue){
+                std::string name(BlockName);
+                return queue->push([this, name, type, np_write, begin, partlen](void * buf) {
+                                return write_blocks(name, type, buf, np_write, begin, partlen);
+                        }, data, np_write*partlen, np_write, release);
+        }
+        int64_t np_written = write_blocks(BlockName, type, data, np_write, begin, partlen);
+        if(release)
+                release(data);
+        return np_written;
+  }
+
+  int64_t GWriteSnap::write_blocks(const std::string& BlockName, int type, void *data, int64_t np_write, int64_t begin, short partlen)
+  {
+        std::vector<GBaseWriteFile *>::iterator it;
+        uint32_t ret;
+        int64_t np_written=0;
         for(it=files.begin(); it<files.end(); ++it){
                 int64_t np_file=np_write;
-                if(begin > (**it).GetNPart(type)){
+                //Nothing to write in this file: go to the next one
+                if(begin >= (**it).GetNPart(type)){
                         begin-=(**it).GetNPart(type);
                         continue;
                 }
@@ -183,9 +246,40 @@ namespace GadgetWriter{
         return np_written;
   }
 
+  void GWriteSnap::SetChecksums(bool on)
+  {
+        checksums = on;
+        std::vector<GBaseWriteFile *>::iterator it;
+        for(it=files.begin(); it<files.end(); ++it)
+                (**it).SetChecksums(on);
+  }
+
+  bool GWriteSnap::CheckBlockType(std::string BlockName, char dtype, int size, int ncomp)
+  {
+        std::vector<block_info>::iterator jt;
+        for(jt=BlockNames.begin();jt<BlockNames.end();++jt){
+                if((*jt).name != BlockName)
+                        continue;
+                if((*jt).dtype != dtype || (*jt).ncomp != ncomp || (*jt).partlen != size*ncomp){
+                        WARN("Block %s holds %d elements of type %c%d, not %d of %c%d\n",BlockName.c_str(),(*jt).ncomp,(*jt).dtype,(*jt).partlen/std::max<int>((*jt).ncomp,1),ncomp,dtype,size);
+                        return false;
+                }
+                return true;
+        }
+        WARN("No block %s specified in constructor\n",BlockName.c_str());
+        return false;
+  }
+
   //npart, num_files and friends silently ignored
   int GWriteSnap::WriteHeaders(gadget_header head)
   {
+        std::vector<block_info>::iterator jt;
+        for(jt=BlockNames.begin();jt<BlockNames.end();++jt)
+                if((*jt).types.sum() && (*jt).dtype == 'f' && (*jt).partlen == (*jt).ncomp*(int)sizeof(double))
+                        head.flag_doubleprecision = 1;
+        //Queued block writes share the files
+        if(Flush())
+                return 1;
         head.num_files=num_files;
         for(int i=0; i< N_TYPE; ++i){
             head.NallHW[i] = ( npart[i] >> 32);
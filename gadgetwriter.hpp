@@ -44,24 +44,39 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <set>
+#include <algorithm>
+#include <type_traits>
 
 /* Include the file header structure*/
 #include "gadgetheader.h"
+#ifndef SWIG
+#include "crc32c.h"
+#endif
 
 namespace GadgetWriter{
 
   /** Public structure for passing around
    * the metadata for each block:
    * types is a bitfield containing the types that can have this block
-   * partlen is bits per particle for this block */
+   * partlen is bits per particle for this block
+   * dtype is the element type, 'f' for floating point or 'i' for integer,
+   * and ncomp the number of elements per particle, so each element is partlen/ncomp bytes.
+   * If not given, they are guessed from partlen: 8 bytes is one integer, anything else is floats.*/
   /* Put this in a map with start_pos*/
   class DLL_PUBLIC block_info {
           public:
-                block_info(std::string name, std::valarray<bool> types, short partlen): name(name),types(types), partlen(partlen)
-          {};
+                block_info(std::string name, std::valarray<bool> types, short partlen, char dtype=0, short ncomp=0): name(name),types(types), partlen(partlen), dtype(dtype), ncomp(ncomp)
+          {
+                if(!dtype)
+                    this->dtype = (partlen == sizeof(int64_t)) ? 'i' : 'f';
+                if(ncomp <= 0)
+                    this->ncomp = (this->dtype == 'i' && partlen % sizeof(int64_t) == 0) ? partlen/sizeof(int64_t) : std::max(partlen/(int)sizeof(float), 1);
+          };
                 std::string name;
                 std::valarray<bool>  types;
                 short       partlen;
+                char        dtype;
+                short       ncomp;
   };
 
   // The following are private structures that we don't want wrapped
@@ -69,7 +84,7 @@ namespace GadgetWriter{
 
     class DLL_LOCAL GBaseWriteFile {
          public:
-                GBaseWriteFile(std::string filename, std::valarray<uint32_t> npart_in): filename(filename), npart(N_TYPE)
+                GBaseWriteFile(std::string filename, std::valarray<uint32_t> npart_in): filename(filename), npart(N_TYPE), checksums(false)
                 {
                     for(int i=0; i< N_TYPE; i++)
                         npart[i] = npart_in[i];
@@ -79,14 +94,27 @@ namespace GadgetWriter{
                 /** Note npart is silently ignored.*/
                 virtual int WriteHeader(gadget_header& head) =0;
                 uint32_t GetNPart(int type);
+                /** Checksum the data written, and save the checksums when the file is closed.*/
+                void SetChecksums(bool on){
+                    checksums = on;
+                }
                 virtual ~GBaseWriteFile()=0;
          protected:
                 //The file's actual name
                 std::string filename;
                 std::valarray<uint32_t> npart; //Number of particles in this file.
+                bool checksums;
+                /** Checksums of the data written so far, by block*/
+                std::map<std::string, crc32c_pieces> sums;
+                /** Guards adding to sums*/
+                std::mutex sums_lock;
+                /** Checksum len bytes of data, written offset bytes from the start of block key. Thread-safe.*/
+                void add_checksum(const std::string& key, uint64_t offset, const void * data, uint64_t len);
   };
   #endif //SWIG
 
+  class GWriteQueue;
+
   /*Base class for snapshot sets, inherited by GWriteSnap,
    * which implements formats where we have to do the file striping ourselves,
    * (Gadget and HDF5) and GWriteBigSnap, which implements BigFile*/
@@ -94,7 +122,7 @@ namespace GadgetWriter{
           public:
                   /** Base constructor. If you want an HDF5 snapshot, pass a filename ending in .hdf5 */
                   GWriteBaseSnap(int format, std::valarray<int64_t> npart_in,int num_files=1, bool debug=true) :
-                      npart(npart_in), num_files(num_files), format(format), debug(debug)
+                      npart(npart_in), num_files(num_files), format(format), debug(debug), queue(NULL), checksums(false)
                   {}
                   virtual int WriteHeaders(gadget_header head) = 0;
                   /** Get the number of files */
@@ -105,14 +133,39 @@ namespace GadgetWriter{
                   int GetFormat(){
                       return format;
                   }
-                  virtual ~GWriteBaseSnap() {};
+                  /** Turn on asynchronous writing. WriteBlocks then queues the data and returns at once,
+                   * while a background thread writes it out. Unless the caller hands over the buffer,
+                   * data is copied into a staging buffer, so it may be reused as soon as WriteBlocks returns.
+                   * @param max_bytes At most this much data is queued; WriteBlocks waits for space beyond that.
+                   * Zero waits for queued writes and turns asynchronous writing off again. */
+                  void SetAsync(size_t max_bytes);
+                  /** Wait until every queued write has finished.
+                   * Does nothing unless SetAsync has been called.
+                   * @return 0 if all queued writes succeeded, 1 if any failed.
+                   * Exceptions from queued writes (BigFile) are rethrown here. */
+                  int Flush();
+                  /** Compute a CRC-32C checksum of each block while writing it, for checking later with GSnap::Verify.
+                   * Call before writing any blocks. Gadget files get a sidecar, <file>.crc32c, listing the checksum
+                   * of each block in the file; HDF5 datasets and BigFile blocks get a CRC32C attribute.
+                   * Checksums are saved when the snapshot is closed, and only for blocks written completely, exactly once.*/
+                  virtual void SetChecksums(bool on){
+                      checksums = on;
+                  }
+                  virtual ~GWriteBaseSnap();
           protected:
+                  /** Flush queued writes and stop the background thread, reporting but not throwing errors.
+                   * Derived destructors must call this before closing their files.*/
+                  void StopAsync();
                   /** Vector to store the maps of each simulation snapshot */
                   const std::valarray<int64_t> npart;
                   const int num_files;
                   int format;
                   /** Flag to control whether WARN prints anything */
                   bool debug;
+                  /** Background writer, if asynchronous writing is on*/
+                  GWriteQueue * queue;
+                  /** Whether blocks are checksummed*/
+                  bool checksums;
   };
 
   /** Main class for reading Gadget snapshots. */
@@ -120,17 +173,49 @@ namespace GadgetWriter{
           public:
                   /** Base constructor. If you want an HDF5 snapshot, pass a filename ending in .hdf5 */
                   GWriteSnap(std::string snap_filename, std::valarray<int64_t> npart_in,int num_files=1, int idsize=sizeof(int64_t),bool debug=true, bool format_2 = true, std::vector<block_info> *BlockNames=NULL);
-                  int64_t WriteBlocks(std::string BlockName, int type, void *data, int64_t np_write, int64_t begin);
+                  /** Write np_write particles of type, starting at particle begin of that type.
+                   * @param release If not NULL, the writer takes ownership of data, and calls release(data)
+                   * once it has been written (for example, pass free for a malloced buffer).
+                   * In asynchronous mode this avoids copying data into a staging buffer.
+                   * May be called from several threads at once, as long as each writes a different
+                   * (block, type, particle range); HDF5 writes are serialised internally.
+                   * @return number of particles written (or queued). */
+                  int64_t WriteBlocks(std::string BlockName, int type, void *data, int64_t np_write, int64_t begin, void (*release)(void *)=NULL);
+                #ifndef SWIG
+                  /** Typed WriteBlocks: checks that the block was declared with N elements of type T per particle,
+                   * then writes data as it is, in its own precision. Nothing is written on a mismatch.
+                   * For example, WriteBlocks<double,3>("POS ", type, pos, n, 0) for a block declared as
+                   * block_info("POS ", types, 3*sizeof(double), 'f', 3).*/
+                  template <class T, int N> int64_t WriteBlocks(std::string BlockName, int type, const T *data, int64_t np_write, int64_t begin, void (*release)(void *)=NULL)
+                  {
+                          static_assert(std::is_arithmetic<T>::value, "WriteBlocks needs a numeric type");
+                          if(!CheckBlockType(BlockName, std::is_integral<T>::value ? 'i' : 'f', sizeof(T), N)){
+                                  if(release)
+                                          release((void *) data);
+                                  return 0;
+                          }
+                          return WriteBlocks(BlockName, type, (void *) data, np_write, begin, release);
+                  }
+                #endif
+                  /** Check that a block was declared with ncomp elements per particle, each of type dtype ('f' or 'i') and size bytes.
+                   * Warns and returns false if not.*/
+                  bool CheckBlockType(std::string BlockName, char dtype, int size, int ncomp);
                   //npart, num_files and friends silently ignored
+                  //flag_doubleprecision is set if any block holds doubles.
+                  //Waits for any queued block writes first.
                   int WriteHeaders(gadget_header head);
+                  /** Turn checksums on or off in every file. @see GWriteBaseSnap::SetChecksums*/
+                  void SetChecksums(bool on);
                   ~GWriteSnap()
                   {
+                      StopAsync();
                       std::vector<GBaseWriteFile *>::iterator it;
                       for(it=files.begin(); it<files.end(); ++it)
                             delete *it;
                   }
 
           private:
+                  int64_t write_blocks(const std::string& BlockName, int type, void *data, int64_t np_write, int64_t begin, short partlen);
                   /** Vector to store the maps of each simulation snapshot */
                   std::vector<GBaseWriteFile *> files;
                   std::vector<block_info> BlockNames;
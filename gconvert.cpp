@@ -0,0 +1,147 @@
+/* Copyright (c) 2010, Simeon Bird <spb41@cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+/** \file
+ * Convert a Gadget snapshot to any format the writer library supports:
+ * Gadget-1, Gadget-2, HDF5 or BigFile, optionally with a different number of files.
+ * The conversion is streamed in chunks; see gadgetconvert.hpp.*/
+
+#include "gadgetreader.hpp"
+#include "gadgetwriter.hpp"
+#include "gadgetwritebigfile.hpp"
+#include "gadgetconvert.hpp"
+#include <iostream>
+#include <thread>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "type_map.h"
+
+using namespace GadgetReader;
+using namespace GadgetWriter;
+using namespace GadgetConvert;
+using namespace std;
+
+void usage()
+{
+     fprintf(stderr,"Usage: ./gconvert [-v] [-f format] [-n files] [-c particles per chunk] [-j blocks read at once] [-q chunks queued] input output\n");
+     fprintf(stderr,"format is 1 for Gadget-1, 2 for Gadget-2 (default), 3 for HDF5 and 4 for BigFile.\n");
+     fprintf(stderr,"files is the number of output files (BigFile: files per block). Default is the same as the input.\n");
+     exit(1);
+}
+
+int main(int argc, char* argv[]){
+     int verbose=0;
+     int format = 2, num_files = 0;
+     int64_t chunk_part = 1<<20;
+     int nreaders = 4, queue_len = 4;
+     int c;
+     while((c = getopt(argc, argv, "vf:n:c:j:q:h")) !=-1){
+        switch(c){
+            case 'v':
+                verbose=1;
+                break;
+            case 'f':
+                format = atoi(optarg);
+                break;
+            case 'n':
+                num_files = atoi(optarg);
+                break;
+            case 'c':
+                chunk_part = atol(optarg);
+                break;
+            case 'j':
+                nreaders = atoi(optarg);
+                break;
+            case 'q':
+                queue_len = atoi(optarg);
+                break;
+            case 'h':
+            default:
+                usage();
+        }
+     }
+     if(argc - optind != 2 || format < 1 || format > 4 || num_files < 0 || chunk_part < 1 || nreaders < 1 || queue_len < 1)
+            usage();
+#ifndef HAVE_HDF5
+     if(format == 3){
+            fprintf(stderr,"HDF5 support was not compiled in\n");
+            return 1;
+     }
+#endif
+#ifndef HAVE_BGFL
+     if(format == 4){
+            fprintf(stderr,"BigFile support was not compiled in\n");
+            return 1;
+     }
+#endif
+     string filename(argv[optind]);
+     string outfile(argv[optind+1]);
+     GSnap snap(filename);
+     if(snap.GetNumFiles() < 1){
+             cerr<<"Unable to load file. Probably does not exist"<<endl;
+             return 1;
+     }
+     if(num_files == 0)
+             num_files = snap.GetNumFiles();
+     gadget_header head=snap.GetHeader();
+     std::valarray<int64_t> npart(N_TYPE);
+     for (int i=0; i<N_TYPE; i++)
+         npart[i] = snap.GetNpart(i);
+     /*Gadget formats keep the block names; the others use the long names*/
+     init_map();
+     vector<convert_job> jobs = plan_jobs(snap, format > 2 ? &type_map : NULL);
+     vector<GadgetWriter::block_info> out_blocks = output_blocks(jobs);
+     int idsize = snap.IsBlock("ID  ") ? snap.GetPartLen("ID  ") : sizeof(int64_t);
+     try {
+#ifdef HAVE_BGFL
+        if(format == 4){
+            /*Write the files of each block in parallel*/
+            GWriteBigSnap bigsnap(outfile, npart, num_files, verbose, thread::hardware_concurrency());
+            if(bigsnap.WriteHeaders(head)){
+                cerr<<"Could not write header to "<<outfile<<endl;
+                return 1;
+            }
+            return run_pipeline(snap, jobs, [&](const convert_job& job, void * data, int64_t np, int64_t begin) {
+                        return bigsnap.WriteBlocks(job.out_name, job.type, data, np, begin, job.dtype.c_str(), job.items);
+                    }, chunk_part, nreaders, queue_len, verbose);
+        }
+#endif
+        if(format == 3 && outfile.find(".hdf5") == string::npos)
+            outfile += ".hdf5";
+        /*GWriteSnap adds POS, VEL, ID, MASS and U blocks by default.
+         * Turn off any the input does not have, so the Gadget files have no empty space*/
+        if(format < 3){
+            const char * defaults[5] = {"POS ","VEL ","ID  ","MASS","U   "};
+            for(int i=0; i<5; i++)
+                if(!snap.IsBlock(defaults[i]))
+                    out_blocks.push_back(GadgetWriter::block_info(defaults[i], std::valarray<bool>(false, N_TYPE), 4));
+        }
+        GWriteSnap outsnap(outfile, npart, num_files, idsize, verbose, format == 2, &out_blocks);
+        if(outsnap.WriteHeaders(head)){
+            cerr<<"Could not write headers to "<<outfile<<endl;
+            return 1;
+        }
+        return run_pipeline(snap, jobs, [&](const convert_job& job, void * data, int64_t np, int64_t begin) {
+                    return outsnap.WriteBlocks(job.out_name, job.type, data, np, begin);
+                }, chunk_part, nreaders, queue_len, verbose);
+     }
+     catch(const std::ios_base::failure& e) {
+         cerr<<e.what()<<endl;
+         return 1;
+     }
+     return 0;
+}
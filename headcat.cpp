@@ -0,0 +1,78 @@
+/* Copyright (c) 2010, Simeon Bird <spb41@cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+/** \file
+ * Build a catalogue of the headers of many snapshots, reading only the HEAD record of each file.
+ * The catalogue is printed as CSV, or saved in binary for GHeaderCatalogue::Read.*/
+
+#include "gadgetcatalogue.hpp"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace GadgetReader;
+using namespace std;
+
+int main(int argc, char* argv[]){
+     int nthreads = 4*thread::hardware_concurrency();
+     string csvfile, binfile, infile;
+     int c;
+     while((c = getopt(argc, argv, "j:c:b:i:h")) !=-1){
+        switch(c){
+            case 'j':
+                nthreads = atoi(optarg);
+                break;
+            case 'c':
+                csvfile = optarg;
+                break;
+            case 'b':
+                binfile = optarg;
+                break;
+            case 'i':
+                infile = optarg;
+                break;
+            case 'h':
+            default:
+                optind = argc+1;
+        }
+     }
+     if(optind > argc || (optind == argc && infile.empty())){
+            fprintf(stderr,"Usage: ./headcat [-j files read at once] [-c output.csv] [-b output.cat] [-i input.cat] snapshot...\n");
+            fprintf(stderr,"Reads the headers of the snapshots, or loads a catalogue saved with -b. CSV goes to stdout without -c or -b.\n");
+            exit(1);
+     }
+     if(nthreads < 1)
+            nthreads = 1;
+     GHeaderCatalogue cat;
+     if(!infile.empty() && cat.Read(infile)){
+             cerr<<"Could not read catalogue "<<infile<<endl;
+             return 1;
+     }
+     vector<string> snapshots(argv+optind, argv+argc);
+     int64_t bad = 0;
+     if(snapshots.size())
+            bad = cat.Build(snapshots, nthreads);
+     if(bad)
+            cerr<<bad<<" files could not be read or had inconsistent headers"<<endl;
+     if(!binfile.empty() && cat.Write(binfile))
+            return 1;
+     if(!csvfile.empty() && cat.WriteCSV(csvfile))
+            return 1;
+     if(csvfile.empty() && binfile.empty() && cat.WriteCSV("/dev/stdout"))
+            return 1;
+     return bad != 0;
+}
@@ -0,0 +1,64 @@
+/* Copyright (c) 2010, Simeon Bird <spb41@cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+/** \file
+ * Write a level of detail pyramid beside a snapshot: levels holding 1/8, 1/64, ... of the particles,
+ * each a snapshot of its own which GSnap::OpenLevel can open. See GSnap::WritePyramid.*/
+
+#include "gadgetreader.hpp"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace GadgetReader;
+using namespace std;
+
+int main(int argc, char* argv[]){
+     int levels = 3;
+     uint64_t seed = 0;
+     int c;
+     while((c = getopt(argc, argv, "l:s:h")) !=-1){
+        switch(c){
+            case 'l':
+                levels = atoi(optarg);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'h':
+            default:
+                optind = argc+1;
+        }
+     }
+     if(optind >= argc || levels < 1){
+            fprintf(stderr,"Usage: ./lodpyramid [-l levels] [-s seed] snapshot [block...]\n");
+            fprintf(stderr,"Writes snapshot.lod1, snapshot.lod2, ... holding POS and the named blocks for 1/8, 1/64, ... of the particles.\n");
+            exit(1);
+     }
+     GSnap snap(argv[optind]);
+     if(snap.GetNumFiles() < 1){
+             cerr<<"Unable to load file. Probably does not exist"<<endl;
+             return 1;
+     }
+     vector<string> blocks;
+     for(int i = optind+1; i < argc; i++){
+             string name(argv[i]);
+             /*Block names are four characters, padded with spaces*/
+             name.resize(4, ' ');
+             blocks.push_back(name);
+     }
+     return snap.WritePyramid(blocks, levels, seed);
+}
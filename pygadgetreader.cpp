@@ -0,0 +1,371 @@
+/* Copyright (c) 2010, Simeon Bird <spb41@cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+/** \file
+ * Python bindings for GadgetReader, returning NumPy arrays.
+ * Unlike the vector wrappers, blocks are read straight into a freshly allocated array
+ * of the right dtype and shape, so there is no intermediate copy. Build with "make bind".
+ *
+ * import gadgetreader
+ * snap = gadgetreader.Snapshot("snapdir/snap_001")
+ * pos = snap.get_block("POS ", type=1)          # (N,3) float32, or float64 for double precision files
+ * ids = snap.get_block("ID  ", dtype="int64")   # converted while reading
+ * views = snap.mmap_block("POS ", 1)            # read-only memory-mapped arrays, one per file */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <numpy/arrayobject.h>
+
+#include "gadgetreader.hpp"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+using namespace GadgetReader;
+
+typedef struct {
+        PyObject_HEAD
+        GSnap * snap;
+        GPageCache * cache;
+} SnapshotObject;
+
+/* Keeps a memory mapping alive for as long as an array uses it*/
+typedef struct {
+        void * addr;
+        size_t length;
+} mapping;
+
+static void unmap_capsule(PyObject * capsule)
+{
+        mapping * map = (mapping *) PyCapsule_GetPointer(capsule, NULL);
+        if(map){
+                munmap(map->addr, map->length);
+                delete map;
+        }
+}
+
+/* NumPy type number for a block, or for the dtype the caller asked for*/
+static int block_typenum(char dtype, int size)
+{
+        if(dtype == 'f')
+                return size == 8 ? NPY_FLOAT64 : NPY_FLOAT32;
+        return size == 8 ? NPY_INT64 : NPY_INT32;
+}
+
+static void Snapshot_dealloc(SnapshotObject * self)
+{
+        delete self->snap;
+        delete self->cache;
+        Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int Snapshot_init(SnapshotObject * self, PyObject * args, PyObject * kwds)
+{
+        const char * filename;
+        int debug = 0;
+        Py_ssize_t cache_bytes = 0;
+        static const char * kwlist[] = {"filename", "debug", "cache_bytes", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|pn", (char **) kwlist, &filename, &debug, &cache_bytes))
+                return -1;
+        delete self->snap;
+        delete self->cache;
+        self->cache = NULL;
+        self->snap = new GSnap(filename, debug);
+        if(self->snap->GetNumFiles() < 1){
+                PyErr_Format(PyExc_IOError, "Could not open snapshot %s", filename);
+                return -1;
+        }
+        if(cache_bytes > 0){
+                self->cache = new GPageCache(cache_bytes);
+                self->snap->SetPageCache(self->cache);
+        }
+        return 0;
+}
+
+/* Check the block exists, setting an exception if not*/
+static bool check_block(GSnap * snap, block_handle block, const char * name)
+{
+        if(!snap->IsBlock(block)){
+                PyErr_Format(PyExc_KeyError, "No block '%s' in snapshot", name);
+                return false;
+        }
+        return true;
+}
+
+static PyObject * Snapshot_get_block(SnapshotObject * self, PyObject * args, PyObject * kwds)
+{
+        const char * name;
+        int type = -1, skip_type = 0;
+        long long npart = -1, start = 0;
+        PyObject * dtype_arg = NULL;
+        static const char * kwlist[] = {"name", "type", "npart", "start", "skip_type", "dtype", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|iLLiO", (char **) kwlist, &name, &type, &npart, &start, &skip_type, &dtype_arg))
+                return NULL;
+        GSnap * snap = self->snap;
+        //Look the name up once, rather than in every call below
+        const block_handle block = GSnap::GetBlockHandle(name);
+        if(!check_block(snap, block, name))
+                return NULL;
+        if(type >= N_TYPE){
+                PyErr_Format(PyExc_ValueError, "Particle type %d out of range", type);
+                return NULL;
+        }
+        if(start < 0){
+                PyErr_Format(PyExc_ValueError, "Negative start %lld", start);
+                return NULL;
+        }
+        //A single type overrides skip_type
+        if(type >= 0)
+                skip_type = (1<<N_TYPE)-1-(1<<type);
+        const int ncomp = snap->GetBlockComponents(block);
+        if(npart < 0){
+                //Count what is in the block: a type may be missing from it even where the header has particles
+                const int types = snap->GetBlockTypes(block);
+                const short partlen = snap->GetPartLen(block);
+                npart = 0;
+                for(int j=0; j<N_TYPE; j++)
+                        if((types & (1<<j)) && !(skip_type & (1<<j)))
+                                npart += snap->GetBlockSize(block, j)/partlen;
+                npart = std::max(npart - start, 0LL);
+        }
+        //Output type: the block's own, unless the caller asked for another
+        int typenum = block_typenum(snap->GetBlockDType(block), snap->GetPartLen(block)/ncomp);
+        if(dtype_arg && dtype_arg != Py_None){
+                PyArray_Descr * descr = NULL;
+                if(!PyArray_DescrConverter(dtype_arg, &descr))
+                        return NULL;
+                typenum = descr->type_num;
+                Py_DECREF(descr);
+                if(typenum != NPY_FLOAT32 && typenum != NPY_FLOAT64 && typenum != NPY_INT32 && typenum != NPY_INT64){
+                        PyErr_SetString(PyExc_TypeError, "dtype must be float32, float64, int32 or int64");
+                        return NULL;
+                }
+        }
+        npy_intp dims[2] = {(npy_intp) npart, ncomp};
+        PyArrayObject * array = (PyArrayObject *) PyArray_SimpleNew(ncomp > 1 ? 2 : 1, dims, typenum);
+        if(!array)
+                return NULL;
+        const char out_dtype = (typenum == NPY_FLOAT32 || typenum == NPY_FLOAT64) ? 'f' : 'i';
+        const int out_size = PyArray_ITEMSIZE(array);
+        int64_t read = 0;
+        if(npart > 0){
+                void * data = PyArray_DATA(array);
+                Py_BEGIN_ALLOW_THREADS
+                read = snap->ReadBlockAs(block, data, out_dtype, out_size, ncomp, npart, start, skip_type);
+                Py_END_ALLOW_THREADS
+        }
+        if(read != npart){
+                Py_DECREF(array);
+                PyErr_Format(PyExc_IOError, "Read %lld particles of block '%s', expected %lld", (long long) read, name, npart);
+                return NULL;
+        }
+        return (PyObject *) array;
+}
+
+static PyObject * Snapshot_mmap_block(SnapshotObject * self, PyObject * args)
+{
+        const char * name;
+        int type;
+        if(!PyArg_ParseTuple(args, "si", &name, &type))
+                return NULL;
+        GSnap * snap = self->snap;
+        //Look the name up once, rather than in every call below
+        const block_handle block = GSnap::GetBlockHandle(name);
+        if(!check_block(snap, block, name))
+                return NULL;
+        if(snap->GetFormat() & 2){
+                PyErr_SetString(PyExc_ValueError, "Cannot memory-map an endian swapped snapshot; use get_block");
+                return NULL;
+        }
+        const int ncomp = snap->GetBlockComponents(block);
+        const short partlen = snap->GetPartLen(block);
+        const int typenum = block_typenum(snap->GetBlockDType(block), partlen/ncomp);
+        const long page = sysconf(_SC_PAGESIZE);
+        std::vector<block_segment> segments = snap->GetBlockSegments(block, type);
+        PyObject * list = PyList_New(0);
+        if(!list)
+                return NULL;
+        for(size_t i = 0; i < segments.size(); i++){
+                //mmap needs a page aligned offset
+                const int64_t aligned = segments[i].offset - segments[i].offset % page;
+                const size_t length = segments[i].offset - aligned + segments[i].npart*partlen;
+                std::string filename = snap->GetFileName(segments[i].file);
+                int fd = open(filename.c_str(), O_RDONLY);
+                void * addr = MAP_FAILED;
+                if(fd >= 0){
+                        addr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, aligned);
+                        close(fd);
+                }
+                if(addr == MAP_FAILED){
+                        Py_DECREF(list);
+                        PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename.c_str());
+                        return NULL;
+                }
+                mapping * map = new mapping;
+                map->addr = addr;
+                map->length = length;
+                PyObject * capsule = PyCapsule_New(map, NULL, unmap_capsule);
+                if(!capsule){
+                        munmap(addr, length);
+                        delete map;
+                        Py_DECREF(list);
+                        return NULL;
+                }
+                npy_intp dims[2] = {(npy_intp) segments[i].npart, ncomp};
+                PyObject * array = PyArray_New(&PyArray_Type, ncomp > 1 ? 2 : 1, dims, typenum, NULL,
+                                ((char *) addr) + (segments[i].offset - aligned), 0, NPY_ARRAY_CARRAY_RO, NULL);
+                //The array owns the mapping from here on
+                if(!array || PyArray_SetBaseObject((PyArrayObject *) array, capsule) < 0){
+                        Py_XDECREF(array);
+                        Py_DECREF(capsule);
+                        Py_DECREF(list);
+                        return NULL;
+                }
+                int ret = PyList_Append(list, array);
+                Py_DECREF(array);
+                if(ret < 0){
+                        Py_DECREF(list);
+                        return NULL;
+                }
+        }
+        return list;
+}
+
+static PyObject * Snapshot_get_header(SnapshotObject * self, PyObject * args)
+{
+        int i = 0;
+        if(!PyArg_ParseTuple(args, "|i", &i))
+                return NULL;
+        if(i < 0 || i >= self->snap->GetNumFiles()){
+                PyErr_Format(PyExc_IndexError, "No file %d in snapshot", i);
+                return NULL;
+        }
+        gadget_header head = self->snap->GetHeader(i);
+        PyObject * npart = PyList_New(N_TYPE);
+        PyObject * npartTotal = PyList_New(N_TYPE);
+        PyObject * NallHW = PyList_New(N_TYPE);
+        PyObject * mass = PyList_New(N_TYPE);
+        //Raw header values: some initial condition generators set NallHW wrongly, so use get_npart for totals
+        for(int j = 0; j < N_TYPE; j++){
+                PyList_SET_ITEM(npart, j, PyLong_FromUnsignedLong(head.npart[j]));
+                PyList_SET_ITEM(npartTotal, j, PyLong_FromUnsignedLong(head.npartTotal[j]));
+                PyList_SET_ITEM(NallHW, j, PyLong_FromUnsignedLong(head.NallHW[j]));
+                PyList_SET_ITEM(mass, j, PyFloat_FromDouble(head.mass[j]));
+        }
+        return Py_BuildValue("{s:N,s:N,s:N,s:N,s:d,s:d,s:i,s:d,s:d,s:d,s:d,s:d,s:i,s:i,s:i,s:i,s:i,s:i,s:d,s:d,s:d}",
+                        "npart", npart, "npartTotal", npartTotal, "NallHW", NallHW, "mass", mass,
+                        "time", head.time, "redshift", head.redshift, "num_files", head.num_files,
+                        "BoxSize", head.BoxSize, "Omega0", head.Omega0, "OmegaLambda", head.OmegaLambda,
+                        "OmegaB", head.OmegaB, "HubbleParam", head.HubbleParam,
+                        "flag_sfr", head.flag_sfr, "flag_feedback", head.flag_feedback, "flag_cooling", head.flag_cooling,
+                        "flag_stellarage", head.flag_stellarage, "flag_metals", head.flag_metals,
+                        "flag_doubleprecision", head.flag_doubleprecision,
+                        "UnitLength_in_cm", head.UnitLength_in_cm, "UnitMass_in_g", head.UnitMass_in_g,
+                        "UnitVelocity_in_cm_per_s", head.UnitVelocity_in_cm_per_s);
+}
+
+static PyObject * Snapshot_get_npart(SnapshotObject * self, PyObject * args)
+{
+        int type;
+        if(!PyArg_ParseTuple(args, "i", &type))
+                return NULL;
+        return PyLong_FromLongLong(self->snap->GetNpart(type));
+}
+
+static PyObject * Snapshot_get_blocks(SnapshotObject * self, PyObject * Py_UNUSED(ignored))
+{
+        std::set<std::string> blocks = self->snap->GetBlocks();
+        PyObject * list = PyList_New(0);
+        if(!list)
+                return NULL;
+        for(std::set<std::string>::iterator it = blocks.begin(); it != blocks.end(); ++it){
+                PyObject * str = PyUnicode_FromString(it->c_str());
+                if(!str || PyList_Append(list, str) < 0){
+                        Py_XDECREF(str);
+                        Py_DECREF(list);
+                        return NULL;
+                }
+                Py_DECREF(str);
+        }
+        return list;
+}
+
+static PyObject * Snapshot_cache_stats(SnapshotObject * self, PyObject * Py_UNUSED(ignored))
+{
+        if(!self->cache)
+                return Py_BuildValue("{s:L,s:L,s:n}", "hits", 0LL, "misses", 0LL, "bytes", (Py_ssize_t) 0);
+        return Py_BuildValue("{s:L,s:L,s:n}", "hits", (long long) self->cache->GetHits(),
+                        "misses", (long long) self->cache->GetMisses(), "bytes", (Py_ssize_t) self->cache->GetCachedBytes());
+}
+
+static PyMethodDef Snapshot_methods[] = {
+        {"get_block", (PyCFunction)(void(*)(void)) Snapshot_get_block, METH_VARARGS | METH_KEYWORDS,
+         "get_block(name, type=-1, npart=-1, start=0, skip_type=0, dtype=None)\n"
+         "Read a block into a new array of shape (N,) or (N, components).\n"
+         "type selects a single particle type; otherwise skip_type is as for GSnap::GetBlock.\n"
+         "npart=-1 reads all selected particles. dtype defaults to the type on disc."},
+        {"mmap_block", (PyCFunction) Snapshot_mmap_block, METH_VARARGS,
+         "mmap_block(name, type)\n"
+         "Memory-map the particles of one type in a block, without reading them.\n"
+         "Returns a list of read-only arrays, one for each file containing the type."},
+        {"get_header", (PyCFunction) Snapshot_get_header, METH_VARARGS,
+         "get_header(i=0)\nThe header of file i, as a dict of its raw values."},
+        {"get_npart", (PyCFunction) Snapshot_get_npart, METH_VARARGS,
+         "get_npart(type)\nTotal number of particles of a type."},
+        {"get_blocks", (PyCFunction) Snapshot_get_blocks, METH_NOARGS,
+         "get_blocks()\nNames of all blocks in the snapshot."},
+        {"cache_stats", (PyCFunction) Snapshot_cache_stats, METH_NOARGS,
+         "cache_stats()\nHits, misses and cached bytes of the page cache, enabled by passing cache_bytes to Snapshot."},
+        {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject SnapshotType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+};
+
+static PyModuleDef gadgetreader_module = {
+        PyModuleDef_HEAD_INIT,
+        "gadgetreader",
+        "Read Gadget snapshots into NumPy arrays.",
+        -1,
+        NULL,
+};
+
+PyMODINIT_FUNC PyInit_gadgetreader(void)
+{
+        import_array();
+        SnapshotType.tp_name = "gadgetreader.Snapshot";
+        SnapshotType.tp_doc = "Snapshot(filename, debug=False, cache_bytes=0)\nA Gadget snapshot, possibly split over several files.\ncache_bytes > 0 serves small reads from a page cache of that size.";
+        SnapshotType.tp_basicsize = sizeof(SnapshotObject);
+        SnapshotType.tp_flags = Py_TPFLAGS_DEFAULT;
+        SnapshotType.tp_new = PyType_GenericNew;
+        SnapshotType.tp_init = (initproc) Snapshot_init;
+        SnapshotType.tp_dealloc = (destructor) Snapshot_dealloc;
+        SnapshotType.tp_methods = Snapshot_methods;
+        if(PyType_Ready(&SnapshotType) < 0)
+                return NULL;
+        PyObject * module = PyModule_Create(&gadgetreader_module);
+        if(!module)
+                return NULL;
+        Py_INCREF(&SnapshotType);
+        if(PyModule_AddObject(module, "Snapshot", (PyObject *) &SnapshotType) < 0){
+                Py_DECREF(&SnapshotType);
+                Py_DECREF(module);
+                return NULL;
+        }
+        PyModule_AddIntConstant(module, "N_TYPE", N_TYPE);
+        return module;
+}
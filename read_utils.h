@@ -15,8 +15,16 @@
 #define __READ_UTILS_H
 
 #include <stdint.h>
+#include <stdio.h>
 /** \file 
- * Contains routines to swap the enddianness of data. */
+ * Contains routines to swap the enddianness of data, and the reader's warning macro. */
+
+/** Print a warning to stderr if the variable debug, which must be in scope, is true*/
+#define WARN(...) do{ \
+        if(debug){ \
+                fprintf(stderr,"[GadgetReader]: "); \
+                fprintf(stderr, __VA_ARGS__); \
+        }}while(0)
 
 #ifdef __cplusplus
 extern "C"{
@@ -54,14 +62,14 @@ inline uint64_t endian_swap_64(uint64_t* x)
 /** Swap the endianness of a range of integers
  * @param start Pointer to memory to start at.
  * @param range Range to swap, in bytes.*/
-uint32_t * multi_endian_swap(uint32_t * start,uint32_t range){
+inline uint32_t * multi_endian_swap(uint32_t * start,uint32_t range){
         uint32_t* cur=start;
         while(cur < start+range)
           endian_swap(cur++);
         return cur;
 }
 
-uint64_t * multi_endian_swap64(uint64_t * start,uint64_t range){
+inline uint64_t * multi_endian_swap64(uint64_t * start,uint64_t range){
         uint64_t* cur=start;
         while(cur < start+range)
           endian_swap_64(cur++);
@@ -0,0 +1,318 @@
+/* Copyright (c) 2010, Simeon Bird <spb41@cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+/** \file
+ * Re-split a Gadget snapshot into a different number of files.
+ * Only the headers and record markers are rewritten: particle data is copied
+ * straight from the input files in chunks, or with copy_file_range if the
+ * data does not need endian swapping. Each output file is written by its own thread.*/
+
+#include "gadgetreader.hpp"
+#include "read_utils.h"
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace GadgetReader;
+using namespace std;
+
+/* Everything the writers need to know about an input block*/
+struct reshard_block {
+        string name;
+        int types;
+        short partlen;
+        /* Size of one element, for endian swapping */
+        int itemsize;
+        vector<block_segment> segments[N_TYPE];
+};
+
+/* Copies particle data from the input files to one output file */
+class ShardWriter {
+        public:
+                ShardWriter(GSnap& snap, const string& outname, size_t chunk_bytes, bool swap_endian): snap(snap), outname(outname), chunk_bytes(chunk_bytes), swap_endian(swap_endian), out(-1), out_pos(0)
+                {}
+                ~ShardWriter()
+                {
+                        map<int, int>::iterator it;
+                        for(it = inputs.begin(); it != inputs.end(); ++it)
+                                close(it->second);
+                        if(out >= 0)
+                                close(out);
+                }
+                int write_file(gadget_header& head, const vector<reshard_block>& blocks, const int64_t first[N_TYPE], bool format_2);
+        private:
+                GSnap& snap;
+                string outname;
+                size_t chunk_bytes;
+                bool swap_endian;
+                int out;
+                int64_t out_pos;
+                /* Open input files, by file number*/
+                map<int, int> inputs;
+                vector<char> buffer;
+                int write_bytes(const void * data, size_t len);
+                int write_record(const char * name, uint32_t len, bool format_2);
+                int copy_bytes(int file, int64_t offset, int64_t len, int itemsize);
+                int copy_particles(const reshard_block& block, int type, int64_t first, int64_t npart);
+};
+
+int ShardWriter::write_bytes(const void * data, size_t len)
+{
+        const char * cdata = (const char *) data;
+        while(len > 0){
+                ssize_t ret = pwrite(out, cdata, len, out_pos);
+                if(ret <= 0){
+                        fprintf(stderr, "Could not write to %s: %s\n", outname.c_str(), strerror(errno));
+                        return 1;
+                }
+                cdata += ret;
+                len -= ret;
+                out_pos += ret;
+        }
+        return 0;
+}
+
+/* Write the record markers before a block: the block name record for format 2 files, then the length*/
+int ShardWriter::write_record(const char * name, uint32_t len, bool format_2)
+{
+        if(format_2){
+                uint32_t head[5];
+                head[0] = 8;
+                memcpy(&head[1], name, 4);
+                head[2] = len + 2*sizeof(uint32_t);
+                head[3] = 8;
+                head[4] = len;
+                return write_bytes(head, sizeof(head));
+        }
+        return write_bytes(&len, sizeof(len));
+}
+
+/* Copy len bytes from offset in input file to the end of the output*/
+int ShardWriter::copy_bytes(int file, int64_t offset, int64_t len, int itemsize)
+{
+        if(!inputs.count(file)){
+                int in = open(snap.GetFileName(file).c_str(), O_RDONLY);
+                if(in < 0){
+                        fprintf(stderr, "Could not open %s: %s\n", snap.GetFileName(file).c_str(), strerror(errno));
+                        return 1;
+                }
+                inputs[file] = in;
+        }
+        int in = inputs[file];
+#ifdef __linux__
+        /*Let the kernel do the copy if we can*/
+        while(!swap_endian && len > 0){
+                loff_t in_off = offset, out_off = out_pos;
+                ssize_t ret = copy_file_range(in, &in_off, out, &out_off, len, 0);
+                if(ret <= 0)
+                        break; //Not supported here; fall back to read and write
+                offset += ret;
+                out_pos += ret;
+                len -= ret;
+        }
+#endif
+        while(len > 0){
+                /*Keep chunks a whole number of elements, for swapping*/
+                size_t chunk = min((int64_t) (chunk_bytes - chunk_bytes % itemsize), len);
+                buffer.resize(chunk);
+                ssize_t ret = pread(in, &buffer[0], chunk, offset);
+                if(ret != (ssize_t) chunk){
+                        fprintf(stderr, "Could not read %lu bytes from %s at %ld\n", chunk, snap.GetFileName(file).c_str(), offset);
+                        return 1;
+                }
+                if(swap_endian){
+                        if(itemsize == 8)
+                                multi_endian_swap64((uint64_t *) &buffer[0], chunk/8);
+                        else
+                                multi_endian_swap((uint32_t *) &buffer[0], chunk/4);
+                }
+                if(write_bytes(&buffer[0], chunk))
+                        return 1;
+                offset += chunk;
+                len -= chunk;
+        }
+        return 0;
+}
+
+/* Copy particles [first, first+npart) of a type in a block, which may span several input files*/
+int ShardWriter::copy_particles(const reshard_block& block, int type, int64_t first, int64_t npart)
+{
+        const vector<block_segment>& segs = block.segments[type];
+        for(size_t i = 0; i < segs.size() && npart > 0; i++){
+                if(first >= segs[i].npart){
+                        first -= segs[i].npart;
+                        continue;
+                }
+                int64_t ncopy = min(npart, segs[i].npart - first);
+                if(copy_bytes(segs[i].file, segs[i].offset + first*block.partlen, ncopy*block.partlen, block.itemsize))
+                        return 1;
+                npart -= ncopy;
+                first = 0;
+        }
+        if(npart > 0){
+                fprintf(stderr, "Ran out of particles of type %d in block %s\n", type, block.name.c_str());
+                return 1;
+        }
+        return 0;
+}
+
+int ShardWriter::write_file(gadget_header& head, const vector<reshard_block>& blocks, const int64_t first[N_TYPE], bool format_2)
+{
+        out = open(outname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(out < 0){
+                fprintf(stderr, "Could not open %s for writing: %s\n", outname.c_str(), strerror(errno));
+                return 1;
+        }
+        uint32_t headlen = sizeof(gadget_header);
+        if(write_record("HEAD", headlen, format_2) || write_bytes(&head, headlen) || write_bytes(&headlen, sizeof(headlen)))
+                return 1;
+        for(size_t b = 0; b < blocks.size(); b++){
+                int64_t npart = 0;
+                for(int t = 0; t < N_TYPE; t++)
+                        if(blocks[b].types & (1<<t))
+                                npart += head.npart[t];
+                /*Format 2 files can omit empty blocks; format 1 files need them to keep the order*/
+                if(npart == 0 && format_2)
+                        continue;
+                uint32_t len = npart*blocks[b].partlen;
+                if(write_record(blocks[b].name.c_str(), len, format_2))
+                        return 1;
+                for(int t = 0; t < N_TYPE; t++)
+                        if((blocks[b].types & (1<<t)) && head.npart[t] > 0)
+                                if(copy_particles(blocks[b], t, first[t], head.npart[t]))
+                                        return 1;
+                if(write_bytes(&len, sizeof(len)))
+                        return 1;
+        }
+        return 0;
+}
+
+/* Order of two blocks in the input: the first file containing them, then position in that file*/
+bool block_before(const reshard_block& a, const reshard_block& b)
+{
+        int64_t pa[2] = {INT32_MAX, INT64_MAX}, pb[2] = {INT32_MAX, INT64_MAX};
+        for(int t = 0; t < N_TYPE; t++){
+                if(a.segments[t].size() && (a.segments[t][0].file < pa[0] || (a.segments[t][0].file == pa[0] && a.segments[t][0].offset < pa[1]))){
+                        pa[0] = a.segments[t][0].file;
+                        pa[1] = a.segments[t][0].offset;
+                }
+                if(b.segments[t].size() && (b.segments[t][0].file < pb[0] || (b.segments[t][0].file == pb[0] && b.segments[t][0].offset < pb[1]))){
+                        pb[0] = b.segments[t][0].file;
+                        pb[1] = b.segments[t][0].offset;
+                }
+        }
+        return pa[0] < pb[0] || (pa[0] == pb[0] && pa[1] < pb[1]);
+}
+
+int main(int argc, char* argv[]){
+     int num_files = 0, nthreads = thread::hardware_concurrency();
+     size_t chunk_bytes = 64<<20;
+     int c;
+     while((c = getopt(argc, argv, "n:j:c:h")) !=-1){
+        switch(c){
+            case 'n':
+                num_files = atoi(optarg);
+                break;
+            case 'j':
+                nthreads = atoi(optarg);
+                break;
+            case 'c':
+                chunk_bytes = atol(optarg);
+                break;
+            case 'h':
+            default:
+                optind = argc;
+        }
+     }
+     if(argc - optind != 2 || num_files < 1 || chunk_bytes < 8){
+            fprintf(stderr,"Usage: ./reshard -n output files [-j files written at once] [-c bytes per chunk] input output\n");
+            exit(1);
+     }
+     if(nthreads < 1)
+            nthreads = 1;
+     string filename(argv[optind]);
+     string outfile(argv[optind+1]);
+     GSnap snap(filename);
+     if(snap.GetNumFiles() < 1){
+             cerr<<"Unable to load file. Probably does not exist"<<endl;
+             return 1;
+     }
+     bool format_2 = !(snap.GetFormat() & 1);
+     bool swap_endian = snap.GetFormat() & 2;
+     /*Find where everything is in the input*/
+     set<string> names = snap.GetBlocks();
+     vector<reshard_block> blocks;
+     for(set<string>::iterator it = names.begin(); it != names.end(); ++it){
+             reshard_block block;
+             block.name = *it;
+             block.types = snap.GetBlockTypes(*it);
+             block.partlen = snap.GetPartLen(*it);
+             //Swapped element by element, as in GetBlock
+             block.itemsize = block.partlen/snap.GetBlockComponents(*it);
+             if(block.itemsize != 8)
+                     block.itemsize = 4;
+             for(int t = 0; t < N_TYPE; t++)
+                     if(block.types & (1<<t))
+                             block.segments[t] = snap.GetBlockSegments(*it, t);
+             blocks.push_back(block);
+     }
+     sort(blocks.begin(), blocks.end(), block_before);
+     /*Plan the output: split each type evenly, with any extra in the last file*/
+     int64_t npart[N_TYPE];
+     gadget_header head = snap.GetHeader();
+     head.num_files = num_files;
+     for(int t = 0; t < N_TYPE; t++){
+             npart[t] = snap.GetNpart(t, true);
+             head.NallHW[t] = npart[t] >> 32;
+             head.npartTotal[t] = npart[t] - ((uint64_t) head.NallHW[t] << 32);
+     }
+     vector<gadget_header> heads(num_files, head);
+     vector<vector<int64_t> > first(num_files, vector<int64_t>(N_TYPE));
+     for(int i = 0; i < num_files; i++)
+             for(int t = 0; t < N_TYPE; t++){
+                     first[i][t] = i*(npart[t]/num_files);
+                     heads[i].npart[t] = npart[t]/num_files + (i == num_files-1 ? npart[t] % num_files : 0);
+             }
+     /*Write the files*/
+     atomic<int> next_file(0), failed(0);
+     vector<thread> workers;
+     for(int j = 0; j < min(nthreads, num_files); j++)
+             workers.push_back(thread([&]{
+                 int i;
+                 while((i = next_file++) < num_files){
+                         string name = outfile;
+                         if(num_files > 1){
+                                 ostringstream s;
+                                 s<<"."<<i;
+                                 name += s.str();
+                         }
+                         ShardWriter writer(snap, name, chunk_bytes, swap_endian);
+                         if(writer.write_file(heads[i], blocks, &first[i][0], format_2))
+                                 failed++;
+                 }
+             }));
+     for(size_t j = 0; j < workers.size(); j++)
+             workers[j].join();
+     return failed > 0;
+}
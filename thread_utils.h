@@ -0,0 +1,71 @@
+/* Copyright (c) 2010, Simeon Bird <spb41@cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+#ifndef __THREAD_UTILS_H
+#define __THREAD_UTILS_H
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+/** \file
+ * Contains small helpers for passing data between threads. */
+
+/** A first-in first-out queue with a maximum length.
+ * push() waits while the queue is full and pop() waits while it is empty,
+ * so a producer can never get more than max_len items ahead of a consumer.
+ * After close(), push() fails and pop() returns what is left, then fails. */
+template <class T> class BoundedQueue {
+        public:
+                BoundedQueue(size_t max_len): max_len(max_len > 0 ? max_len : 1), closed(false)
+                {}
+                /** Add an item, waiting for space. Returns false if the queue was closed. */
+                bool push(T&& item)
+                {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        not_full.wait(lock, [this]{ return closed || items.size() < max_len; });
+                        if(closed)
+                                return false;
+                        items.push_back(std::move(item));
+                        not_empty.notify_one();
+                        return true;
+                }
+                /** Remove an item, waiting for one to arrive.
+                 * Returns false if the queue is closed and empty. */
+                bool pop(T& item)
+                {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        not_empty.wait(lock, [this]{ return closed || !items.empty(); });
+                        if(items.empty())
+                                return false;
+                        item = std::move(items.front());
+                        items.pop_front();
+                        not_full.notify_one();
+                        return true;
+                }
+                /** Stop accepting new items and wake everyone up. */
+                void close()
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        closed = true;
+                        not_full.notify_all();
+                        not_empty.notify_all();
+                }
+        private:
+                size_t max_len;
+                bool closed;
+                std::deque<T> items;
+                std::mutex mutex;
+                std::condition_variable not_full, not_empty;
+};
+
+#endif //__THREAD_UTILS_H